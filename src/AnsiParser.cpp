@@ -0,0 +1,358 @@
+#include <AnsiParser.hpp>
+#include <Console.hpp>
+
+/*
+  ANSI/VT escape sequence parser for the consoles
+
+  Copyright (C) 2018 Arthur M
+*/
+
+using namespace annos;
+
+enum AnsiState : uint8_t {
+    StGround,    // Plain text
+    StEscape,    // After the ESC
+    StCSI,       // Reading the CSI parameters
+    StCSIIgnore, // A CSI we don't support. Skip until its end
+    StCount,
+};
+
+// Character classes
+enum AnsiClass : uint8_t {
+    ClText,    // Printable text and the other control characters
+    ClEsc,     // ESC
+    ClCancel,  // CAN and SUB abort a sequence
+    ClBracket, // '['
+    ClDigit,
+    ClSep,     // ';'
+    ClPrivate, // '<', '=', '>' and '?'
+    ClInter,   // Intermediate bytes, 0x20 to 0x2f
+    ClFinal,   // Final bytes, 0x40 to 0x7e
+    ClCount,
+};
+
+enum AnsiAction : uint8_t {
+    AcNone,
+    AcPrint,
+    AcClear,       // Start a new sequence
+    AcParam,       // Add a digit to the current parameter
+    AcNextParam,
+    AcPrivate,
+    AcDispatch,    // Execute the CSI sequence
+    AcEscDispatch, // Execute an ESC sequence without CSI
+};
+
+struct AnsiTransition {
+    AnsiAction action;
+    AnsiState next;
+};
+
+static constexpr AnsiClass ClassOf(unsigned c)
+{
+    return (c == 0x1b) ? ClEsc :
+	(c == 0x18 || c == 0x1a) ? ClCancel :
+	(c == '[') ? ClBracket :
+	(c >= '0' && c <= '9') ? ClDigit :
+	(c == ';') ? ClSep :
+	(c >= 0x3c && c <= 0x3f) ? ClPrivate :
+	(c >= 0x20 && c <= 0x2f) ? ClInter :
+	(c >= 0x40 && c <= 0x7e) ? ClFinal :
+	ClText;
+}
+
+/* What each character does in each state, indexed [state][class]
+   Ground only sees the ESC here: the text before it is written in bulk */
+static const AnsiTransition transitions[StCount][ClCount] = {
+    // Text, Esc, Cancel, Bracket, Digit, Sep, Private, Inter, Final
+    { // StGround
+	{AcPrint, StGround}, {AcNone, StEscape}, {AcPrint, StGround},
+	{AcPrint, StGround}, {AcPrint, StGround}, {AcPrint, StGround},
+	{AcPrint, StGround}, {AcPrint, StGround}, {AcPrint, StGround},
+    },
+    { // StEscape
+	{AcNone, StGround}, {AcNone, StEscape}, {AcNone, StGround},
+	{AcClear, StCSI}, {AcEscDispatch, StGround}, {AcEscDispatch, StGround},
+	{AcEscDispatch, StGround}, {AcNone, StEscape},
+	{AcEscDispatch, StGround},
+    },
+    { // StCSI. Control characters inside a sequence are ignored
+	{AcNone, StCSI}, {AcNone, StEscape}, {AcNone, StGround},
+	{AcDispatch, StGround}, {AcParam, StCSI}, {AcNextParam, StCSI},
+	{AcPrivate, StCSI}, {AcNone, StCSIIgnore}, {AcDispatch, StGround},
+    },
+    { // StCSIIgnore
+	{AcNone, StCSIIgnore}, {AcNone, StEscape}, {AcNone, StGround},
+	{AcNone, StGround}, {AcNone, StCSIIgnore}, {AcNone, StCSIIgnore},
+	{AcNone, StCSIIgnore}, {AcNone, StCSIIgnore}, {AcNone, StGround},
+    },
+};
+
+// The ANSI color numbers, in VGA color indexes
+static const uint8_t ansi_to_vga[8] = {
+    Black, Red, Green, Brown, Blue, Magenta, Cyan, LightGrey
+};
+
+/**
+ * The nearest of the 16 VGA colors to an RGB color
+ */
+uint8_t annos::AnsiNearestVGA(uint8_t r, uint8_t g, uint8_t b)
+{
+    // Each channel is off, dim (0xaa) or, with the intensity bit, bright
+    unsigned max = (r > g) ? ((r > b) ? r : b) : ((g > b) ? g : b);
+    if (max < 0x40)
+	return Black;
+
+    unsigned half = max / 2;
+    unsigned color = ((r > half) ? 0x4 : 0) | ((g > half) ? 0x2 : 0) |
+	((b > half) ? 0x1 : 0);
+
+    if (max > 0xc0)
+	color |= 0x8;
+
+    // 'Dark yellow' is brown in the VGA palette, and bright black is grey
+    return color;
+}
+
+/**
+ * Read a color given as 5;n or 2;r;g;b, starting at the
+ * parameter 'i'
+ *
+ * @return the index of the last parameter used
+ */
+unsigned AnsiParser::ReadExtendedColor(unsigned i, AnsiColor& c)
+{
+    if (i + 1 >= _param_count)
+	return i;
+
+    if (_params[i+1] == 5 && i + 2 < _param_count) {
+	unsigned n = _params[i+2];
+
+	if (n < 16) {
+	    c = {.type = AnsiColorIndex,
+		 .index = (uint8_t)(ansi_to_vga[n & 7] | (n & 8)),
+		 .r = 0, .g = 0, .b = 0};
+	} else if (n < 232) {
+	    // The 6x6x6 color cube
+	    static const uint8_t levels[6] = {0, 95, 135, 175, 215, 255};
+	    n -= 16;
+	    c = {.type = AnsiColorRGB, .index = 0, .r = levels[n / 36],
+		 .g = levels[(n / 6) % 6], .b = levels[n % 6]};
+	} else if (n < 256) {
+	    uint8_t gray = 8 + (n - 232) * 10;
+	    c = {.type = AnsiColorRGB, .index = 0, .r = gray, .g = gray,
+		 .b = gray};
+	}
+
+	return i + 2;
+    }
+
+    if (_params[i+1] == 2 && i + 4 < _param_count) {
+	c = {.type = AnsiColorRGB, .index = 0, .r = (uint8_t)_params[i+2],
+	     .g = (uint8_t)_params[i+3], .b = (uint8_t)_params[i+4]};
+	return i + 4;
+    }
+
+    return i + 1;
+}
+
+/**
+ * Execute a 'Select Graphic Rendition' (ESC [ ... m)
+ */
+void AnsiParser::SelectGraphics(IAnsiTarget* t)
+{
+    // No parameters means a reset
+    if (_param_count == 0)
+	_params[_param_count++] = 0;
+
+    for (unsigned i = 0; i < _param_count; i++) {
+	unsigned p = _params[i];
+
+	if (p == 0) {
+	    _attr = {};
+	} else if (p == 1) {
+	    _attr.bold = true;
+	} else if (p == 22) {
+	    _attr.bold = false;
+	} else if (p >= 30 && p <= 37) {
+	    _attr.fg = {.type = AnsiColorIndex, .index = ansi_to_vga[p - 30],
+			.r = 0, .g = 0, .b = 0};
+	} else if (p == 38) {
+	    i = this->ReadExtendedColor(i, _attr.fg);
+	} else if (p == 39) {
+	    _attr.fg.type = AnsiColorDefault;
+	} else if (p >= 40 && p <= 47) {
+	    _attr.bg = {.type = AnsiColorIndex, .index = ansi_to_vga[p - 40],
+			.r = 0, .g = 0, .b = 0};
+	} else if (p == 48) {
+	    i = this->ReadExtendedColor(i, _attr.bg);
+	} else if (p == 49) {
+	    _attr.bg.type = AnsiColorDefault;
+	} else if (p >= 90 && p <= 97) {
+	    _attr.fg = {.type = AnsiColorIndex,
+			.index = (uint8_t)(ansi_to_vga[p - 90] | 0x8),
+			.r = 0, .g = 0, .b = 0};
+	} else if (p >= 100 && p <= 107) {
+	    _attr.bg = {.type = AnsiColorIndex,
+			.index = (uint8_t)(ansi_to_vga[p - 100] | 0x8),
+			.r = 0, .g = 0, .b = 0};
+	}
+    }
+
+    t->AnsiAttributes(_attr);
+}
+
+/**
+ * Execute the CSI sequence ending with 'final'
+ */
+void AnsiParser::Dispatch(IAnsiTarget* t, char final)
+{
+    if (_private)
+	return;
+
+    // Most commands take a count that defaults to 1
+    unsigned n = (_param_count > 0 && _params[0] > 0) ? _params[0] : 1;
+    unsigned x, y;
+
+    switch (final) {
+    case 'm':
+	this->SelectGraphics(t);
+	break;
+
+    case 'A': // Up
+	t->AnsiGetCursor(x, y);
+	t->AnsiSetCursor(x, (y > n) ? y - n : 0);
+	break;
+
+    case 'B': // Down
+	t->AnsiGetCursor(x, y);
+	t->AnsiSetCursor(x, y + n);
+	break;
+
+    case 'C': // Forward
+	t->AnsiGetCursor(x, y);
+	t->AnsiSetCursor(x + n, y);
+	break;
+
+    case 'D': // Back
+	t->AnsiGetCursor(x, y);
+	t->AnsiSetCursor((x > n) ? x - n : 0, y);
+	break;
+
+    case 'G': // Column
+	t->AnsiGetCursor(x, y);
+	t->AnsiSetCursor(n - 1, y);
+	break;
+
+    case 'H': // Position, 1-based row;column
+    case 'f': {
+	unsigned col = (_param_count > 1 && _params[1] > 0) ? _params[1] : 1;
+	t->AnsiSetCursor(col - 1, n - 1);
+	break;
+    }
+
+    case 'J':
+	t->AnsiEraseScreen((_param_count > 0 && _params[0] <= 2) ?
+			   (AnsiErase)_params[0] : AnsiEraseToEnd);
+	break;
+
+    case 'K':
+	t->AnsiEraseLine((_param_count > 0 && _params[0] <= 2) ?
+			 (AnsiErase)_params[0] : AnsiEraseToEnd);
+	break;
+    }
+}
+
+/**
+ * Parse 'len' bytes of 'str', and drive 't' with them
+ */
+void AnsiParser::Feed(IAnsiTarget* t, const char* str, size_t len)
+{
+    const char* end = str + len;
+
+    while (str < end) {
+	if (_state == StGround) {
+	    // Give all the text until the next escape at once
+	    const char* span = str;
+	    while (str < end && *str != '\033')
+		str++;
+
+	    if (str > span)
+		t->AnsiText(span, str - span);
+
+	    if (str == end)
+		break;
+	}
+
+	uint8_t c = *str++;
+	const AnsiTransition& tr = transitions[_state][ClassOf(c)];
+
+	switch (tr.action) {
+	case AcNone:
+	    break;
+
+	case AcPrint:
+	    t->AnsiText((const char*)&c, 1);
+	    break;
+
+	case AcClear:
+	    _param_count = 0;
+	    _private = false;
+	    break;
+
+	case AcParam:
+	    if (_param_count == 0)
+		_params[_param_count++] = 0;
+
+	    if (_param_count <= ANSI_MAX_PARAMS) {
+		unsigned v = _params[_param_count-1] * 10 + (c - '0');
+		_params[_param_count-1] = (v > 9999) ? 9999 : v;
+	    }
+	    break;
+
+	case AcNextParam:
+	    if (_param_count == 0)
+		_params[_param_count++] = 0;
+
+	    // Past the limit, the parameters are dropped
+	    if (_param_count < ANSI_MAX_PARAMS)
+		_params[_param_count] = 0;
+	    if (_param_count <= ANSI_MAX_PARAMS)
+		_param_count++;
+	    break;
+
+	case AcPrivate:
+	    _private = true;
+	    break;
+
+	case AcDispatch:
+	    if (_param_count > ANSI_MAX_PARAMS)
+		_param_count = ANSI_MAX_PARAMS;
+	    this->Dispatch(t, c);
+	    break;
+
+	case AcEscDispatch:
+	    // ESC c resets the terminal
+	    if (c == 'c') {
+		_attr = {};
+		t->AnsiAttributes(_attr);
+		t->AnsiEraseScreen(AnsiEraseAll);
+		t->AnsiSetCursor(0, 0);
+	    }
+	    break;
+	}
+
+	_state = tr.next;
+    }
+}
+
+/**
+ * Parse a null-terminated string
+ */
+void AnsiParser::Feed(IAnsiTarget* t, const char* str)
+{
+    size_t len = 0;
+    while (str[len])
+	len++;
+
+    this->Feed(t, str, len);
+}
@@ -1,5 +1,5 @@
 #include <DebugConsole.hpp>
-#include <arch/x86/IO.hpp>
+#include <libk/stdio.h>
 
 using namespace annos;
 using namespace annos::x86;
@@ -7,57 +7,28 @@ using namespace annos::x86;
 /*
   Kernel serial logging console driver
 
-  Outputs logging information to COM1 at 9600 baud, for ease retrieval of
-  logger information
-
-  TODO: When the *real* serial port driver starts, make this console driver
-  use it, instead of its own thing
+  Outputs logging information to COM1 at 115200 baud, for ease retrieval
+  of logger information. The UART driver does the real work
 
   Copyright (C) 2018 Arthur M
 */
 
+// The UART rings. Static, because the console lives in the boot stack
+static uint8_t serial_tx_ring[4096];
+static uint8_t serial_rx_ring[256];
+
 void SerialLogConsole::WriteString(const char* str)
 {
-    while (*str != '\0') {
-	this->WriteChar(*str);
-	str++;
-    }
+    _uart.Write(str, strlen(str));
 }
 
-/* Check if the line is empty before we transmit
-   If is, then go
-*/    
-void SerialLogConsole::WriteChar(char c)
-{
-    volatile unsigned int timeout=0;
-    while ( (in8(this->portno+5) & 0x20) == 0 ) {
-	if ((timeout++) > 0xfffff0) {
-	    return;
-	}
-    }
-
-    out8(this->portno, (uint8_t)c);
-}
-	
-
 /* Do a basic setup of the serial ports */
 SerialLogConsole::SerialLogConsole()
+    : _uart(0x3f8, 115200, serial_tx_ring, sizeof(serial_tx_ring),
+	    serial_rx_ring, sizeof(serial_rx_ring))
 {
-    out8(this->portno+1, 0); // no interrupts
-
-    // 115200 Hz is the clock the UART runs
-    const uint16_t divisor = 115200 / this->baud;
-    
-    // Open divisor latch, by setting the bit 7, to set the baud rate
-    out8(this->portno+3, 0x80);
-    out8(this->portno+0, divisor & 0xff);
-    out8(this->portno+1, divisor >> 8);
-    out8(this->portno+3, 0x3); // 8 bits, no parity, 1 stop bit (8N1)
+    _uart.Initialize();
 
-    /* Clear the transmit and receive FIFOs, set FIFO threshold to 8 bytes
-       and enable it
-    */
-    out8(this->portno+2, 0x87);
     this->WriteString("\n\n \033[1m-[annOS]-\033[0m \n");
     this->WriteString("Serial log console started: "
 		      "\033[38;5;74m115200\033[0m baud, "
@@ -82,11 +53,17 @@ void SerialLogConsole::WriteVGA(const char* str, BaseColors color)
 	this->WriteString("\033[0m");
 }
 	
-/* Write function for RGB-compatible output */
+/* Write function for RGB-compatible output
+   Uses the 24-bit color ANSI escape */
 void SerialLogConsole::WriteRGB(const char* str,
 		      uint8_t r, uint8_t g, uint8_t b)
 {
-    this->WriteVGA(str);
+    char esc[24];
+    snprintf(esc, sizeof(esc), "\033[38;2;%d;%d;%dm", r, g, b);
+
+    this->WriteString(esc);
+    this->WriteString(str);
+    this->WriteString("\033[0m");
 }
 
 
@@ -0,0 +1,186 @@
+#include <DeviceInit.hpp>
+#include <Timer.hpp>
+#include <Log.hpp>
+#include <libk/panic.h>
+
+/**
+ * Asynchronous device initialization
+ *
+ * Copyright (C) 2018 Arthur M
+ */
+
+using namespace annos;
+
+DeviceInitTask* DeviceInit::_tasks = NULL;
+DeviceInitPhase DeviceInit::_phase = DevInitRegistering;
+
+/**
+ * Only run this task after 't' finishes
+ * Must be called before the task is added.
+ */
+void DeviceInitTask::DependsOn(DeviceInitTask* t)
+{
+    if (dep_count >= MAX_DEVINIT_DEPS)
+	panic("too many device init dependencies");
+
+    deps[dep_count++] = t;
+}
+
+static bool IsReady(DeviceInitTask* t)
+{
+    for (unsigned i = 0; i < t->dep_count; i++) {
+	if (!t->deps[i]->IsFinished())
+	    return false;
+    }
+
+    return true;
+}
+
+/**
+ * Queue the waiting tasks whose dependencies are finished
+ * Before the background phase, only the required ones.
+ */
+void DeviceInit::QueueReady()
+{
+    if (_phase == DevInitRegistering)
+	return;
+
+    for (DeviceInitTask* t = _tasks; t; t = t->next) {
+	if (t->state != DevInitWaiting)
+	    continue;
+
+	if (!t->required && _phase != DevInitBackground)
+	    continue;
+
+	if (!IsReady(t))
+	    continue;
+
+	t->state = DevInitQueued;
+	WorkQueue::Queue(&t->work);
+    }
+}
+
+void DeviceInit::RunTask(WorkItem* w, void* data)
+{
+    (void)w;
+    auto t = (DeviceInitTask*)data;
+
+    t->start_ns = Timer::GetNs();
+
+    if (t->dev->Detect()) {
+	t->dev->Initialize();
+	if (t->done)
+	    t->done(t, t->data);
+
+	t->state = DevInitDone;
+    } else {
+	t->state = DevInitNotFound;
+    }
+
+    t->end_ns = Timer::GetNs();
+
+    LOG(Info, "devinit", "%s %s in %d us", t->dev->GetTag(),
+	(t->state == DevInitDone) ? "initialized" : "not found",
+	(uint32_t)((t->end_ns - t->start_ns) / 1000));
+
+    DeviceInit::QueueReady();
+
+    // Show the summary once the last task finishes
+    for (DeviceInitTask* o = _tasks; o; o = o->next) {
+	if (!o->IsFinished())
+	    return;
+    }
+
+    DeviceInit::Report();
+}
+
+/**
+ * Add a task
+ * It's only queued by WaitRequired(), or right away if that
+ * already ran.
+ */
+void DeviceInit::Add(DeviceInitTask* t)
+{
+    t->work = WorkItem(&DeviceInit::RunTask, t);
+    t->state = DevInitWaiting;
+
+    // Keep the insertion order, so tasks start in the order they're added
+    t->next = NULL;
+    DeviceInitTask** pt = &_tasks;
+    while (*pt)
+	pt = &(*pt)->next;
+    *pt = t;
+
+    DeviceInit::QueueReady();
+}
+
+/**
+ * Run the deferred work until 't' finishes
+ * Waiting for a background task starts the background phase.
+ */
+void DeviceInit::WaitFor(DeviceInitTask* t)
+{
+    if (!t->required && _phase != DevInitBackground) {
+	_phase = DevInitBackground;
+	DeviceInit::QueueReady();
+    }
+
+    while (!t->IsFinished()) {
+	if (!WorkQueue::RunOne())
+	    WorkQueue::WaitForWork();
+    }
+}
+
+/**
+ * Run the required tasks, and the deferred work, until they
+ * finish. Then queue the other tasks, to run in the idle loop
+ */
+void DeviceInit::WaitRequired()
+{
+    // A required task also needs its dependencies
+    for (bool changed = true; changed; ) {
+	changed = false;
+
+	for (DeviceInitTask* t = _tasks; t; t = t->next) {
+	    if (!t->required)
+		continue;
+
+	    for (unsigned i = 0; i < t->dep_count; i++) {
+		if (!t->deps[i]->required) {
+		    t->deps[i]->required = true;
+		    changed = true;
+		}
+	    }
+	}
+    }
+
+    if (_phase == DevInitRegistering) {
+	_phase = DevInitRequired;
+	DeviceInit::QueueReady();
+    }
+
+    for (DeviceInitTask* t = _tasks; t; t = t->next) {
+	if (t->required)
+	    DeviceInit::WaitFor(t);
+    }
+
+    _phase = DevInitBackground;
+    DeviceInit::QueueReady();
+}
+
+/**
+ * Log how long each finished task took
+ */
+void DeviceInit::Report()
+{
+    for (DeviceInitTask* t = _tasks; t; t = t->next) {
+	if (!t->IsFinished()) {
+	    LOG(Info, "devinit", "%s: pending", t->dev->GetTag());
+	    continue;
+	}
+
+	LOG(Info, "devinit", "%s: %d us, %s", t->dev->GetTag(),
+	    (uint32_t)((t->end_ns - t->start_ns) / 1000),
+	    t->required ? "required" : "background");
+    }
+}
@@ -0,0 +1,434 @@
+#include <FramebufferConsole.hpp>
+#include <arch/x86/VMM.hpp>
+#include <libk/stdlib.h>
+
+/*
+   Console implementation on linear framebuffers
+
+   Copyright (C) 2018 Arthur M
+ */
+
+using namespace annos;
+using annos::x86::VMM;
+using annos::x86::VMMFlags;
+
+/* The 8 pixel masks of each glyph byte, all ones where the pixel is
+   set. Drawing a pixel is (fg & mask) | (bg & ~mask) */
+static uint32_t fb_expand[256][8];
+static bool fb_expand_ready = false;
+
+// The VGA text mode palette
+static const uint8_t vga_rgb[16][3] = {
+    {0x00, 0x00, 0x00}, {0x00, 0x00, 0xaa}, {0x00, 0xaa, 0x00},
+    {0x00, 0xaa, 0xaa}, {0xaa, 0x00, 0x00}, {0xaa, 0x00, 0xaa},
+    {0xaa, 0x55, 0x00}, {0xaa, 0xaa, 0xaa}, {0x55, 0x55, 0x55},
+    {0x55, 0x55, 0xff}, {0x55, 0xff, 0x55}, {0x55, 0xff, 0xff},
+    {0xff, 0x55, 0x55}, {0xff, 0x55, 0xff}, {0xff, 0xff, 0x55},
+    {0xff, 0xff, 0xff},
+};
+
+uint32_t FramebufferConsole::MakePixel(uint8_t r, uint8_t g, uint8_t b)
+{
+    return ((uint32_t)(r >> (8 - _info.red_size)) << _info.red_pos) |
+	((uint32_t)(g >> (8 - _info.green_size)) << _info.green_pos) |
+	((uint32_t)(b >> (8 - _info.blue_size)) << _info.blue_pos);
+}
+
+/**
+ * Map the framebuffer and allocate the cells
+ *
+ * @return false if we can't use this framebuffer
+ */
+bool FramebufferConsole::Init(const FBInfo& info, const FBFont* font)
+{
+    if (info.bpp != 32 || (info.phys >> 32) || !font)
+	return false;
+
+    if (info.red_size > 8 || info.green_size > 8 || info.blue_size > 8)
+	return false;
+
+    _info = info;
+    _font = font;
+    _pitch = info.pitch / 4;
+
+    _cols = info.width / font->width;
+    _rows = info.height / font->height;
+    if (_cols > FB_MAX_COLS) _cols = FB_MAX_COLS;
+    if (_rows > FB_MAX_ROWS) _rows = FB_MAX_ROWS;
+    if (_cols == 0 || _rows == 0)
+	return false;
+
+    uintptr_t phys = (uintptr_t)info.phys;
+    size_t len = (phys & 0xfff) + size_t(info.pitch) * info.height;
+    size_t pages = (len + VMM_PAGE_SIZE - 1) / VMM_PAGE_SIZE;
+    uintptr_t virt = VMM::MapMMIO(phys & ~0xfff, pages,
+				  VMMFlags::ReadWrite | VMMFlags::WriteCombining);
+    _fb = (volatile uint32_t*)(virt + (phys & 0xfff));
+
+    size_t cellpages = (_cols * _rows * sizeof(FBCell) + VMM_PAGE_SIZE - 1) /
+	VMM_PAGE_SIZE;
+    _cells = (FBCell*)VMM::AllocateVirtual(cellpages);
+    _shown = (FBCell*)VMM::AllocateVirtual(cellpages);
+
+    if (!fb_expand_ready) {
+	for (unsigned b = 0; b < 256; b++)
+	    for (unsigned p = 0; p < 8; p++)
+		fb_expand[b][p] = (b & (0x80 >> p)) ? 0xffffffff : 0;
+
+	fb_expand_ready = true;
+    }
+
+    for (unsigned i = 0; i < 16; i++)
+	_palette[i] = this->MakePixel(vga_rgb[i][0], vga_rgb[i][1],
+				      vga_rgb[i][2]);
+
+    this->Clear();
+    return true;
+}
+
+/**
+ * Read a PSF (version 1 or 2) font from memory
+ * The glyphs are copied, so 'data' can go away.
+ *
+ * @return true if it's a valid font
+ */
+bool FramebufferConsole::LoadPSF(const void* data, size_t len, FBFont& font)
+{
+    auto b = (const uint8_t*)data;
+    size_t offset, glyphsize;
+
+    if (len >= 4 && b[0] == 0x36 && b[1] == 0x04) {
+	// PSF 1: 8 pixels wide, 256 or 512 glyphs
+	font.width = 8;
+	font.height = b[3];
+	font.count = (b[2] & 0x1) ? 512 : 256;
+	font.row_bytes = 1;
+	offset = 4;
+	glyphsize = b[3];
+    } else if (len >= 32 && *(const uint32_t*)b == 0x864ab572) {
+	auto h = (const uint32_t*)b;
+	offset = h[2];
+	font.count = h[4];
+	glyphsize = h[5];
+	font.height = h[6];
+	font.width = h[7];
+	font.row_bytes = (font.width + 7) / 8;
+
+	if (glyphsize != font.row_bytes * font.height)
+	    return false;
+    } else {
+	return false;
+    }
+
+    font.first = 0;
+
+    if (font.width == 0 || font.height == 0 || font.width > 32 ||
+	offset + glyphsize * font.count > len)
+	return false;
+
+    // Only the first 256 glyphs matter, we don't do unicode
+    if (font.count > 256)
+	font.count = 256;
+
+    size_t size = glyphsize * font.count;
+    auto glyphs = (uint8_t*)VMM::AllocateVirtual(
+	(size + VMM_PAGE_SIZE - 1) / VMM_PAGE_SIZE);
+    memcpy(glyphs, b + offset, size);
+    font.glyphs = glyphs;
+    return true;
+}
+
+FBCell* FramebufferConsole::CellRow(unsigned y)
+{
+    return &_cells[((_top + y) % _rows) * _cols];
+}
+
+void FramebufferConsole::MarkDirty(unsigned x, unsigned y)
+{
+    if (_dirty_start[y] >= _dirty_end[y]) {
+	_dirty_start[y] = x;
+	_dirty_end[y] = x + 1;
+	return;
+    }
+
+    if (x < _dirty_start[y])
+	_dirty_start[y] = x;
+    if (x >= _dirty_end[y])
+	_dirty_end[y] = x + 1;
+}
+
+/**
+ * Draw the cell at column 'x' and row 'y'
+ */
+void FramebufferConsole::DrawCell(unsigned x, unsigned y, const FBCell* cell)
+{
+    const FBFont* f = _font;
+    unsigned ch = cell->ch;
+    if (ch < f->first || ch >= f->first + f->count)
+	ch = (f->first <= '?' && '?' < f->first + f->count) ? '?' : f->first;
+
+    const uint8_t* glyph = &f->glyphs[(ch - f->first) * f->height *
+				      f->row_bytes];
+    volatile uint32_t* line = &_fb[(y * f->height) * _pitch + x * f->width];
+    uint32_t fg = cell->fg, bg = cell->bg;
+
+    for (unsigned row = 0; row < f->height; row++) {
+	volatile uint32_t* px = line;
+	unsigned left = f->width;
+
+	for (unsigned byte = 0; byte < f->row_bytes; byte++) {
+	    const uint32_t* mask = fb_expand[glyph[byte]];
+	    unsigned n = (left < 8) ? left : 8;
+
+	    for (unsigned p = 0; p < n; p++)
+		px[p] = (fg & mask[p]) | (bg & ~mask[p]);
+
+	    px += n;
+	    left -= n;
+	}
+
+	glyph += f->row_bytes;
+	line += _pitch;
+    }
+}
+
+/**
+ * Draw the cursor, as an underline in the foreground color
+ */
+void FramebufferConsole::DrawCursor()
+{
+    const FBFont* f = _font;
+    uint32_t fg = this->CellRow(_yPos)[_xPos].fg;
+
+    for (unsigned row = f->height - 2; row < f->height; row++) {
+	volatile uint32_t* px = &_fb[(_yPos * f->height + row) * _pitch +
+				     _xPos * f->width];
+	for (unsigned p = 0; p < f->width; p++)
+	    px[p] = fg;
+    }
+
+    _cursor_x = _xPos;
+    _cursor_y = _yPos;
+}
+
+/**
+ * Draw the dirty spans and the cursor
+ */
+void FramebufferConsole::Flush()
+{
+    // Erase the old cursor
+    this->MarkDirty(_cursor_x, _cursor_y);
+
+    for (unsigned y = 0; y < _rows; y++) {
+	if (_dirty_start[y] >= _dirty_end[y])
+	    continue;
+
+	FBCell* row = this->CellRow(y);
+	FBCell* shown = &_shown[y * _cols];
+	for (unsigned x = _dirty_start[y]; x < _dirty_end[y]; x++) {
+	    // The cursor is drawn over its cell, so always redraw it
+	    bool cursor = (x == _cursor_x && y == _cursor_y);
+	    if (!cursor && row[x].ch == shown[x].ch &&
+		row[x].fg == shown[x].fg && row[x].bg == shown[x].bg)
+		continue;
+
+	    this->DrawCell(x, y, &row[x]);
+	    shown[x] = row[x];
+	}
+
+	_dirty_start[y] = _dirty_end[y] = 0;
+    }
+
+    this->DrawCursor();
+}
+
+// Scrolls the console up
+void FramebufferConsole::Scroll()
+{
+    _top = (_top + 1) % _rows;
+
+    FBCell* bottom = this->CellRow(_rows - 1);
+    for (unsigned x = 0; x < _cols; x++)
+	bottom[x] = {.fg = _palette[LightGrey], .bg = _palette[Black],
+		     .ch = ' '};
+
+    /* Everything moved, so the whole screen is dirty. Flush() only draws
+       the cells that differ from the ones on the screen, so the blank
+       parts of the rows cost nothing */
+    for (unsigned y = 0; y < _rows; y++) {
+	_dirty_start[y] = 0;
+	_dirty_end[y] = _cols;
+    }
+}
+
+void FramebufferConsole::PutChar(char c, uint32_t fg, uint32_t bg)
+{
+    if (c == '\n') {
+	_xPos = 0;
+	_yPos++;
+    } else if (c == '\t') {
+	_xPos = (_xPos + 4) & ~3;
+	if (_xPos > _cols) {
+	    _xPos = 0;
+	    _yPos++;
+	}
+    } else {
+	FBCell* cell = &this->CellRow(_yPos)[_xPos];
+	cell->fg = fg;
+	cell->bg = bg;
+	cell->ch = (uint8_t)c;
+	this->MarkDirty(_xPos, _yPos);
+	_xPos++;
+    }
+
+    if (_xPos >= _cols) {
+	_xPos = 0;
+	_yPos++;
+    }
+
+    if (_yPos >= _rows) {
+	this->Scroll();
+	_yPos = _rows - 1;
+    }
+}
+
+uint32_t FramebufferConsole::AnsiPixel(const AnsiColor& c, bool bold)
+{
+    if (c.type == AnsiColorRGB)
+	return this->MakePixel(c.r, c.g, c.b);
+
+    return _palette[(c.index | (bold ? 8 : 0)) & 0xf];
+}
+
+/**
+ * Get the colors from the ANSI attributes and the write color
+ */
+void FramebufferConsole::UpdateColor(const AnsiAttr& attr)
+{
+    if (attr.fg.type != AnsiColorDefault)
+	_fg = this->AnsiPixel(attr.fg, attr.bold);
+    else if (attr.bold && _write_fgbase >= 0)
+	_fg = _palette[_write_fgbase | 8];
+    else
+	_fg = _write_fg;
+
+    if (attr.bg.type != AnsiColorDefault)
+	_bg = this->AnsiPixel(attr.bg, false);
+    else
+	_bg = _palette[Black];
+}
+
+void FramebufferConsole::AnsiText(const char* str, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+	this->PutChar(str[i], _fg, _bg);
+}
+
+void FramebufferConsole::AnsiAttributes(const AnsiAttr& attr)
+{
+    this->UpdateColor(attr);
+}
+
+void FramebufferConsole::AnsiGetCursor(unsigned& x, unsigned& y)
+{
+    x = _xPos;
+    y = _yPos;
+}
+
+void FramebufferConsole::AnsiSetCursor(unsigned x, unsigned y)
+{
+    _xPos = (x < _cols) ? x : _cols - 1;
+    _yPos = (y < _rows) ? y : _rows - 1;
+}
+
+// Clear 'count' cells from column 'x' of row 'y'
+void FramebufferConsole::EraseCells(unsigned x, unsigned y, unsigned count)
+{
+    if (count == 0)
+	return;
+
+    // Erased cells keep the current background
+    FBCell* row = this->CellRow(y);
+    for (unsigned i = x; i < x + count; i++)
+	row[i] = {.fg = _fg, .bg = _bg, .ch = ' '};
+
+    this->MarkDirty(x, y);
+    this->MarkDirty(x + count - 1, y);
+}
+
+void FramebufferConsole::AnsiEraseLine(AnsiErase mode)
+{
+    switch (mode) {
+    case AnsiEraseToEnd:
+	this->EraseCells(_xPos, _yPos, _cols - _xPos);
+	break;
+    case AnsiEraseToStart:
+	this->EraseCells(0, _yPos, _xPos + 1);
+	break;
+    case AnsiEraseAll:
+	this->EraseCells(0, _yPos, _cols);
+	break;
+    }
+}
+
+void FramebufferConsole::AnsiEraseScreen(AnsiErase mode)
+{
+    this->AnsiEraseLine(mode);
+
+    unsigned first = (mode == AnsiEraseToEnd) ? _yPos + 1 : 0;
+    unsigned last = (mode == AnsiEraseToStart) ? _yPos : _rows;
+    for (unsigned y = first; y < last; y++) {
+	if (y != _yPos)
+	    this->EraseCells(0, y, _cols);
+    }
+}
+
+/**
+ * Write 'str', with 'fg' as the default foreground
+ */
+void FramebufferConsole::Write(const char* str, uint32_t fg, int fgbase)
+{
+    _write_fg = fg;
+    _write_fgbase = fgbase;
+    this->UpdateColor(_ansi.GetAttributes());
+
+    _ansi.Feed(this, str);
+    this->Flush();
+}
+
+/* Write function for VGA-compatible output */
+void FramebufferConsole::WriteVGA(const char* str, BaseColors color)
+{
+    this->Write(str, _palette[color & 0xf], color & 0xf);
+}
+
+/* Write function for RGB-compatible output */
+void FramebufferConsole::WriteRGB(const char* str, uint8_t r, uint8_t g,
+				  uint8_t b)
+{
+    this->Write(str, this->MakePixel(r, g, b), -1);
+}
+
+/* Clears the screen */
+void FramebufferConsole::Clear()
+{
+    for (unsigned i = 0; i < _cols * _rows; i++) {
+	_cells[i] = {.fg = _palette[LightGrey], .bg = _palette[Black],
+		     .ch = ' '};
+	_shown[i] = _cells[i];
+    }
+
+    _top = 0;
+    _xPos = _yPos = 0;
+    _cursor_x = _cursor_y = 0;
+
+    // Also clear the margins the text grid doesn't cover
+    for (unsigned y = 0; y < _info.height; y++)
+	for (unsigned x = 0; x < _info.width; x++)
+	    _fb[y * _pitch + x] = _palette[Black];
+
+    for (unsigned y = 0; y < _rows; y++)
+	_dirty_start[y] = _dirty_end[y] = 0;
+
+    this->DrawCursor();
+}
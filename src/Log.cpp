@@ -1,5 +1,8 @@
 #include <Log.hpp>
+#include <arch/x86/TSC.hpp>
+#include <arch/x86/InterruptGuard.hpp>
 #include <libk/stdio.h>
+#include <libk/stdlib.h>
 #include <stdarg.h>
 
 /*
@@ -9,9 +12,33 @@
 */
 
 using namespace annos;
+using annos::x86::TSC;
+using annos::x86::InterruptGuard;
+
+/* The drainer hands the packed arguments to vsnprintf as a va_list.
+   This only works where a va_list is a plain pointer to the arguments
+   in the stack, like in i386 */
+static_assert(sizeof(va_list) == sizeof(void*),
+	      "the log records need a pointer-sized va_list");
 
 Console* Log::_cons = NULL;
 
+uint8_t Log::_ring[LOG_RING_SIZE];
+volatile uint32_t Log::_head = 0;
+volatile uint32_t Log::_tail = 0;
+volatile uint32_t Log::_dropped = 0;
+volatile uint32_t Log::_draining = 0;
+WorkItem Log::_drain_work(&Log::DrainWork);
+
+volatile uint8_t Log::_default_level = Debug;
+LogTagRule Log::_rules[LOG_MAX_TAG_RULES];
+unsigned Log::_rule_count = 0;
+volatile uint32_t Log::_generation = 1;
+LogTagCache Log::_tag_cache[LOG_TAG_CACHE_SIZE];
+
+// Longer log lines are truncated when drained
+#define LOG_LINE_MAX 512
+
 static void PrintLogLevel(Console* c, LogLevel l)
 {
     switch(l) {
@@ -24,33 +51,340 @@ static void PrintLogLevel(Console* c, LogLevel l)
     }
 }
 
+/**
+ * Compare the tag 'tag' with the first 'len' bytes of 'name'
+ */
+static bool TagEquals(const char* tag, const char* name, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+	if (tag[i] != name[i] || !tag[i])
+	    return false;
+    }
+
+    return (tag[len] == '\0');
+}
+
+/**
+ * Find the level of 'tag' in the rules, and cache it
+ */
+LogLevel Log::LookupLevel(const char* tag)
+{
+    uint32_t gen = _generation;
+    uint8_t level = _default_level;
+
+    for (unsigned i = 0; i < _rule_count; i++) {
+	if (TagEquals(tag, _rules[i].tag, strlen(_rules[i].tag))) {
+	    level = _rules[i].level;
+	    break;
+	}
+    }
+
+    auto& c = _tag_cache[((uintptr_t)tag >> 2) & (LOG_TAG_CACHE_SIZE-1)];
+    c.tag = tag;
+    c.level = level;
+    c.generation = gen;
+    return (LogLevel)level;
+}
+
+/**
+ * Set the minimum level of the messages of 'tag'
+ * A NULL tag sets the level of all tags without their own level
+ *
+ * @return false if there's no space for another tag
+ */
+bool Log::SetLevel(const char* tag, LogLevel l)
+{
+    if (!tag) {
+	_default_level = l;
+	__sync_fetch_and_add(&_generation, 1);
+	return true;
+    }
+
+    size_t len = strlen(tag);
+    if (len >= LOG_MAX_TAG_NAME)
+	len = LOG_MAX_TAG_NAME - 1;
+
+    LogTagRule* r = NULL;
+    for (unsigned i = 0; i < _rule_count; i++) {
+	if (TagEquals(_rules[i].tag, tag, len)) {
+	    r = &_rules[i];
+	    break;
+	}
+    }
+
+    if (!r) {
+	if (_rule_count >= LOG_MAX_TAG_RULES)
+	    return false;
+
+	r = &_rules[_rule_count];
+	memcpy(r->tag, tag, len);
+	r->tag[len] = '\0';
+	_rule_count++;
+    }
+
+    r->level = l;
+    __sync_fetch_and_add(&_generation, 1);
+    return true;
+}
+
+/**
+ * Parse a level name or number
+ *
+ * @return the level, or -1 if it's not valid
+ */
+static int ParseLevel(const char* s, size_t len)
+{
+    static const char* names[] = {
+	"debug", "notice", "info", "warning", "error", "fatal"
+    };
+
+    if (len == 1 && s[0] >= '0' && s[0] <= '5')
+	return s[0] - '0';
+
+    for (unsigned i = 0; i < sizeof(names)/sizeof(names[0]); i++) {
+	if (TagEquals(names[i], s, len))
+	    return i;
+    }
+
+    return -1;
+}
+
+/**
+ * Parse the log options of the kernel command line
+ *
+ *  loglevel=<level>     sets the default level
+ *  log.<tag>=<level>    sets the level of a tag
+ *
+ * The level can be a name (debug, notice, info, warning, error,
+ * fatal) or its number.
+ */
+void Log::ParseCommandLine(const char* cmdline)
+{
+    if (!cmdline)
+	return;
+
+    const char* p = cmdline;
+    while (*p) {
+	while (*p == ' ')
+	    p++;
+
+	const char* opt = p;
+	while (*p && *p != ' ')
+	    p++;
+
+	size_t optlen = p - opt;
+	const char* eq = opt;
+	while (eq < p && *eq != '=')
+	    eq++;
+
+	if (eq == p)
+	    continue;
+
+	int level = ParseLevel(eq + 1, p - eq - 1);
+
+	if (optlen > 9 && !memcmp(opt, "loglevel=", 9)) {
+	    if (level < 0) {
+		LOG(Warning, "log", "invalid log level in '%.*s'",
+		    (int)optlen, opt);
+		continue;
+	    }
+
+	    Log::SetLevel(NULL, (LogLevel)level);
+	} else if (optlen > 4 && !memcmp(opt, "log.", 4)) {
+	    char tag[LOG_MAX_TAG_NAME];
+	    size_t taglen = eq - opt - 4;
+	    if (level < 0 || taglen == 0 || taglen >= sizeof(tag)) {
+		LOG(Warning, "log", "invalid log option in '%.*s'",
+		    (int)optlen, opt);
+		continue;
+	    }
+
+	    memcpy(tag, opt + 4, taglen);
+	    tag[taglen] = '\0';
+	    if (!Log::SetLevel(tag, (LogLevel)level))
+		LOG(Warning, "log", "too many log tag levels, "
+		    "ignoring '%s'", tag);
+	}
+    }
+}
+
 void Log::Init(Console* c)
 {
     Log::_cons = c;
+
+    // Show what was logged before we had a console
+    WorkQueue::Queue(&_drain_work);
+}
+
+/**
+ * Reserve 'size' bytes in the ring
+ *
+ * @return the record, or NULL if there's no space
+ */
+LogRecord* Log::Reserve(size_t size)
+{
+    for (;;) {
+	uint32_t head = _head;
+	uint32_t off = head & (LOG_RING_SIZE - 1);
+
+	// Records are contiguous. If it doesn't fit in the end, skip it
+	uint32_t pad = (off + size > LOG_RING_SIZE) ? LOG_RING_SIZE - off : 0;
+
+	if (head + pad + size - _tail > LOG_RING_SIZE)
+	    return NULL;
+
+	if (!__sync_bool_compare_and_swap(&_head, head, head + pad + size))
+	    continue;
+
+	if (pad) {
+	    auto p = (LogRecord*)&_ring[off];
+	    p->size = pad;
+	    // A flush from an IRQ must never see the state without the size
+	    asm volatile("" ::: "memory");
+	    p->state = LogRecordPadding;
+	    off = 0;
+	}
+
+	return (LogRecord*)&_ring[off];
+    }
+}
+
+/**
+ * Reserve a record with 'datasize' bytes of arguments, and fill
+ * its header
+ *
+ * @return the record, or NULL if the ring is full
+ */
+LogRecord* Log::Begin(LogLevel l, const char* tag, const char* fmt,
+		      size_t datasize)
+{
+    size_t size = (sizeof(LogRecord) + datasize + 3) & ~3;
+    LogRecord* r = Log::Reserve(size);
+    if (!r) {
+	__sync_fetch_and_add(&_dropped, 1);
+	return NULL;
+    }
+
+    r->size = size;
+    r->level = l;
+    r->tag = tag;
+    r->fmt = fmt;
+    r->tsc = TSC::Read();
+    return r;
 }
 
-void Log::Write(LogLevel l, const char* tag, const char* fmt, ...)
+/**
+ * Mark the record as complete, and schedule the drain
+ */
+void Log::Commit(LogRecord* r)
 {
-    PrintLogLevel(Log::_cons, l);
+    __sync_synchronize();
+    r->state = LogRecordCommitted;
 
-    char fstr[strlen(tag) + strlen(fmt) + 256];
-    
-    va_list vl;
-    va_start(vl, fmt);
-    vsprintf(fstr, fmt, vl);
-    va_end(vl);
+    /* Nobody will drain the ring after a fatal error. Flush with
+       interrupts disabled, so the UART writes it out before returning */
+    if (r->level >= LogLevel::Fatal) {
+	InterruptGuard g;
+	Log::Flush();
+    } else
+	WorkQueue::Queue(&_drain_work);
+}
+
+/**
+ * Write the committed records to the console
+ * Stops at the first record not committed yet.
+ */
+void Log::Drain()
+{
+    if (!_cons)
+	return;
+
+    uint32_t dropped = __sync_lock_test_and_set(&_dropped, 0);
+    if (dropped) {
+	char msg[64];
+	snprintf(msg, sizeof(msg), "log: %d messages dropped, ring full\n",
+		 dropped);
+	_cons->WriteVGA(msg, BaseColors::Yellow);
+    }
+
+    for (;;) {
+	uint32_t tail = _tail;
+	if (tail == _head)
+	    break;
+
+	auto r = (LogRecord*)&_ring[tail & (LOG_RING_SIZE - 1)];
+	uint8_t state = r->state;
+
+	if (state == LogRecordReserved)
+	    break;
+
+	uint16_t size = r->size;
+
+	if (state == LogRecordCommitted) {
+	    auto l = (LogLevel)r->level;
 
-    char str[strlen(fstr) + strlen(tag) + 8] = "\033[1m";
-    strcat(str, tag);
-    strcat(str, "\033[0m: ");
-    strcat(str, fstr);
-    strcat(str, "\n");
+	    char msg[LOG_LINE_MAX];
+	    va_list vl = (va_list)(r + 1);
+	    vsnprintf(msg, sizeof(msg), r->fmt, vl);
 
-    Log::_cons->WriteVGA(str);
+	    if (TSC::IsCalibrated()) {
+		char ts[24];
+		uint64_t us = TSC::CyclesToNs(r->tsc) / 1000;
+		snprintf(ts, sizeof(ts), "[%5d.%06d] ",
+			 (uint32_t)(us / 1000000), (uint32_t)(us % 1000000));
+		_cons->WriteVGA(ts);
+	    }
 
-    if (l >= LogLevel::Fatal)
-	kputs("A fatal error occurred: \n"); // You should panic on fatals
-    else if (l >= LogLevel::Warning)
-	kputs(str); // if > warning, print to the screen too
+	    PrintLogLevel(_cons, l);
+	    _cons->WriteVGA("\033[1m");
+	    _cons->WriteVGA(r->tag);
+	    _cons->WriteVGA("\033[0m: ");
+	    _cons->WriteVGA(msg);
+	    _cons->WriteVGA("\n");
+
+	    if (l >= LogLevel::Fatal) {
+		kputs("A fatal error occurred: \n"); // You should panic on fatals
+	    } else if (l >= LogLevel::Warning) {
+		// if > warning, print to the screen too
+		kprintf("\033[1m%s\033[0m: %s\n", r->tag, msg);
+	    }
+	}
+
+	/* Give the space back only after we're done with it. Zero it, so
+	   free space always reads as a record still being written.
+	   A flush that interrupted us might have given it back already,
+	   and a new record might be there now; leave it alone then */
+	InterruptGuard g;
+	if (_tail == tail) {
+	    memset(r, 0, size);
+	    __sync_synchronize();
+	    __sync_bool_compare_and_swap(&_tail, tail, tail + size);
+	}
+    }
+}
+
+void Log::DrainWork(WorkItem* w, void* data)
+{
+    (void)w;
+    (void)data;
+
+    if (__sync_lock_test_and_set(&_draining, 1))
+	return;
+
+    Log::Drain();
+    __sync_lock_release(&_draining);
 }
 
+/**
+ * Write all committed records now
+ * Used when we can't trust the work queue to run anymore, like on
+ * a panic.
+ */
+void Log::Flush()
+{
+    /* If we interrupted the drainer, take over anyway. The worst that
+       can happen is a message printed twice */
+    __sync_lock_test_and_set(&_draining, 1);
+    Log::Drain();
+    __sync_lock_release(&_draining);
+}
@@ -2,6 +2,11 @@
 #include <stdint.h>
 #include <Log.hpp>
 #include <arch/x86/IO.hpp>
+#include <arch/x86/IRQHandler.hpp>
+#include <arch/x86/VMM.hpp>
+#include <arch/x86/ACPI.hpp>
+#include <arch/x86/InterruptGuard.hpp>
+#include <Timer.hpp>
 #include <libk/stdlib.h>
 #include <libk/panic.h>
 
@@ -22,6 +27,148 @@ static PCIAddressQuery MakePCIAddrQuery(unsigned bus, unsigned dev, unsigned fun
     return p;			 
 }
 
+/**
+ * Look for the memory mapped configuration space in the ACPI MCFG
+ * table. If not found, we use the I/O ports
+ */
+void PCIBus::InitECAM()
+{
+    auto mcfg = (ACPI_MCFG*)ACPI::FindTable("MCFG");
+    if (!mcfg) {
+	LOG(Info, "pcibus", "no MCFG, using I/O port configuration access");
+	return;
+    }
+
+    unsigned count = (mcfg->hdr.length - sizeof(ACPI_MCFG)) / sizeof(ACPI_MCFGEntry);
+    auto entries = (ACPI_MCFGEntry*)(((uint8_t*)mcfg) + sizeof(ACPI_MCFG));
+
+    for (unsigned i = 0; i < count; i++) {
+	ACPI_MCFGEntry* e = &entries[i];
+
+	// We only know about the segment 0, and can't reach above 4 GB
+	if (e->segment != 0 || (e->base_addr >> 32))
+	    continue;
+
+	_ecam_phys = (uintptr_t)e->base_addr;
+	_ecam_start = e->start_bus;
+	_ecam_end = e->end_bus;
+
+	/* The whole area can be 256 MB, too much address space for us.
+	   We map a single page, and move it to the function we want */
+	_ecam_window = VMM::MapMMIO(_ecam_phys + (_ecam_start << 20), 1,
+				    VMMFlags::ReadWrite | VMMFlags::NonCached |
+				    VMMFlags::WriteThrough);
+	_ecam_mapped = (_ecam_start << 8);
+
+	LOG(Info, "pcibus", "ECAM at 0x%08x, buses %d to %d",
+	    _ecam_phys, _ecam_start, _ecam_end);
+	return;
+    }
+}
+
+/**
+ * Get a pointer to the configuration space of a function, through the
+ * ECAM window. Must be called with interrupts disabled, so no one moves
+ * the window while we use it
+ */
+volatile uint8_t* PCIBus::MapECAM(unsigned bus, unsigned dev, unsigned func)
+{
+    uint32_t devfn = (bus << 8) | (dev << 3) | func;
+
+    if (devfn != _ecam_mapped) {
+	VMM::RemapPage(_ecam_window, _ecam_phys + (devfn << 12),
+		       VMMFlags::ReadWrite | VMMFlags::NonCached |
+		       VMMFlags::WriteThrough);
+	_ecam_mapped = devfn;
+    }
+
+    return (volatile uint8_t*)_ecam_window;
+}
+
+/**
+ * Read 'size' bits of the register 'idx' of the function 'func', of
+ * device 'dev' in bus 'bus'
+ */
+unsigned PCIBus::ConfigRead(unsigned bus, unsigned dev, unsigned func,
+			    unsigned idx, unsigned size)
+{
+    unsigned mask = 0xffffffff;
+    if (size < 32)
+	mask = (1 << size) - 1;
+
+    InterruptGuard g;
+
+    if (_ecam_window && bus >= _ecam_start && bus <= _ecam_end) {
+	volatile uint8_t* cfg = this->MapECAM(bus, dev, func);
+
+	switch (size) {
+	case 8: return *(volatile uint8_t*)(cfg + idx);
+	case 16: return *(volatile uint16_t*)(cfg + idx);
+	default: return *(volatile uint32_t*)(cfg + idx);
+	}
+    }
+
+    // The ports only reach the first 256 bytes
+    if (idx >= 256)
+	return mask;
+
+    // ridx is that will be used. PCI supports directly querying only
+    //registers that are multiples of 4
+    unsigned ridx = (idx & ~0x3);
+    unsigned roff = (idx & 0x3);
+    
+    auto qry = MakePCIAddrQuery(bus, dev, func, ridx>>2);
+    ::x86::out32(CONFIG_ADDRESS, qry.data);
+
+    unsigned data = ::x86::in32(CONFIG_DATA);
+
+    unsigned ret = (data >> (roff * 8));
+    ret &= mask;
+    return ret;
+}
+
+/**
+ * Write 'size' bits of 'data' in the register 'idx' of the function
+ * 'func', of device 'dev' in bus 'bus'
+ */
+void PCIBus::ConfigWrite(unsigned bus, unsigned dev, unsigned func,
+			 unsigned idx, unsigned size, unsigned data)
+{
+    InterruptGuard g;
+
+    if (_ecam_window && bus >= _ecam_start && bus <= _ecam_end) {
+	volatile uint8_t* cfg = this->MapECAM(bus, dev, func);
+
+	switch (size) {
+	case 8: *(volatile uint8_t*)(cfg + idx) = data; break;
+	case 16: *(volatile uint16_t*)(cfg + idx) = data; break;
+	default: *(volatile uint32_t*)(cfg + idx) = data; break;
+	}
+	return;
+    }
+
+    if (idx >= 256)
+	return;
+
+    auto qry = MakePCIAddrQuery(bus, dev, func, idx>>2);
+    ::x86::out32(CONFIG_ADDRESS, qry.data);
+
+    /* Write only the bytes we want through the matching data port
+       bytes, so we don't write back the RW1C bits of the other fields
+       of the same register, like the status */
+    switch (size) {
+    case 8:
+	::x86::out8(CONFIG_DATA + (idx & 0x3), data);
+	break;
+    case 16:
+	::x86::out16(CONFIG_DATA + (idx & 0x2), data);
+	break;
+    default:
+	::x86::out32(CONFIG_DATA, data);
+	break;
+    }
+}
+
 /**
  * Make a read with 'size' bytes in the PCI register 'idx' of device
  * 'dev'
@@ -36,39 +183,78 @@ unsigned PCIBus::ReadPCIRegister(PCIDev* dev, unsigned idx)
     assert(size % 8 == 0);
     assert(size <= 32);
 
-    // ridx is that will be used. PCI supports directly querying only
-    //registers that are multiples of 4
-    unsigned ridx = (idx & ~0x3);
-    unsigned roff = (idx & 0x3);
-    
-    auto qry = MakePCIAddrQuery(dev->bus, dev->dev, dev->func, ridx>>2);
-    ::x86::out32(CONFIG_ADDRESS, qry.data);
+    return this->ConfigRead(dev->bus, dev->dev, dev->func, idx, size);
+}
 
-    unsigned data = ::x86::in32(CONFIG_DATA);
 
-    unsigned mask = 0xffffffff;
-    if (size < 32)
-	mask = (1 << size) - 1;
+static inline unsigned HashID(uint16_t vendor, uint16_t device)
+{
+    uint32_t key = (uint32_t(vendor) << 16) | device;
+    return ((key * 2654435761u) >> 16) & (PCI_HASH_SIZE - 1);
+}
 
-    unsigned ret = (data >> (roff * 8));
-    ret &= mask;
-    return ret;
+static inline unsigned HashClass(uint16_t classcode, uint16_t subclass)
+{
+    return ((classcode << 3) ^ subclass) & (PCI_HASH_SIZE - 1);
+}
+
+/**
+ * Allocate a new device, and add it to the registry
+ * The indexes are only updated in IndexDevice()
+ */
+PCIDev* PCIBus::AllocDevice()
+{
+    if (_free_count == 0) {
+	_free_devs = (PCIDev*)VMM::AllocateVirtual(1);
+	_free_count = VMM_PAGE_SIZE / sizeof(PCIDev);
+    }
+
+    PCIDev* pd = _free_devs++;
+    _free_count--;
+
+    *pd = PCIDev();
+
+    if (_devs_tail)
+	_devs_tail->next = pd;
+    else
+	_devs = pd;
+
+    _devs_tail = pd;
+    pcidev_count++;
+    return pd;
 }
 
+/**
+ * Add the device to the hash tables
+ */
+void PCIBus::IndexDevice(PCIDev* dev)
+{
+    PCIRegister* r = &dev->reginfo;
+
+    unsigned h = HashID(r->vendor, r->device);
+    dev->next_id = _id_hash[h];
+    _id_hash[h] = dev;
+
+    h = HashClass(r->classcode, r->subclass);
+    dev->next_class = _class_hash[h];
+    _class_hash[h] = dev;
+}
 
 /**
  * Finds PCI device by vendor and device IDs
+ * Pass the last device found in 'prev' to find the next one
  *
  * @returns PCIDev struct containing the device info, or NULL
  *          if it couldn't be found
  */
-PCIDev* PCIBus::FindPCIByVendor(uint16_t vendor, uint16_t device)
+PCIDev* PCIBus::FindPCIByVendor(uint16_t vendor, uint16_t device,
+				PCIDev* prev)
 {
-    for (unsigned i = 0; i < pcidev_count; i++) {
-	PCIRegister* r = &(this->pcidevs[i].reginfo);
+    PCIDev* d = (prev) ? prev->next_id : _id_hash[HashID(vendor, device)];
 
-	if (r->vendor == vendor && r->device == device)
-	    return &this->pcidevs[i];
+    for (; d; d = d->next_id) {
+	if (d->reginfo.vendor == vendor && d->reginfo.device == device)
+	    return d;
     }
     
     return NULL;
@@ -76,40 +262,568 @@ PCIDev* PCIBus::FindPCIByVendor(uint16_t vendor, uint16_t device)
 
 /**
  * Finds PCI devices by classcode and subclass
- * 'list_count' is the size of the array returned
+ * Pass the last device found in 'prev' to find the next one
  *
- * @returns a pointer to an array containing the devices,
- *          or NULL if it couldn't find none.
+ * @returns PCIDev struct containing the device info, or NULL
+ *          if it couldn't find none.
  */
 PCIDev* PCIBus::FindPCIByClass(uint16_t classcode, uint16_t subclass,
-			       unsigned& list_count)
+			       PCIDev* prev)
 {
-    // TODO: support returning more than one device
-    for (unsigned i = 0; i < pcidev_count; i++) {
-	PCIRegister* r = &(this->pcidevs[i].reginfo);
+    PCIDev* d = (prev) ? prev->next_class :
+	_class_hash[HashClass(classcode, subclass)];
 
-	if (r->classcode == classcode && r->subclass == subclass) {
-	    list_count = 1;
-	    return &this->pcidevs[i];
-	}
+    for (; d; d = d->next_class) {
+	if (d->reginfo.classcode == classcode &&
+	    d->reginfo.subclass == subclass)
+	    return d;
     }
 
-    list_count = 0;
     return NULL;
 }
 
+/**
+ * Check if 'dev' matches the table entry 'id'
+ */
+bool PCIBus::MatchID(PCIDev* dev, const PCIDeviceID* id)
+{
+    PCIRegister* r = &dev->reginfo;
+
+    return (id->vendor == PCI_ANY_ID || id->vendor == r->vendor) &&
+	(id->device == PCI_ANY_ID || id->device == r->device) &&
+	(id->classcode == PCI_ANY_ID || id->classcode == r->classcode) &&
+	(id->subclass == PCI_ANY_ID || id->subclass == r->subclass);
+}
+
+/**
+ * Try the probe of 'drv' for each matching device without a
+ * driver
+ */
+void PCIBus::BindDriver(PCIDriver* drv)
+{
+    for (const PCIDeviceID* id = drv->ids; id->vendor || id->device ||
+	     id->classcode || id->subclass; id++) {
+
+	/* Use the indexes when we can. Only a table entry with neither
+	   the IDs nor the class needs to look at all devices */
+	bool by_id = (id->vendor != PCI_ANY_ID && id->device != PCI_ANY_ID);
+	bool by_class = (id->classcode != PCI_ANY_ID &&
+			 id->subclass != PCI_ANY_ID);
+
+	PCIDev* d = NULL;
+	for (;;) {
+	    if (by_id)
+		d = this->FindPCIByVendor(id->vendor, id->device, d);
+	    else if (by_class)
+		d = this->FindPCIByClass(id->classcode, id->subclass, d);
+	    else
+		d = this->GetNextDevice(d);
+
+	    if (!d)
+		break;
+
+	    if (d->devobj || !PCIBus::MatchID(d, id))
+		continue;
+
+	    Device* obj = drv->probe(this, d, id);
+	    if (!obj)
+		continue;
+
+	    d->devobj = obj;
+	    LOG(Info, "pcibus", "%02x:%02x.%x bound to driver %s",
+		d->bus, d->dev, d->func, drv->name);
+	}
+    }
+}
+
+/**
+ * Register a driver
+ * Its probe function is called for each device that matches its
+ * ID table and has no driver yet, now and after the bus
+ * enumeration.
+ */
+void PCIBus::RegisterDriver(PCIDriver* drv)
+{
+    drv->next = _drivers;
+    _drivers = drv;
+
+    this->BindDriver(drv);
+}
+
+
 /**
  * Write 'data', with 'size' bytes in the PCI register 'idx' of device
  * 'dev'
  *
- * @return the content read
- *
  * @remarks Note that 'size' can only be a multiple of 8
  */
 template<uint8_t size>
-void WritePCIRegister(PCIDev* dev, unsigned idx, unsigned data)
+void PCIBus::WritePCIRegister(PCIDev* dev, unsigned idx, unsigned data)
+{
+    assert(size % 8 == 0);
+    assert(size <= 32);
+
+    this->ConfigWrite(dev->bus, dev->dev, dev->func, idx, size, data);
+}
+
+// The typed accessors in the header use these
+template unsigned PCIBus::ReadPCIRegister<8>(PCIDev*, unsigned);
+template unsigned PCIBus::ReadPCIRegister<16>(PCIDev*, unsigned);
+template unsigned PCIBus::ReadPCIRegister<32>(PCIDev*, unsigned);
+template void PCIBus::WritePCIRegister<8>(PCIDev*, unsigned, unsigned);
+template void PCIBus::WritePCIRegister<16>(PCIDev*, unsigned, unsigned);
+template void PCIBus::WritePCIRegister<32>(PCIDev*, unsigned, unsigned);
+
+// Offsets in the configuration space
+#define PCI_VENDOR 0x00
+#define PCI_COMMAND 0x04
+#define PCI_STATUS 0x06
+#define PCI_HEADER_TYPE 0x0e
+#define PCI_CAPABILITIES 0x34
+
+#define PCI_BAR0 0x10
+
+#define PCI_COMMAND_IO (1 << 0)
+#define PCI_COMMAND_MEMORY (1 << 1)
+#define PCI_COMMAND_MASTER (1 << 2)
+#define PCI_COMMAND_INTX_DISABLE (1 << 10)
+#define PCI_STATUS_CAPABILITIES (1 << 4)
+
+// MSI capability registers
+#define MSI_CONTROL 0x2
+#define MSI_ADDRESS 0x4
+#define MSI_CONTROL_ENABLE (1 << 0)
+#define MSI_CONTROL_64BIT (1 << 7)
+
+// MSI-X capability registers
+#define MSIX_CONTROL 0x2
+#define MSIX_TABLE 0x4
+#define MSIX_CONTROL_ENABLE (1 << 15)
+#define MSIX_CONTROL_MASKALL (1 << 14)
+
+/**
+ * Find the capability 'id' in the capability list of 'dev'
+ * 'start' is the offset of the capability to start after, so we
+ * can find the next one with the same ID
+ *
+ * @return the capability offset, or 0 if not found
+ */
+unsigned PCIBus::FindCapability(PCIDev* dev, uint8_t id, unsigned start)
+{
+    if (!(dev->reginfo.status & PCI_STATUS_CAPABILITIES))
+	return 0;
+
+    unsigned off = (start) ? this->ReadPCIRegister<8>(dev, start+1) :
+	this->ReadPCIRegister<8>(dev, PCI_CAPABILITIES);
+
+    /* The list lives after the 64-byte header. A broken device could make
+       it loop, so we limit the number of entries */
+    for (unsigned i = 0; i < 48 && off >= 0x40; i++) {
+	off &= ~0x3;
+
+	if (this->ReadPCIRegister<8>(dev, off) == id)
+	    return off;
+
+	off = this->ReadPCIRegister<8>(dev, off+1);
+    }
+
+    return 0;
+}
+
+/**
+ * Set the 'bits' of the command register of 'dev'
+ * If 'enable' is false, clear them.
+ */
+void PCIBus::SetCommand(PCIDev* dev, uint16_t bits, bool enable)
+{
+    uint16_t command = this->ReadPCIRegister<16>(dev, PCI_COMMAND);
+
+    if (enable)
+	command |= bits;
+    else
+	command &= ~bits;
+
+    this->WritePCIRegister<16>(dev, PCI_COMMAND, command);
+    dev->reginfo.command = command;
+}
+
+/**
+ * Read the BAR 'idx' of 'dev', and find its size
+ * The size is found by writing all ones and reading back which bits
+ * stuck. The device decoding is disabled while we do this.
+ *
+ * @return false if the BAR doesn't exist or isn't implemented
+ */
+bool PCIBus::GetBAR(PCIDev* dev, unsigned idx, PCIBar& bar)
+{
+    unsigned maxbars = 0;
+    switch (dev->reginfo.header_type & 0x7f) {
+    case 0: maxbars = 6; break;
+    case 1: maxbars = 2; break;
+    }
+
+    if (idx >= maxbars)
+	return false;
+
+    unsigned off = PCI_BAR0 + idx*4;
+    uint32_t orig = this->ReadPCIRegister<32>(dev, off);
+
+    bar.io = (orig & 0x1);
+    bar.is64 = !bar.io && ((orig >> 1) & 0x3) == 0x2;
+    bar.prefetchable = !bar.io && (orig & 0x8);
+
+    if (bar.is64 && idx+1 >= maxbars)
+	return false;
+
+    /* Don't let the device decode the strange addresses we write while
+       sizing it */
+    uint16_t command = this->ReadPCIRegister<16>(dev, PCI_COMMAND);
+    this->WritePCIRegister<16>(dev, PCI_COMMAND,
+			       command & ~(PCI_COMMAND_IO | PCI_COMMAND_MEMORY));
+
+    this->WritePCIRegister<32>(dev, off, 0xffffffff);
+    uint32_t mask = this->ReadPCIRegister<32>(dev, off);
+    this->WritePCIRegister<32>(dev, off, orig);
+
+    uint32_t orighi = 0, maskhi = 0xffffffff;
+    if (bar.is64) {
+	orighi = this->ReadPCIRegister<32>(dev, off+4);
+	this->WritePCIRegister<32>(dev, off+4, 0xffffffff);
+	maskhi = this->ReadPCIRegister<32>(dev, off+4);
+	this->WritePCIRegister<32>(dev, off+4, orighi);
+    }
+
+    this->WritePCIRegister<16>(dev, PCI_COMMAND, command);
+
+    if (bar.io) {
+	// Some devices leave the upper 16 bits as zero
+	uint32_t m = mask & ~0x3;
+	if (!m)
+	    return false;
+
+	bar.addr = orig & ~0x3;
+	bar.size = (~(m | 0xffff0000) + 1) & 0xffff;
+    } else {
+	uint64_t m = (uint64_t(maskhi) << 32) | (mask & ~0xf);
+	if (!(mask & ~0xf))
+	    return false;
+
+	bar.addr = (uint64_t(orighi) << 32) | (orig & ~0xf);
+	bar.size = ~m + 1;
+    }
+
+    return true;
+}
+
+/**
+ * Map the memory BAR 'idx' of 'dev' in the kernel address space
+ * Prefetchable BARs are mapped write-combining, the others uncached.
+ * 'maxlen' limits how much we map, 0 means the whole BAR.
+ *
+ * @return the virtual address of the BAR, or 0 on error
+ */
+virt_t PCIBus::MapBAR(PCIDev* dev, unsigned idx, size_t maxlen)
+{
+    PCIBar bar;
+    if (!this->GetBAR(dev, idx, bar) || bar.io)
+	return 0;
+
+    if ((bar.addr >> 32) || ((bar.addr + bar.size - 1) >> 32)) {
+	LOG(Error, "pcibus", "%02x:%02x.%x: BAR %d is above 4 GB",
+	    dev->bus, dev->dev, dev->func, idx);
+	return 0;
+    }
+
+    uint64_t len = bar.size;
+    if (maxlen && maxlen < len)
+	len = maxlen;
+
+    /* Registers can have side effects on reads, and need the writes to
+       happen in order: strong uncached. Prefetchable memory can use
+       write-combining */
+    uint16_t flags = VMMFlags::ReadWrite;
+    if (bar.prefetchable)
+	flags |= VMMFlags::WriteCombining;
+    else
+	flags |= VMMFlags::NonCached | VMMFlags::WriteThrough;
+
+    uintptr_t phys = (uintptr_t)bar.addr;
+    unsigned pageoff = phys & (VMM_PAGE_SIZE - 1);
+    size_t pages = (pageoff + len + VMM_PAGE_SIZE - 1) / VMM_PAGE_SIZE;
+
+    virt_t v = VMM::MapMMIO(phys & ~(VMM_PAGE_SIZE - 1), pages, flags);
+    if (!v)
+	return 0;
+
+    this->SetCommand(dev, PCI_COMMAND_MEMORY);
+    return v + pageoff;
+}
+
+/**
+ * Set or clear the INTx disable bit of the command register
+ */
+static void SetLegacyInterrupt(PCIDev* dev, uint16_t& command, bool enable)
+{
+    if (enable)
+	command &= ~PCI_COMMAND_INTX_DISABLE;
+    else
+	command |= PCI_COMMAND_INTX_DISABLE;
+
+    dev->reginfo.command = command;
+}
+
+/**
+ * Enable MSI for 'dev', with 'count' vectors
+ * 'count' must be a power of 2, and the device might support less
+ * than that. The legacy INTx interrupt is disabled.
+ *
+ * @return the first IRQ number, or -1 if MSI can't be used
+ */
+int PCIBus::EnableMSI(PCIDev* dev, unsigned& count)
+{
+    unsigned cap = dev->msi_cap;
+    if (!cap || dev->int_mode != PCIIntLegacy)
+	return -1;
+
+    uint16_t control = this->ReadPCIRegister<16>(dev, cap + MSI_CONTROL);
+
+    // Bits 1-3 are the log2 of the vectors the device can send
+    unsigned maxcount = 1 << ((control >> 1) & 0x7);
+    if (count > maxcount)
+	count = maxcount;
+    if (count == 0 || (count & (count - 1)))
+	return -1;
+
+    int irq = ::x86::IRQHandler::AllocateIRQ(count);
+    if (irq < 0)
+	return -1;
+
+    uint32_t addr, data;
+    auto ctl = ::x86::IRQHandler::GetController();
+    if (!ctl || !ctl->GetMSIMessage(irq, addr, data)) {
+	::x86::IRQHandler::FreeIRQ(irq, count);
+	return -1;
+    }
+
+    this->WritePCIRegister<32>(dev, cap + MSI_ADDRESS, addr);
+    if (control & MSI_CONTROL_64BIT) {
+	this->WritePCIRegister<32>(dev, cap + MSI_ADDRESS + 4, 0);
+	this->WritePCIRegister<16>(dev, cap + MSI_ADDRESS + 8, data);
+    } else {
+	this->WritePCIRegister<16>(dev, cap + MSI_ADDRESS + 4, data);
+    }
+
+    // Bits 4-6 are the log2 of the vectors we enable
+    unsigned log2count = __builtin_ctz(count);
+    control &= ~(0x7 << 4);
+    control |= (log2count << 4) | MSI_CONTROL_ENABLE;
+    this->WritePCIRegister<16>(dev, cap + MSI_CONTROL, control);
+
+    uint16_t command = this->ReadPCIRegister<16>(dev, PCI_COMMAND);
+    SetLegacyInterrupt(dev, command, false);
+    this->WritePCIRegister<16>(dev, PCI_COMMAND, command);
+
+    dev->int_mode = PCIIntMSI;
+    dev->irq_base = irq;
+    dev->irq_count = count;
+
+    LOG(Info, "pcibus", "%02x:%02x.%x: MSI enabled, IRQs %d to %d",
+	dev->bus, dev->dev, dev->func, irq, irq + count - 1);
+    return irq;
+}
+
+/**
+ * Enable MSI-X for 'dev', with 'count' vectors, one for each table
+ * entry. Each one gets its own IRQ, and they're written in 'irqs'
+ *
+ * @return the number of vectors enabled, or -1 if MSI-X can't be
+ *         used
+ */
+int PCIBus::EnableMSIX(PCIDev* dev, unsigned count, int* irqs)
 {
-    panic("unimplemented");
+    unsigned cap = dev->msix_cap;
+    if (!cap || dev->int_mode != PCIIntLegacy || count == 0)
+	return -1;
+
+    uint16_t control = this->ReadPCIRegister<16>(dev, cap + MSIX_CONTROL);
+    unsigned tablesize = (control & 0x7ff) + 1;
+    if (count > tablesize)
+	count = tablesize;
+
+    // The table is in one of the memory BARs
+    uint32_t tableinfo = this->ReadPCIRegister<32>(dev, cap + MSIX_TABLE);
+    unsigned bir = tableinfo & 0x7;
+    uint32_t tableoff = tableinfo & ~0x7;
+
+    if (bir > 5 || (dev->reginfo.header_type & 0x7f) != 0)
+	return -1;
+
+    uint32_t bar = dev->reginfo.dev.bar[bir];
+    if (bar & 0x1)
+	return -1;
+
+    // 64-bit BAR, that we can only use if it's below 4 GB
+    if (((bar >> 1) & 0x3) == 0x2 && bir < 5 && dev->reginfo.dev.bar[bir+1])
+	return -1;
+
+    uintptr_t tablephys = (bar & ~0xf) + tableoff;
+    unsigned pageoff = tablephys & (VMM_PAGE_SIZE - 1);
+    size_t pages = (pageoff + count*16 + VMM_PAGE_SIZE - 1) / VMM_PAGE_SIZE;
+    volatile uint32_t* table = (volatile uint32_t*)
+	(::x86::VMM::MapMMIO(tablephys & ~(VMM_PAGE_SIZE - 1), pages) + pageoff);
+
+    auto ctl = ::x86::IRQHandler::GetController();
+
+    // Mask everything while we fill the table
+    control |= MSIX_CONTROL_ENABLE | MSIX_CONTROL_MASKALL;
+    this->WritePCIRegister<16>(dev, cap + MSIX_CONTROL, control);
+
+    unsigned enabled = 0;
+    for (unsigned i = 0; i < count; i++) {
+	int irq = ::x86::IRQHandler::AllocateIRQ();
+	uint32_t addr, data;
+
+	if (irq < 0 || !ctl || !ctl->GetMSIMessage(irq, addr, data)) {
+	    if (irq >= 0)
+		::x86::IRQHandler::FreeIRQ(irq);
+	    break;
+	}
+
+	volatile uint32_t* entry = &table[i*4];
+	entry[0] = addr;
+	entry[1] = 0;
+	entry[2] = data;
+	entry[3] = 0; // Unmasked
+
+	irqs[i] = irq;
+	enabled++;
+    }
+
+    if (enabled == 0) {
+	control &= ~(MSIX_CONTROL_ENABLE | MSIX_CONTROL_MASKALL);
+	this->WritePCIRegister<16>(dev, cap + MSIX_CONTROL, control);
+	return -1;
+    }
+
+    uint16_t command = this->ReadPCIRegister<16>(dev, PCI_COMMAND);
+    SetLegacyInterrupt(dev, command, false);
+    this->WritePCIRegister<16>(dev, PCI_COMMAND, command);
+
+    control &= ~MSIX_CONTROL_MASKALL;
+    this->WritePCIRegister<16>(dev, cap + MSIX_CONTROL, control);
+
+    /* The IRQs of MSI-X don't need to be consecutive. We keep the first
+       one only for logging */
+    dev->int_mode = PCIIntMSIX;
+    dev->irq_base = irqs[0];
+    dev->irq_count = enabled;
+
+    LOG(Info, "pcibus", "%02x:%02x.%x: MSI-X enabled, %d vectors",
+	dev->bus, dev->dev, dev->func, enabled);
+    return int(enabled);
+}
+
+/**
+ * Disable MSI or MSI-X, and go back to the legacy interrupt
+ */
+void PCIBus::DisableMSI(PCIDev* dev)
+{
+    switch (dev->int_mode) {
+    case PCIIntMSI: {
+	unsigned cap = dev->msi_cap;
+	uint16_t control = this->ReadPCIRegister<16>(dev, cap + MSI_CONTROL);
+	control &= ~MSI_CONTROL_ENABLE;
+	this->WritePCIRegister<16>(dev, cap + MSI_CONTROL, control);
+
+	::x86::IRQHandler::FreeIRQ(dev->irq_base, dev->irq_count);
+	break;
+    }
+
+    case PCIIntMSIX: {
+	unsigned cap = dev->msix_cap;
+	uint16_t control = this->ReadPCIRegister<16>(dev, cap + MSIX_CONTROL);
+	control &= ~MSIX_CONTROL_ENABLE;
+	this->WritePCIRegister<16>(dev, cap + MSIX_CONTROL, control);
+
+	/* The driver has the list of MSI-X IRQs, and must free them
+	   itself */
+	break;
+    }
+
+    default:
+	return;
+    }
+
+    uint16_t command = this->ReadPCIRegister<16>(dev, PCI_COMMAND);
+    SetLegacyInterrupt(dev, command, true);
+    this->WritePCIRegister<16>(dev, PCI_COMMAND, command);
+
+    dev->int_mode = PCIIntLegacy;
+    dev->irq_base = -1;
+    dev->irq_count = 0;
+}
+
+/**
+ * Read the header of a function we know exists, and add it to the
+ * device list. If it's a bridge, scan the bus behind it
+ */
+void PCIBus::ScanFunction(unsigned bus, unsigned dev, unsigned fun)
+{
+    PCIDev* pd = this->AllocDevice();
+
+    // Only the 64-byte header, not the whole configuration space
+    uint32_t* hdr = (uint32_t*)&pd->reginfo;
+    for (unsigned i = 0; i < sizeof(PCIRegister) / sizeof(uint32_t); i++)
+	hdr[i] = this->ConfigRead(bus, dev, fun, i*4, 32);
+
+    pd->bus = bus;
+    pd->dev = dev;
+    pd->func = fun;
+    this->IndexDevice(pd);
+
+    LOG(Debug, "pcibus", "found device at %02x:%02x:%x",
+	bus, dev, fun);
+
+    PCIRegister* r = &pd->reginfo;
+    if (r->classcode == 0x06 && r->subclass == 0x04 &&
+	(r->header_type & 0x7f) == 1) {
+	// PCI to PCI bridge
+	unsigned secondary = r->pci2pci.secundary_bus_num;
+
+	/* A bus number that isn't after ours means the firmware didn't
+	   configure the bridge */
+	if (secondary > bus)
+	    this->ScanBus(secondary);
+    }
+}
+
+/**
+ * Find the devices in bus 'bus', and in the buses behind its bridges
+ */
+void PCIBus::ScanBus(unsigned bus)
+{
+    if (bus > 255 || (_scanned_buses[bus / 32] & (1 << (bus % 32))))
+	return;
+
+    _scanned_buses[bus / 32] |= (1 << (bus % 32));
+
+    for (unsigned dev = 0; dev < 32; dev++) {
+	// Only the vendor first, most slots are empty
+	if (this->ConfigRead(bus, dev, 0, PCI_VENDOR, 16) == 0xffff)
+	    continue;
+
+	unsigned nfuncs = 1;
+	if (this->ConfigRead(bus, dev, 0, PCI_HEADER_TYPE, 8) & 0x80)
+	    nfuncs = 8;
+
+	for (unsigned fun = 0; fun < nfuncs; fun++) {
+	    if (fun > 0 &&
+		this->ConfigRead(bus, dev, fun, PCI_VENDOR, 16) == 0xffff)
+		continue;
+
+	    this->ScanFunction(bus, dev, fun);
+	}
+    }
 }
 
 /** 
@@ -117,69 +831,36 @@ void WritePCIRegister(PCIDev* dev, unsigned idx, unsigned data)
  */
 void PCIBus::Initialize()
 {
-    Log::Write(Info, "pcibus", "Querying PCI devices");
+    this->InitECAM();
 
-    unsigned pidx = 0;
+    LOG(Info, "pcibus", "Querying PCI devices");
 
-    /* Query devices and list them */
-    for (unsigned bus = 0; bus < 255; bus++) {
-	for (unsigned dev = 0; dev < 32; dev++) {
-	    for (unsigned fun = 0; fun < 8; fun++) {
+    uint64_t start = Timer::GetNs();
 
-		// Mount the query and sent to the pci bus */
-		const unsigned pcibsize = sizeof(PCIDev) / sizeof(uint32_t);
-		uint32_t pcibytes[pcibsize];
+    memset(_scanned_buses, 0, sizeof(_scanned_buses));
 
-		PCIAddressQuery query = MakePCIAddrQuery(bus, dev, fun, 0);
-		bool exists = false;
-		
-		for (unsigned queryidx = 0; queryidx < pcibsize; queryidx++) {
-		    query.reg = queryidx;
-		    ::x86::out32(CONFIG_ADDRESS, query.data);
-		    pcibytes[queryidx] = ::x86::in32(CONFIG_DATA);
-		    
-		    // If the device is non-existant, break
-		    if (pcibytes[0] == 0xffffffff) {
-			break;
-		    } else {
-			exists = true;
-		    }
-		}
-
-		if (!exists) {
-		    continue;
-		} else {
-		    Log::Write(Debug, "pcibus", "found device at %02x:%02x:%x",
-			       bus, dev, fun);
-		    memcpy(&(this->pcidevs[pidx].reginfo), &pcibytes[0],
-			   sizeof(PCIRegister));
-
-		    pcidevs[pidx].bus = bus;
-		    pcidevs[pidx].dev = dev;
-		    pcidevs[pidx].func = fun;
-
-		    pidx++;
-		    /* If bit 7 of type is set, then the device has multiple
-		       functions. If not, then it's safe to break 
-		    */
-		    if (fun == 0 && pcidevs[pidx-1].reginfo.header_type < 0x80)
-			break;
-		    
-		}
-	    }
+    /* If the host bridge is multi-function, each function is the
+       host bridge of another root bus */
+    if (this->ConfigRead(0, 0, 0, PCI_HEADER_TYPE, 8) & 0x80) {
+	for (unsigned fun = 0; fun < 8; fun++) {
+	    if (this->ConfigRead(0, 0, fun, PCI_VENDOR, 16) != 0xffff)
+		this->ScanBus(fun);
 	}
+    } else {
+	this->ScanBus(0);
     }
 
-    Log::Write(Info, "pcibus", "%d PCI devices discovered", pidx);
-    pcidev_count = pidx;
+    unsigned pidx = pcidev_count;
+    uint32_t elapsed_us = (uint32_t)((Timer::GetNs() - start) / 1000);
+    LOG(Info, "pcibus", "%d PCI devices discovered in %d us",
+	pidx, elapsed_us);
 
-    for (unsigned i = 0; i < pidx; i++) {
-	PCIRegister* pr = &(this->pcidevs[i].reginfo);
-	Log::Write(Info, "pcibus", "%d:%d.%d -> \033[36m%04x:%04x\033[0m, command %04x, status %04x, type %02x",
-		   this->pcidevs[i].bus, this->pcidevs[i].dev,
-		   this->pcidevs[i].func,
-		   pr->vendor, pr->device, pr->command, pr->status, pr->header_type);
-	Log::Write(Info, "pcibus", "         class %02x:%02x, rev %02x progid %02x", pr->classcode, pr->subclass, pr->rev, pr->prog_id);
+    for (PCIDev* pd = _devs; pd; pd = pd->next) {
+	PCIRegister* pr = &(pd->reginfo);
+	LOG(Info, "pcibus", "%d:%d.%d -> \033[36m%04x:%04x\033[0m, command %04x, status %04x, type %02x",
+	    pd->bus, pd->dev, pd->func,
+	    pr->vendor, pr->device, pr->command, pr->status, pr->header_type);
+	LOG(Info, "pcibus", "         class %02x:%02x, rev %02x progid %02x", pr->classcode, pr->subclass, pr->rev, pr->prog_id);
 
 	switch ((pr->header_type & 0xf)) {
 	case 0:
@@ -198,8 +879,8 @@ void PCIBus::Initialize()
 		    }
 		    
 		    
-		    Log::Write(Info, "pcibus", "         bar[%d] = (%s at %x)",
-			       baridx, type, addr);
+		    LOG(Info, "pcibus", "         bar[%d] = (%s at %x)",
+			baridx, type, addr);
 		}
 	    }
 	    break;
@@ -218,8 +899,8 @@ void PCIBus::Initialize()
 		    }
 		    
 		    
-		    Log::Write(Info, "pcibus", "         bar[%d] = (%s at %x)",
-			       baridx, type, addr);
+		    LOG(Info, "pcibus", "         bar[%d] = (%s at %x)",
+			baridx, type, addr);
 		}
 
 	    }
@@ -228,10 +909,18 @@ void PCIBus::Initialize()
 	}
 	
 	if (pr->dev.interrupt_line > 0)
-	    Log::Write(Info, "pcibus", "         interrupt %d at pin %02x", pr->dev.interrupt_line, pr->dev.interrupt_pin);
-    }
+	    LOG(Info, "pcibus", "         interrupt %d at pin %02x", pr->dev.interrupt_line, pr->dev.interrupt_pin);
 
+	pd->msi_cap = this->FindCapability(pd, PCICapMSI);
+	pd->msix_cap = this->FindCapability(pd, PCICapMSIX);
+	if (pd->msi_cap || pd->msix_cap)
+	    LOG(Info, "pcibus", "         MSI capability at %02x, MSI-X at %02x",
+		pd->msi_cap, pd->msix_cap);
+    }
 
+    // Bind the drivers registered before the enumeration
+    for (PCIDriver* drv = _drivers; drv; drv = drv->next)
+	this->BindDriver(drv);
 }
 
 
@@ -5,19 +5,18 @@ using namespace annos;
 
 bool PCIDevice::DetectPCIByClass(uint16_t classcode, uint16_t subclass)
 {
-    unsigned lsize = 0;
-    auto p = _bus->FindPCIByClass(classcode, subclass, lsize);
+    auto p = _bus->FindPCIByClass(classcode, subclass);
 
-    if (lsize == 0) return false;
+    if (!p) return false;
 
-    for (unsigned i = 0; i < lsize; i++) {
-	if (p[i].devobj)
+    for (; p; p = _bus->FindPCIByClass(classcode, subclass, p)) {
+	if (p->devobj)
 	    continue;
 
-	this->pci = &p[i];
+	this->pci = p;
 	return true;
     }
 
-    Log::Write(Error, "pcidevice", "Found device class %d:%d asked by '%s', but it already had a device object", classcode, subclass, _tag);
+    LOG(Error, "pcidevice", "Found device class %d:%d asked by '%s', but it already had a device object", classcode, subclass, _tag);
     return false;
 }
@@ -28,7 +28,7 @@ PMM::PMM(uintptr_t kernel_start, uintptr_t virt_offset, void* pmm_pool_start,
     this->_mmap = (PMMZone*)kernel_end_malloc(&kend_addr,
 					      sizeof(PMMZone)*mmap_count);
 
-    Log::Write(Info, "pmm", "Memory map:");
+    LOG(Info, "pmm", "Memory map:");
     for (size_t i = 0; i < mmap_count; i++) {
 	auto pagecount = (mmap_addr[i].len / PHYS_PAGE_SIZE);
 	if(mmap_addr[i].len > 0 && pagecount == 0)
@@ -65,25 +65,25 @@ PMM::PMM(uintptr_t kernel_start, uintptr_t virt_offset, void* pmm_pool_start,
 	// Clean the memory!
 	memset(this->_mmap[i].alloc_bitmap, 0, (pagecount/8)+1);
 	
-	Log::Write(Info, "pmm",
-		   "\t%d: start 0x%08x, type %02x, using %d phys pages, "
-		   "bitmap at 0x%08x",
-		   i+1, this->_mmap[i].start, this->_mmap[i].type,
-		   this->_mmap[i].pagecount,
-		   (uintptr_t)this->_mmap[i].alloc_bitmap);
+	LOG(Info, "pmm",
+	    "\t%d: start 0x%08x, type %02x, using %d phys pages, "
+	    "bitmap at 0x%08x",
+	    i+1, this->_mmap[i].start, this->_mmap[i].type,
+	    this->_mmap[i].pagecount,
+	    (uintptr_t)this->_mmap[i].alloc_bitmap);
     }
 
-    Log::Write(Info, "pmm", "kernel end is at 0x%x, with %d bytes",
-	       kend_addr, (kend_addr - (phys_t)pmm_pool_start));
+    LOG(Info, "pmm", "kernel end is at 0x%x, with %d bytes",
+	kend_addr, (kend_addr - (phys_t)pmm_pool_start));
 
-    Log::Write(Debug, "pmm", "mapping the addresses used until now");
+    LOG(Debug, "pmm", "mapping the addresses used until now");
     unsigned pmm_page_count = 1 + ((kend_addr - (kernel_start + virt_offset)) / PHYS_PAGE_SIZE);
 
-    Log::Write(Debug, "pmm", "mapping %d pages for it", pmm_page_count);
+    LOG(Debug, "pmm", "mapping %d pages for it", pmm_page_count);
 
     this->_mmap_count = mmap_count;
     if (this->MapPages(kernel_start, pmm_page_count) == ((uint32_t)-1)) {
-	Log::Write(Error, "pmm", "no memory to create the tables");
+	LOG(Error, "pmm", "no memory to create the tables");
 	panic("pmm: no sufficient memory to even create the tables!");	
     }
 }
@@ -122,8 +122,8 @@ phys_t PMM::AllocatePhysical(size_t n, PMMZoneType type)
 	unsigned page_offset = (zone->first_free_addr - zone->start) / PHYS_PAGE_SIZE;
 
 	if ((page_offset+n) >= zone->pagecount) {
-	    Log::Write(Warning, "pmm", "AllocatePhysical: "
-		       "exhausted mmap zone #%d", i);
+	    LOG(Warning, "pmm", "AllocatePhysical: "
+		"exhausted mmap zone #%d", i);
 	    continue;
 	}
 	
@@ -131,8 +131,8 @@ phys_t PMM::AllocatePhysical(size_t n, PMMZoneType type)
 	    page_offset++;
 
 	    if ((page_offset+n) >= zone->pagecount) {
-		Log::Write(Warning, "pmm", "AllocatePhysical: "
-			   "exhausted mmap zone #%d", i);
+		LOG(Warning, "pmm", "AllocatePhysical: "
+		    "exhausted mmap zone #%d", i);
 		continue;
 	    }
 		
@@ -146,7 +146,7 @@ phys_t PMM::AllocatePhysical(size_t n, PMMZoneType type)
 	return naddr;		
     }
 
-    Log::Write(Fatal, "pmm", "AllocatePhysical: phys memory exhausted, no suitable zones");
+    LOG(Fatal, "pmm", "AllocatePhysical: phys memory exhausted, no suitable zones");
     panic("pmm: AllocatePhysical: phys memory exhausted, no suitable zones");
     return 0;
     
@@ -171,9 +171,9 @@ bool PMM::CheckIfPagesFree(char const* alloc_bitmap,
 
 	// Check if mapped
 	if (alloc_bitmap[byte_offset] & (1 << bit_offset)) {
-	    Log::Write(Error, "pmm", "page already mapped in bitmap offset %d + "
-		       "(%d * 8) + %d pages)",
-		   page_offset, byte_offset, bit_offset);
+	    LOG(Error, "pmm", "page already mapped in bitmap offset %d + "
+		"(%d * 8) + %d pages)",
+		page_offset, byte_offset, bit_offset);
 	    return false;
 	}
 	
@@ -239,14 +239,14 @@ phys_t PMM::MapPages(phys_t addr, size_t n)
 {
     PMMZone* zone = this->FindZone(addr);
     if (!zone) {
-	Log::Write(Error, "pmm",
-		   "MapPages: couldn't find a suitable zone for 0x%08x", addr);
+	LOG(Error, "pmm",
+	    "MapPages: couldn't find a suitable zone for 0x%08x", addr);
 	return 0xffffffff;
     }
 
     if (addr < zone->first_free_addr) {
-	Log::Write(Error, "pmm",
-		   "MapPages: can't map %u pages from address 0x%08x: less that the first free address", n, addr);
+	LOG(Error, "pmm",
+	    "MapPages: can't map %u pages from address 0x%08x: less that the first free address", n, addr);
 	return 0xffffffff;
     }
     
@@ -255,8 +255,8 @@ phys_t PMM::MapPages(phys_t addr, size_t n)
 
     if (!this->CheckIfPagesFree((char const*)zone->alloc_bitmap,
 				page_offset, n)) {
-	Log::Write(Error, "pmm",
-		   "error: page at %08x already mapped", addr_offset);
+	LOG(Error, "pmm",
+	    "error: page at %08x already mapped", addr_offset);
 	return 0xffffffff;	
     }
 
@@ -281,8 +281,8 @@ size_t PMM::UnmapPages(phys_t addr, size_t n)
 {
     PMMZone* zone = this->FindZone(addr);
     if (!zone) {
-	Log::Write(Error, "pmm",
-		   "UnmapPages: couldn't find a suitable zone for 0x%08x", addr);
+	LOG(Error, "pmm",
+	    "UnmapPages: couldn't find a suitable zone for 0x%08x", addr);
 	return 0xffffffff;
     }
 
@@ -319,8 +319,8 @@ PMMZone* PMM::FindZone(phys_t addr)
     for (unsigned i = 0; i < _mmap_count; i++) {
 	PMMZone* zone = &_mmap[i];
 	uintptr_t zone_end = zone->start + (PHYS_PAGE_SIZE * zone->pagecount) - 1;
-	Log::Write(Debug, "pmm", "find zone for %x (%d, %x -> %x)",
-		   addr, i, zone->start, zone_end);
+	LOG(Debug, "pmm", "find zone for %x (%d, %x -> %x)",
+	    addr, i, zone->start, zone_end);
 	
 	if (addr >= zone->start && addr <= zone_end) {
 	    best_zone = zone;
@@ -1,11 +1,12 @@
-
 #include <Timer.hpp>
+#include <WorkQueue.hpp>
 #include <libk/stdio.h>
+#include <arch/x86/InterruptGuard.hpp>
 
 /**
  * Kernel timer
  *
- * The timer is supposed to tick each milisecond, for each PIT on each 
+ * The timer is supposed to tick each milisecond, for each PIT on each
  * architecture
  * It gives the kernel the notion of time.
  *
@@ -13,22 +14,376 @@
  */
 
 using namespace annos;
+using annos::x86::InterruptGuard;
 
 uint64_t Timer::v;
+fnClockSource Timer::_clock = NULL;
+IClockEventDevice* Timer::_dev = NULL;
+
+bool Timer::_tickless = false;
+uint64_t Timer::_ns_offset = 0;
+uint64_t Timer::_programmed_tick = 0;
+
+uint64_t Timer::_wheel_base = 0;
+TimerEvent* Timer::_wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE] = {};
+uint64_t Timer::_wheel_pending[TIMER_WHEEL_LEVELS] = {};
+
+constexpr unsigned wheel_mask = TIMER_WHEEL_SIZE - 1;
 
-void Timer::Init()
+// How far in the future the wheel can hold an event, in ticks
+constexpr uint64_t wheel_span = 1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS);
+
+constexpr uint64_t ns_per_tick = 1000000;
+constexpr uint64_t no_event = (uint64_t)-1;
+
+// Frequency of the timer in periodic mode
+constexpr unsigned tick_hz = 1000;
+
+/* Print the uptime each second
+   Printing is too slow for the timer interrupt, so the timer event only
+   queues the work that prints */
+static void PrintUptime(WorkItem* w, void* data)
+{
+    (void)w;
+    (void)data;
+    kprintf("%4d s\n", ((uint32_t)Timer::Get()/1000));
+}
+
+static TimerEvent uptime_ev;
+static WorkItem uptime_work(&PrintUptime);
+
+static void OnUptimeEvent(TimerEvent* ev, void* data)
+{
+    (void)ev;
+    (void)data;
+    WorkQueue::Queue(&uptime_work);
+}
+
+/**
+ * Start the timer, ticking from the interrupts of 'dev'
+ */
+void Timer::Init(IClockEventDevice* dev)
 {
     Timer::v = 0;
+    Timer::_wheel_base = 0;
+    Timer::_dev = dev;
+    dev->SetPeriodic(tick_hz);
+
+    Timer::SchedulePeriodic(&uptime_ev, 1000, &OnUptimeEvent);
 }
 
 void Timer::Tick()
 {
-    Timer::v += 1;
-    if (Timer::v % 1000 == 0)
-	kprintf("%4d s\n", ((uint32_t)Timer::v/1000));
+    if (Timer::_tickless)
+	Timer::v = (Timer::GetNs() - Timer::_ns_offset) / ns_per_tick;
+    else
+	Timer::v += 1;
+
+    Timer::RunEvents();
+
+    if (Timer::_tickless)
+	Timer::ProgramNext();
 }
 
 uint64_t Timer::Get()
 {
+    // In tickless mode, we might be far away from the last interrupt
+    if (Timer::_tickless)
+	return (Timer::GetNs() - Timer::_ns_offset) / ns_per_tick;
+    
+    // A 64-bit read isn't atomic here, so the tick can't happen in between
+    InterruptGuard g;
     return Timer::v;
 }
+
+/**
+ * Enable or disable the tickless mode
+ * Tickless needs a clock source.
+ *
+ * @return true if the mode was changed, false if not
+ */
+bool Timer::SetTickless(bool enable)
+{
+    InterruptGuard g;
+    
+    if (!Timer::_dev || enable == Timer::_tickless)
+	return false;
+    
+    if (enable) {
+	if (!Timer::_clock)
+	    return false;
+
+	// Keep the tick count continuous
+	Timer::_ns_offset = Timer::GetNs() - (Timer::v * ns_per_tick);
+	Timer::_tickless = true;
+	Timer::ProgramNext();
+    } else {
+	Timer::_tickless = false;
+	Timer::_dev->SetPeriodic(tick_hz);
+    }
+
+    return true;
+}
+
+/**
+ * Set a high resolution clock source for GetNs()
+ */
+void Timer::SetClockSource(fnClockSource c)
+{
+    Timer::_clock = c;
+}
+
+/**
+ * Get a monotonic time, in nanoseconds
+ *
+ * Without a clock source, it will have only the resolution of the
+ * timer tick.
+ */
+uint64_t Timer::GetNs()
+{
+    if (Timer::_clock)
+	return Timer::_clock();
+
+    return Timer::Get() * 1000000;
+}
+
+/**
+ * Put the event in the slot its deadline belongs to
+ * Interrupts must be disabled
+ */
+void Timer::Enqueue(TimerEvent* ev)
+{
+    uint64_t expires = ev->deadline;
+    if (expires < _wheel_base)
+	expires = _wheel_base;
+
+    uint64_t delta = expires - _wheel_base;
+
+    /* Events too far away go to the last slot we can reach. They will be
+       put back in the right place when that slot cascades */
+    if (delta >= wheel_span)
+	expires = _wheel_base + wheel_span - 1;
+
+    unsigned level = 0;
+    while (level < TIMER_WHEEL_LEVELS-1 &&
+	   delta >= (1ULL << (TIMER_WHEEL_BITS * (level+1))))
+	level++;
+
+    unsigned idx = (expires >> (TIMER_WHEEL_BITS * level)) & wheel_mask;
+    TimerEvent** head = &_wheel[level][idx];
+    _wheel_pending[level] |= (1ULL << idx);
+
+    ev->next = *head;
+    if (ev->next)
+	ev->next->pprev = &ev->next;
+
+    ev->pprev = head;
+    *head = ev;
+}
+
+/**
+ * Take the event out of its slot
+ * Interrupts must be disabled
+ */
+void Timer::Dequeue(TimerEvent* ev)
+{
+    *ev->pprev = ev->next;
+    if (ev->next)
+	ev->next->pprev = ev->pprev;
+
+    // If we emptied a wheel slot, clear its pending bit
+    TimerEvent** first = &_wheel[0][0];
+    if (ev->pprev >= first &&
+	ev->pprev < first + (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SIZE) &&
+	*ev->pprev == NULL) {
+	unsigned slot = ev->pprev - first;
+	_wheel_pending[slot / TIMER_WHEEL_SIZE] &=
+	    ~(1ULL << (slot % TIMER_WHEEL_SIZE));
+    }
+
+    ev->next = NULL;
+    ev->pprev = NULL;
+}
+
+/**
+ * Redistribute the events of slot 'idx' of level 'level' into the
+ * levels below
+ *
+ * @return the slot index, so the caller knows if it needs to cascade
+ *         the level above too.
+ */
+unsigned Timer::Cascade(unsigned level, unsigned idx)
+{
+    TimerEvent* ev = _wheel[level][idx];
+    _wheel[level][idx] = NULL;
+    _wheel_pending[level] &= ~(1ULL << idx);
+
+    while (ev) {
+	TimerEvent* next = ev->next;
+	Timer::Enqueue(ev);
+	ev = next;
+    }
+
+    return idx;
+}
+
+/**
+ * Run all events due until the current tick
+ */
+void Timer::RunEvents()
+{
+    while (_wheel_base <= Timer::v) {
+	unsigned idx = _wheel_base & wheel_mask;
+
+	// The first level turned. Bring the next slot of the levels above
+	if (idx == 0) {
+	    for (unsigned level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+		unsigned lidx = (_wheel_base >> (TIMER_WHEEL_BITS * level)) &
+		    wheel_mask;
+		if (Timer::Cascade(level, lidx) != 0)
+		    break;
+	    }
+	}
+
+	/* Detach the whole slot at once. The callbacks might schedule or
+	   cancel other events, even ones of this same list */
+	TimerEvent* expired = _wheel[0][idx];
+	_wheel[0][idx] = NULL;
+	_wheel_pending[0] &= ~(1ULL << idx);
+	if (expired)
+	    expired->pprev = &expired;
+
+	_wheel_base++;
+
+	while (expired) {
+	    TimerEvent* ev = expired;
+	    Timer::Dequeue(ev);
+
+	    if (ev->period) {
+		ev->deadline += ev->period;
+		Timer::Enqueue(ev);
+	    }
+
+	    ev->callback(ev, ev->data);
+	}
+    }
+}
+
+/**
+ * Find the tick of the earliest event in the wheel
+ *
+ * It might be earlier than the real event (we might return the tick
+ * a level above cascades), but never later.
+ * @return the tick, or UINT64_MAX if there's no event
+ */
+uint64_t Timer::NextEventTick()
+{
+    unsigned idx = _wheel_base & wheel_mask;
+
+    /* Ticks until the first level turns. If we are at the start of a turn,
+       the cascade happens when this same tick is processed */
+    unsigned to_wrap = (idx) ? (TIMER_WHEEL_SIZE - idx) : 0;
+
+    uint64_t next = no_event;
+
+    /* The first level slots hold exactly one tick each. Rotate the bitmap
+       so the bit 0 is the slot of the next tick */
+    uint64_t pending = _wheel_pending[0];
+    if (idx)
+	pending = (pending >> idx) | (pending << (TIMER_WHEEL_SIZE - idx));
+
+    if (pending) {
+	uint32_t lo = (uint32_t)pending;
+	unsigned first = (lo) ? __builtin_ctz(lo) :
+	    32 + __builtin_ctz((uint32_t)(pending >> 32));
+	next = _wheel_base + first;
+    }
+
+    /* Events of the levels above are never due before they cascade,
+       and the first cascade is when the first level turns */
+    for (unsigned level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+	if (_wheel_pending[level]) {
+	    uint64_t cascade = _wheel_base + to_wrap;
+	    if (cascade < next)
+		next = cascade;
+	    break;
+	}
+    }
+
+    return next;
+}
+
+/**
+ * Program the timer device to interrupt at the next event
+ */
+void Timer::ProgramNext()
+{
+    uint64_t next = Timer::NextEventTick();
+    uint64_t now = Timer::GetNs();
+    uint64_t ns = _dev->GetMaxOneShot();
+
+    if (next != no_event) {
+	uint64_t target = Timer::_ns_offset + (next * ns_per_tick);
+	uint64_t until = (target > now) ? (target - now) : 0;
+
+	if (until < ns)
+	    ns = until;
+    }
+
+    Timer::_programmed_tick = next;
+    _dev->SetOneShot(ns);
+}
+
+/**
+ * Schedule 'ev' to call 'cb' at tick 'deadline'
+ * If the event is already scheduled, it is moved to the new deadline.
+ * A deadline in the past will expire on the next tick.
+ */
+void Timer::Schedule(TimerEvent* ev, uint64_t deadline,
+		     fnTimerCallback cb, void* data)
+{
+    InterruptGuard g;
+
+    if (Timer::IsPending(ev))
+	Timer::Dequeue(ev);
+
+    ev->deadline = deadline;
+    ev->period = 0;
+    ev->callback = cb;
+    ev->data = data;
+    Timer::Enqueue(ev);
+
+    // Wake up earlier, if needed
+    if (Timer::_tickless && deadline < Timer::_programmed_tick)
+	Timer::ProgramNext();
+}
+
+/**
+ * Schedule 'ev' to call 'cb' every 'period' ticks, starting 'period'
+ * ticks from now
+ */
+void Timer::SchedulePeriodic(TimerEvent* ev, uint64_t period,
+			     fnTimerCallback cb, void* data)
+{
+    InterruptGuard g;
+
+    Timer::Schedule(ev, Timer::Get() + period, cb, data);
+    ev->period = period;
+}
+
+/**
+ * Cancel a scheduled event
+ * Cancelling an event that isn't scheduled does nothing.
+ *
+ * @return true if the event was pending, false if not
+ */
+bool Timer::Cancel(TimerEvent* ev)
+{
+    InterruptGuard g;
+
+    if (!Timer::IsPending(ev))
+	return false;
+
+    Timer::Dequeue(ev);
+    return true;
+}
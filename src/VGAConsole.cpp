@@ -5,36 +5,78 @@
 using namespace annos;
 
 uint16_t* VGAConsole::_framebuffer = (uint16_t*)0xB8000;
-static void update_cursor(uint16_t x, uint16_t y, uint16_t w)
+
+// The shadow of the screen, a ring of rows
+static uint16_t vga_shadow[80*25];
+
+// Rows that fit in the 32 kB of text memory
+#define VGA_VRAM_ROWS (0x8000 / (80 * 2))
+
+// A black space char in white foreground
+#define VGA_BLANK 0x0720
+
+static void crtc_write16(uint8_t reg_hi, uint16_t val)
 {
-    uint16_t pos = (y * w) + x;
-    
-    ::x86::out8(0x3d4, 0x0f);
-    ::x86::out8(0x3d5, (pos & 0xff));
-    ::x86::out8(0x3d4, 0x0e);
-    ::x86::out8(0x3d5, (pos >> 8));    
+    ::x86::out8(0x3d4, reg_hi);
+    ::x86::out8(0x3d5, (val >> 8));
+    ::x86::out8(0x3d4, reg_hi + 1);
+    ::x86::out8(0x3d5, (val & 0xff));
+}
+
+// Address of a screen row in the shadow buffer
+uint16_t* VGAConsole::ShadowRow(unsigned y)
+{
+    return &vga_shadow[((_top + y) % _height) * _width];
 }
 
 // Scrolls the console up
 void VGAConsole::Scroll()
 {
-    for (unsigned y = 1; y < _height; y++) {
-	void* fbFrom = (void*) &this->_framebuffer[ (y*_width) ];
-	void* fbTo = (void*) &this->_framebuffer[ ((y-1)*_width) ];
-	
-	memcpy(fbTo, fbFrom, _width * sizeof(uint16_t));
+    _top = (_top + 1) % _height;
+    _vram_row++;
+
+    uint16_t* bottom = this->ShadowRow(_height-1);
+    for (unsigned i = 0; i < this->_width; i++)
+	bottom[i] = VGA_BLANK;
+
+    // The rows moved up with the screen. Only the new one must be written
+    _dirty = (_dirty >> 1) | (1u << (_height-1));
+}
+
+/**
+ * Copy the dirty rows to the video memory, and update the start
+ * address and the cursor
+ */
+void VGAConsole::Flush()
+{
+    // At the end of the video memory, go back to the start and redraw all
+    if (_vram_row + _height > VGA_VRAM_ROWS) {
+	_vram_row = 0;
+	_dirty = (1u << _height) - 1;
     }
 
-    uint16_t* fbBottom = &this->_framebuffer[(_height-1)*_width];
+    while (_dirty) {
+	unsigned y = __builtin_ctz(_dirty);
+	_dirty &= ~(1u << y);
+
+	memcpy(&_framebuffer[(_vram_row + y) * _width], this->ShadowRow(y),
+	       _width * sizeof(uint16_t));
+    }
 
-    for (unsigned i = 0; i < this->_width; i++) {
-	// Bottom is a black space char in white foreground
-	fbBottom[i] = 0x0720;
+    unsigned start = _vram_row * _width;
+    if (start != _hw_start) {
+	crtc_write16(0x0c, start);
+	_hw_start = start;
+    }
+
+    unsigned cursor = start + _yPos * _width + _xPos;
+    if (cursor != _hw_cursor) {
+	crtc_write16(0x0e, cursor);
+	_hw_cursor = cursor;
     }
 }
 
-void VGAConsole::WriteChar(const char c, BaseColors fgcolor,
-			   BaseColors bgcolor)
+void VGAConsole::WriteChar(const char c)
 {
     if (c == '\n') {
 	_xPos = 0;
@@ -48,9 +90,9 @@ void VGAConsole::WriteChar(const char c, BaseColors fgcolor,
 	}
 	
     } else {
-	uint8_t color = (uint8_t)fgcolor | ((uint8_t)bgcolor << 4);
-	uint16_t data = (uint16_t)c | ((uint16_t)color << 8);
-	_framebuffer[_yPos * _width + _xPos] = data;
+	uint16_t data = (uint8_t)c | ((uint16_t)_color << 8);
+	this->ShadowRow(_yPos)[_xPos] = data;
+	_dirty |= (1u << _yPos);
 	_xPos++;
     }
 
@@ -66,97 +108,132 @@ void VGAConsole::WriteChar(const char c, BaseColors fgcolor,
    
 }
 
+/**
+ * Get the attribute byte from the ANSI attributes and the
+ * write color
+ */
+void VGAConsole::UpdateColor(const AnsiAttr& attr)
+{
+    unsigned fg, bg;
+
+    switch (attr.fg.type) {
+    case AnsiColorIndex: fg = attr.fg.index; break;
+    case AnsiColorRGB:
+	fg = AnsiNearestVGA(attr.fg.r, attr.fg.g, attr.fg.b);
+	break;
+    default: fg = _write_color; break;
+    }
+
+    switch (attr.bg.type) {
+    case AnsiColorIndex: bg = attr.bg.index; break;
+    case AnsiColorRGB:
+	bg = AnsiNearestVGA(attr.bg.r, attr.bg.g, attr.bg.b);
+	break;
+    default: bg = Black; break;
+    }
+
+    if (attr.bold)
+	fg |= 0x8;
+
+    // The background intensity bit is the blink bit
+    _color = (fg & 0xf) | ((bg & 0x7) << 4);
+}
+
+void VGAConsole::AnsiText(const char* str, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+	this->WriteChar(str[i]);
+}
+
+void VGAConsole::AnsiAttributes(const AnsiAttr& attr)
+{
+    this->UpdateColor(attr);
+}
+
+void VGAConsole::AnsiGetCursor(unsigned& x, unsigned& y)
+{
+    x = _xPos;
+    y = _yPos;
+}
+
+void VGAConsole::AnsiSetCursor(unsigned x, unsigned y)
+{
+    _xPos = (x < _width) ? x : _width - 1;
+    _yPos = (y < _height) ? y : _height - 1;
+}
+
+// Clear 'count' characters from column 'x' of row 'y'
+void VGAConsole::EraseChars(unsigned x, unsigned y, unsigned count)
+{
+    // Erased cells keep the current background
+    uint16_t blank = ' ' | (uint16_t(0x07 | (_color & 0x70)) << 8);
+    uint16_t* row = this->ShadowRow(y);
+
+    for (unsigned i = x; i < x + count; i++)
+	row[i] = blank;
+
+    _dirty |= (1u << y);
+}
+
+void VGAConsole::AnsiEraseLine(AnsiErase mode)
+{
+    switch (mode) {
+    case AnsiEraseToEnd:
+	this->EraseChars(_xPos, _yPos, _width - _xPos);
+	break;
+    case AnsiEraseToStart:
+	this->EraseChars(0, _yPos, _xPos + 1);
+	break;
+    case AnsiEraseAll:
+	this->EraseChars(0, _yPos, _width);
+	break;
+    }
+}
+
+void VGAConsole::AnsiEraseScreen(AnsiErase mode)
+{
+    this->AnsiEraseLine(mode);
+
+    unsigned first = (mode == AnsiEraseToEnd) ? _yPos + 1 : 0;
+    unsigned last = (mode == AnsiEraseToStart) ? _yPos : _height;
+    for (unsigned y = first; y < last; y++) {
+	if (y != _yPos)
+	    this->EraseChars(0, y, _width);
+    }
+}
+
 /* Write function for VGA-compatible output */
 void VGAConsole::WriteVGA(const char* str, BaseColors color)
 {
-    BaseColors setcolor = color;
-    BaseColors backcolor = BaseColors::Black;
-    while (*str != '\0') {
-
-	// Process escape sequence
-	if (*str == '\033') {
-	    str++;
-	    bool escape_in = true;
-	    while (escape_in) {	    
-		switch (*str++) {
-		case '0': // Return to normal
-		    setcolor = color;
-		    backcolor = BaseColors::Black;
-		    break;
-			
-		case '1': // Bold
-		{
-		    int _sc = setcolor + 8;
-		    setcolor = (BaseColors)_sc;
-		}
-		break;
-		
-		case '3': // Set foreground
-		{
-		    bool bold = (setcolor >= 8);
-		    switch (*str++) {
-		    case '0': setcolor = BaseColors::Black; break;
-		    case '1': setcolor = BaseColors::Red; break;
-		    case '2': setcolor = BaseColors::Green; break;
-		    case '3': setcolor = BaseColors::Brown; break;
-		    case '4': setcolor = BaseColors::Blue; break;
-		    case '5': setcolor = BaseColors::Magenta; break;
-		    case '6': setcolor = BaseColors::Cyan; break;
-		    case '7': setcolor = BaseColors::LightGrey; break;
-			
-		    }
-		    if (bold) {
-			int _sc = setcolor + 8;
-			setcolor = (BaseColors)_sc;
-		    }
-		}
-		break;
-
-		case '4': // Set background
-		{
-		    switch (*str++) {
-		    case '0': backcolor = BaseColors::Black; break;
-		    case '1': backcolor = BaseColors::Red; break;
-		    case '2': backcolor = BaseColors::Green; break;
-		    case '3': backcolor = BaseColors::Brown; break;
-		    case '4': backcolor = BaseColors::Blue; break;
-		    case '5': backcolor = BaseColors::Magenta; break;
-		    case '6': backcolor = BaseColors::Cyan; break;
-		    case '7': backcolor = BaseColors::LightGrey; break;
-			
-		    }
-		}
-		break;
-		    
-		case 'm': //End
-		    escape_in = false;
-		    break;
-		
-		}
-		
-	    }
-	}
-	    
-	this->WriteChar(*str, setcolor, backcolor);
-	str++;
-    }
-    update_cursor(_xPos, _yPos, _width);
+    _write_color = color;
+    this->UpdateColor(_ansi.GetAttributes());
+
+    _ansi.Feed(this, str);
+    this->Flush();
 }
 
 /* Clears the screen */
 void VGAConsole::Clear()
 {
-    for (auto i = 0; i < _width*_height; i++) {
-	// Clears it all with a black space char in white foreground
-	_framebuffer[i] = 0x0720; 
-    }
+    for (unsigned i = 0; i < _width*_height; i++)
+	vga_shadow[i] = VGA_BLANK;
+
+    _top = 0;
+    _vram_row = 0;
+    _dirty = (1u << _height) - 1;
+
+    // We don't know where the BIOS left them
+    _hw_start = ~0u;
+    _hw_cursor = ~0u;
 
     _xPos = 0;
     _yPos = 0;
+    this->Flush();
 }
 
-/* Write function for RGB-compatible output */
+/* Write function for RGB-compatible output
+   We use the nearest of the 16 VGA colors */
 void VGAConsole::WriteRGB(const char* str, uint8_t r, uint8_t g, uint8_t b)
 {
-    
+    this->WriteVGA(str, (BaseColors)AnsiNearestVGA(r, g, b));
 }
@@ -0,0 +1,96 @@
+#include <WorkQueue.hpp>
+#include <arch/x86/InterruptGuard.hpp>
+
+/**
+ * Deferred work queue
+ *
+ * Copyright (C) 2018 Arthur M
+ */
+
+using namespace annos;
+using annos::x86::InterruptGuard;
+
+WorkItem* WorkQueue::_head = NULL;
+WorkItem* WorkQueue::_tail = NULL;
+
+/**
+ * Queue a work item to run later
+ * Safe to call from interrupt handlers.
+ *
+ * @return true if queued, false if it was already in the queue
+ */
+bool WorkQueue::Queue(WorkItem* w)
+{
+    InterruptGuard g;
+
+    if (w->queued)
+	return false;
+
+    w->queued = true;
+    w->next = NULL;
+
+    if (_tail)
+	_tail->next = w;
+    else
+	_head = w;
+
+    _tail = w;
+    return true;
+}
+
+/**
+ * Run all the queued work, in the order it was queued.
+ * Work queued while we run will also run.
+ */
+void WorkQueue::Run()
+{
+    while (WorkQueue::RunOne())
+	;
+}
+
+/**
+ * Run only the first queued work item
+ *
+ * @return true if something ran, false if the queue was empty
+ */
+bool WorkQueue::RunOne()
+{
+    WorkItem* w;
+
+    {
+	InterruptGuard g;
+
+	w = _head;
+	if (!w)
+	    return false;
+
+	_head = w->next;
+	if (!_head)
+	    _tail = NULL;
+
+	/* Clear it before running, so the handler (or an interrupt)
+	   can queue it again */
+	w->next = NULL;
+	w->queued = false;
+    }
+
+    w->handler(w, w->data);
+    return true;
+}
+
+/**
+ * Halt the processor until the next interrupt, unless there's work
+ * to do
+ */
+void WorkQueue::WaitForWork()
+{
+    // The clobber keeps the compiler from reading '_head' before the 'cli'
+    asm volatile("cli" ::: "memory");
+
+    /* 'sti' only takes effect after the next instruction, so no interrupt
+       can sneak in between the check and the 'hlt' */
+    if (!_head)
+	asm volatile("sti; hlt" ::: "memory");
+    else
+	asm volatile("sti" ::: "memory");
+}
@@ -0,0 +1,198 @@
+#include <arch/x86/ACPI.hpp>
+#include <arch/x86/VMM.hpp>
+#include <libk/stdlib.h>
+#include <Log.hpp>
+
+/*
+  ACPI table discovery
+
+  Copyright (C) 2018 Arthur M
+
+ */
+
+using namespace annos;
+using namespace annos::x86;
+
+ACPI_RSDP* ACPI::_rsdp = NULL;
+ACPI_SDTHeader* ACPI::_rsdt = NULL;
+
+// The first 4 MB of physical memory are mapped here
+constexpr uintptr_t low_mem_virt = 0xc0000000;
+
+// Tables already mapped, so we don't map them again on each search
+#define MAX_ACPI_TABLES 32
+static struct {
+    uintptr_t phys;
+    ACPI_SDTHeader* virt;
+} mapped_tables[MAX_ACPI_TABLES];
+static unsigned mapped_count = 0;
+
+/* Copy a fixed-size, non-terminated firmware string into 'dst' */
+static const char* FixedString(char* dst, const char* src, size_t len)
+{
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+    return dst;
+}
+
+/**
+ * Check if the 'len' bytes of 'ptr' add to 0
+ */
+bool ACPI::CheckSum(const void* ptr, size_t len)
+{
+    const uint8_t* b = (const uint8_t*)ptr;
+    uint8_t sum = 0;
+    for (size_t i = 0; i < len; i++)
+	sum += b[i];
+
+    return (sum == 0);
+}
+
+/**
+ * Look for the RSDP in the 'len' bytes starting at physical
+ * address 'start'
+ */
+ACPI_RSDP* ACPI::SearchRSDP(uintptr_t start, size_t len)
+{
+    // It's always in a 16-byte boundary
+    for (uintptr_t addr = start; addr < start + len; addr += 16) {
+	ACPI_RSDP* r = (ACPI_RSDP*)(addr + low_mem_virt);
+
+	if (memcmp(r->signature, "RSD PTR ", 8))
+	    continue;
+
+	// The ACPI 1.0 part is 20 bytes long
+	if (!ACPI::CheckSum(r, 20))
+	    continue;
+
+	return r;
+    }
+
+    return NULL;
+}
+
+/**
+ * Map a system description table, with its full length
+ */
+ACPI_SDTHeader* ACPI::MapTable(uintptr_t phys)
+{
+    for (unsigned i = 0; i < mapped_count; i++) {
+	if (mapped_tables[i].phys == phys)
+	    return mapped_tables[i].virt;
+    }
+
+    // Map the header first, so we know the length
+    unsigned off = phys & 0xfff;
+    size_t pages = (off + sizeof(ACPI_SDTHeader) + VMM_PAGE_SIZE - 1) / VMM_PAGE_SIZE;
+    auto hdr = (ACPI_SDTHeader*)VMM::MapMMIO(phys, pages, VMMFlags::ReadOnly);
+
+    // If it doesn't fit, drop the header mapping and map all of it
+    size_t fullpages = (off + hdr->length + VMM_PAGE_SIZE - 1) / VMM_PAGE_SIZE;
+    if (fullpages > pages) {
+	VMM::Unmap((virt_t)hdr & ~0xfff, pages);
+	hdr = (ACPI_SDTHeader*)VMM::MapMMIO(phys, fullpages, VMMFlags::ReadOnly);
+	pages = fullpages;
+    }
+
+    if (!ACPI::CheckSum(hdr, hdr->length)) {
+	char sig[5];
+	LOG(Warning, "acpi", "table %s at 0x%08x has a bad checksum",
+	    FixedString(sig, hdr->signature, 4), phys);
+	VMM::Unmap((virt_t)hdr & ~0xfff, pages);
+	return NULL;
+    }
+
+    if (mapped_count < MAX_ACPI_TABLES) {
+	mapped_tables[mapped_count].phys = phys;
+	mapped_tables[mapped_count].virt = hdr;
+	mapped_count++;
+    }
+
+    return hdr;
+}
+
+/**
+ * Find the ACPI tables
+ * Needs the VMM, because the tables are usually at the end of the RAM
+ *
+ * @return true if found, false if not
+ */
+bool ACPI::Init()
+{
+    /* The RSDP is in the first KB of the EBDA, or in the BIOS ROM area,
+       from 0xe0000 to 0xfffff.
+       The BIOS data area has the EBDA segment at 0x40e */
+    uintptr_t ebda = (*(uint16_t*)(low_mem_virt + 0x40e)) << 4;
+    ACPI_RSDP* r = NULL;
+
+    if (ebda >= 0x80000 && ebda < 0xa0000)
+	r = ACPI::SearchRSDP(ebda, 1024);
+
+    if (!r)
+	r = ACPI::SearchRSDP(0xe0000, 0x20000);
+
+    if (!r) {
+	LOG(Warning, "acpi", "no RSDP found");
+	return false;
+    }
+
+    LOG(Info, "acpi", "RSDP found at 0x%08x, revision %d",
+	(uintptr_t)r - low_mem_virt, r->revision);
+
+    /* We are a 32-bit system, so the RSDT is enough, but some machines
+       only have the XSDT. Its pointers are 64-bit wide */
+    uintptr_t rsdt_phys = r->rsdt_addr;
+    if (!rsdt_phys && r->revision >= 2 && (r->xsdt_addr >> 32) == 0)
+	rsdt_phys = (uintptr_t)r->xsdt_addr;
+
+    if (!rsdt_phys) {
+	LOG(Warning, "acpi", "no usable RSDT");
+	return false;
+    }
+
+    ACPI::_rsdp = r;
+    ACPI::_rsdt = ACPI::MapTable(rsdt_phys);
+    if (!ACPI::_rsdt)
+	return false;
+
+    char sig[5], oem[7];
+    LOG(Info, "acpi", "%s at 0x%08x, oem '%s'",
+	FixedString(sig, _rsdt->signature, 4), rsdt_phys,
+	FixedString(oem, _rsdt->oem_id, 6));
+    return true;
+}
+
+/**
+ * Find the table with signature 'sig'
+ * 'idx' is used to get the next table with the same signature
+ *
+ * @return a pointer to the mapped table, or NULL if not found
+ */
+ACPI_SDTHeader* ACPI::FindTable(const char* sig, unsigned idx)
+{
+    if (!ACPI::_rsdt)
+	return NULL;
+
+    bool is_xsdt = !memcmp(_rsdt->signature, "XSDT", 4);
+    unsigned ptrsize = (is_xsdt) ? 8 : 4;
+    unsigned count = (_rsdt->length - sizeof(ACPI_SDTHeader)) / ptrsize;
+    uint8_t* ptrs = ((uint8_t*)_rsdt) + sizeof(ACPI_SDTHeader);
+
+    for (unsigned i = 0; i < count; i++) {
+	// Tables above 4 GB are unreachable for us. XSDT is little endian
+	uintptr_t phys = *(uint32_t*)(ptrs + i*ptrsize);
+	if (is_xsdt && *(uint32_t*)(ptrs + i*ptrsize + 4))
+	    continue;
+
+	ACPI_SDTHeader* h = ACPI::MapTable(phys);
+	if (!h || memcmp(h->signature, sig, 4))
+	    continue;
+
+	if (idx == 0)
+	    return h;
+
+	idx--;
+    }
+
+    return NULL;
+}
@@ -0,0 +1,406 @@
+#include <arch/x86/APIC.hpp>
+#include <arch/x86/ACPI.hpp>
+#include <arch/x86/VMM.hpp>
+#include <arch/x86/IRQHandler.hpp>
+#include <libk/panic.h>
+#include <Log.hpp>
+
+/**
+ * Driver for the Advanced Programmable Interrupt Controller
+ *
+ * Copyright (C) 2018 Arthur M
+ */
+
+using namespace annos;
+using namespace annos::x86;
+
+// The vector the local APIC sends on spurious interrupts
+#define APIC_SPURIOUS_VECTOR 0xff
+
+// Redirection entry bits
+#define IOAPIC_ACTIVE_LOW (1 << 13)
+#define IOAPIC_LEVEL (1 << 15)
+#define IOAPIC_MASKED (1 << 16)
+
+// Local vector table bits
+#define LVT_MASKED (1 << 16)
+#define LVT_NMI (0x4 << 8)
+
+// MSI messages are writes to this address range
+#define MSI_ADDRESS_BASE 0xfee00000
+
+// The IA32_APIC_BASE MSR. Bit 11 enables the local APIC
+#define MSR_APIC_BASE 0x1b
+
+// Interrupt command register bits
+#define ICR_INIT (0x5 << 8)
+#define ICR_STARTUP (0x6 << 8)
+#define ICR_PENDING (1 << 12)
+#define ICR_ASSERT (1 << 14)
+#define ICR_LEVEL (1 << 15)
+
+/**
+ * Check if the processor has a local APIC, and if the firmware
+ * tells us where the I/O APICs are
+ */
+bool APIC::Detect()
+{
+    uint32_t eax = 1, ebx, ecx, edx;
+    asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+
+    if (!(edx & (1 << 9)))
+	return false;
+
+    return (ACPI::FindTable("APIC") != NULL);
+}
+
+/**
+ * Read the MADT, and fill the I/O APIC list and the ISA IRQ
+ * routes
+ */
+void APIC::ParseMADT()
+{
+    auto madt = (ACPI_MADT*)ACPI::FindTable("APIC");
+    if (!madt)
+	panic("APIC: no MADT");
+
+    _lapic_phys = madt->lapic_addr;
+
+    // ISA IRQs are identity mapped, edge triggered, active high by default
+    for (unsigned i = 0; i < 16; i++)
+	_isa[i] = {.gsi = i, .flags = 0, .valid = true};
+
+    uint8_t* ptr = ((uint8_t*)madt) + sizeof(ACPI_MADT);
+    uint8_t* end = ((uint8_t*)madt) + madt->hdr.length;
+
+    while (ptr < end) {
+	auto e = (ACPI_MADTEntry*)ptr;
+	if (e->length < sizeof(ACPI_MADTEntry))
+	    break;
+
+	switch (e->type) {
+	case MADTLocalAPIC: {
+	    auto lapic = (ACPI_MADTLocalAPIC*)e;
+
+	    // Disabled processors can't be started
+	    if (!(lapic->flags & 0x1))
+		break;
+
+	    if (_cpu_count >= MAX_CPUS) {
+		LOG(Warning, "apic", "too many processors, ignoring #%d",
+		    lapic->apic_id);
+		break;
+	    }
+
+	    _cpu_ids[_cpu_count++] = lapic->apic_id;
+	    break;
+	}
+
+	case MADTIOAPIC: {
+	    auto io = (ACPI_MADTIOAPIC*)e;
+	    if (_ioapic_count >= MAX_IOAPICS) {
+		LOG(Warning, "apic", "too many I/O APICs, ignoring #%d",
+		    io->ioapic_id);
+		break;
+	    }
+
+	    IOAPICInfo* info = &_ioapics[_ioapic_count++];
+	    info->id = io->ioapic_id;
+	    info->gsi_base = io->gsi_base;
+	    info->regs = (volatile uint32_t*)VMM::MapMMIO(io->ioapic_addr);
+	    info->count = ((this->ReadIOAPIC(info, 1) >> 16) & 0xff) + 1;
+
+	    LOG(Info, "apic", "I/O APIC #%d at 0x%08x, GSIs %d to %d",
+		info->id, io->ioapic_addr, info->gsi_base,
+		info->gsi_base + info->count - 1);
+	    break;
+	}
+
+	case MADTInterruptOverride: {
+	    auto ov = (ACPI_MADTInterruptOverride*)e;
+	    if (ov->bus != 0 || ov->source >= 16)
+		break;
+
+	    uint32_t flags = 0;
+
+	    // 'Conforms to the bus' means active high, edge triggered for ISA
+	    if ((ov->flags & 0x3) == 0x3)
+		flags |= IOAPIC_ACTIVE_LOW;
+	    if (((ov->flags >> 2) & 0x3) == 0x3)
+		flags |= IOAPIC_LEVEL;
+
+	    _isa[ov->source].gsi = ov->gsi;
+	    _isa[ov->source].flags = flags;
+
+	    LOG(Info, "apic", "ISA IRQ %d goes to GSI %d (flags %04x)",
+		ov->source, ov->gsi, ov->flags);
+	    break;
+	}
+
+	case MADTLocalAPICOverride: {
+	    // 64-bit address. We can only use it if it's below 4 GB
+	    uint64_t addr = *(uint64_t*)(ptr + 4);
+	    if ((addr >> 32) == 0)
+		_lapic_phys = (uintptr_t)addr;
+	    break;
+	}
+	}
+
+	ptr += e->length;
+    }
+
+    /* If an IRQ was moved to another GSI, no other IRQ can use that
+       GSI, even the ones that would be identity mapped to it
+       (usually, the PIT is moved to GSI 2, the old cascade) */
+    for (unsigned i = 0; i < 16; i++) {
+	for (unsigned j = 0; j < 16; j++) {
+	    if (i != j && _isa[j].gsi != j && _isa[j].gsi == _isa[i].gsi &&
+		_isa[i].gsi == i)
+		_isa[i].valid = false;
+	}
+    }
+}
+
+/**
+ * Find the I/O APIC that handles the global system interrupt 'gsi'
+ */
+IOAPICInfo* APIC::FindIOAPIC(unsigned gsi)
+{
+    for (unsigned i = 0; i < _ioapic_count; i++) {
+	IOAPICInfo* io = &_ioapics[i];
+	if (gsi >= io->gsi_base && gsi < io->gsi_base + io->count)
+	    return io;
+    }
+
+    return NULL;
+}
+
+uint32_t APIC::ReadIOAPIC(IOAPICInfo* io, unsigned reg)
+{
+    io->regs[0] = reg;    // IOREGSEL
+    return io->regs[4];   // IOWIN, at offset 0x10
+}
+
+void APIC::WriteIOAPIC(IOAPICInfo* io, unsigned reg, uint32_t val)
+{
+    io->regs[0] = reg;
+    io->regs[4] = val;
+}
+
+/**
+ * Set the redirection entry of 'gsi'
+ */
+void APIC::SetRedirection(unsigned gsi, uint8_t vector, uint32_t flags,
+			  bool masked)
+{
+    IOAPICInfo* io = this->FindIOAPIC(gsi);
+    if (!io)
+	return;
+
+    unsigned reg = 0x10 + (gsi - io->gsi_base) * 2;
+
+    // Fixed delivery, physical destination mode
+    uint32_t low = vector | flags;
+    if (masked)
+	low |= IOAPIC_MASKED;
+
+    // Write the destination first, so we never send it to the wrong place
+    this->WriteIOAPIC(io, reg, IOAPIC_MASKED);
+    this->WriteIOAPIC(io, reg+1, uint32_t(_bsp_id) << 24);
+    this->WriteIOAPIC(io, reg, low);
+}
+
+/**
+ * Map and enable the local APIC, and route the ISA IRQs through
+ * the I/O APICs, all of them masked
+ */
+void APIC::Initialize()
+{
+    this->ParseMADT();
+
+    if (_ioapic_count == 0)
+	panic("APIC: no I/O APIC found");
+
+    _lapic = (volatile uint32_t*)VMM::MapMMIO(_lapic_phys);
+    this->InitializeLocal();
+    _bsp_id = this->GetID();
+
+    LOG(Info, "apic", "local APIC #%d at 0x%08x, version %02x, "
+	"%d processors", _bsp_id, _lapic_phys,
+	this->ReadLAPIC(LAPIC_Version) & 0xff, _cpu_count);
+
+    this->MaskAll();
+
+    // ISA IRQs use the same vectors as with the 8259
+    for (unsigned i = 0; i < 16; i++) {
+	if (_isa[i].valid)
+	    this->SetRedirection(_isa[i].gsi, IRQHandler::GetVector(i),
+				 _isa[i].flags, true);
+    }
+}
+
+/**
+ * Enable and set up the local APIC of the current processor
+ * Each processor must call it, since each has its own.
+ */
+void APIC::InitializeLocal()
+{
+    // Make sure the local APIC is enabled. Some firmwares disable it
+    uint32_t lo, hi;
+    asm volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(MSR_APIC_BASE));
+    if (!(lo & (1 << 11))) {
+	lo |= (1 << 11);
+	asm volatile("wrmsr" :: "a"(lo), "d"(hi), "c"(MSR_APIC_BASE));
+    }
+
+    // Accept all interrupt priorities
+    this->WriteLAPIC(LAPIC_TPR, 0);
+
+    /* We don't use the local APIC timer yet.
+       LINT0 is where the 8259 would be connected, and LINT1 is the NMI */
+    this->WriteLAPIC(LAPIC_LVTTimer, LVT_MASKED);
+    this->WriteLAPIC(LAPIC_LVTLINT0, LVT_MASKED);
+    this->WriteLAPIC(LAPIC_LVTLINT1, LVT_NMI);
+    this->WriteLAPIC(LAPIC_LVTError, LVT_MASKED);
+
+    // Enable the local APIC, with its spurious vector
+    this->WriteLAPIC(LAPIC_SVR, 0x100 | APIC_SPURIOUS_VECTOR);
+
+    // Clear any pending interrupt
+    this->WriteLAPIC(LAPIC_EOI, 0);
+}
+
+/**
+ * Send an inter-processor interrupt, and wait for the local APIC
+ * to deliver it
+ *
+ * @return false if it wasn't delivered
+ */
+bool APIC::SendIPI(uint8_t apic_id, uint32_t icr)
+{
+    // Clear the errors of the previous IPIs
+    this->WriteLAPIC(LAPIC_ESR, 0);
+
+    // Writing the low half sends it
+    this->WriteLAPIC(LAPIC_ICRHigh, uint32_t(apic_id) << 24);
+    this->WriteLAPIC(LAPIC_ICRLow, icr);
+
+    for (unsigned i = 0; i < 100000; i++) {
+	if (!(this->ReadLAPIC(LAPIC_ICRLow) & ICR_PENDING))
+	    return true;
+
+	asm volatile("pause");
+    }
+
+    LOG(Warning, "apic", "IPI %08x to #%d was not delivered",
+	icr, apic_id);
+    return false;
+}
+
+/**
+ * Send an INIT to the processor 'apic_id', resetting it to the
+ * wait-for-SIPI state
+ */
+bool APIC::SendInit(uint8_t apic_id)
+{
+    if (!this->SendIPI(apic_id, ICR_INIT | ICR_ASSERT | ICR_LEVEL))
+	return false;
+
+    // The old 82489DX APICs also need the deassert
+    return this->SendIPI(apic_id, ICR_INIT | ICR_LEVEL);
+}
+
+/**
+ * Send a startup IPI to the processor 'apic_id'
+ * It starts in real mode, at the page-aligned address 'addr', below
+ * 1 MB
+ */
+bool APIC::SendStartup(uint8_t apic_id, uintptr_t addr)
+{
+    if ((addr & 0xfff) || addr >= 0x100000)
+	panic("APIC: the startup address must be page-aligned, below 1 MB");
+
+    return this->SendIPI(apic_id, ICR_STARTUP | (addr >> 12));
+}
+
+void APIC::Reset()
+{
+    this->Initialize();
+}
+
+/**
+ * Enable/disable IRQ mask for a certain IRQ
+ * 'status' true means masked.
+ */
+void APIC::SetIRQMask(unsigned irqno, bool status)
+{
+    if (irqno >= 16)
+	panic("the APIC driver only routes the 16 ISA IRQs");
+
+    if (!_isa[irqno].valid)
+	return;
+
+    IOAPICInfo* io = this->FindIOAPIC(_isa[irqno].gsi);
+    if (!io)
+	return;
+
+    unsigned reg = 0x10 + (_isa[irqno].gsi - io->gsi_base) * 2;
+    uint32_t val = this->ReadIOAPIC(io, reg);
+
+    if (status)
+	val |= IOAPIC_MASKED;
+    else
+	val &= ~IOAPIC_MASKED;
+
+    this->WriteIOAPIC(io, reg, val);
+}
+
+/**
+ * Get IRQ mask status
+ *
+ * @returns true if unmasked, false if masked
+ */
+bool APIC::GetIRQMask(unsigned irqno)
+{
+    if (irqno >= 16 || !_isa[irqno].valid)
+	return false;
+
+    IOAPICInfo* io = this->FindIOAPIC(_isa[irqno].gsi);
+    if (!io)
+	return false;
+
+    unsigned reg = 0x10 + (_isa[irqno].gsi - io->gsi_base) * 2;
+    return (this->ReadIOAPIC(io, reg) & IOAPIC_MASKED) == 0;
+}
+
+/**
+ * Mask all I/O APIC redirection entries
+ */
+void APIC::MaskAll()
+{
+    for (unsigned i = 0; i < _ioapic_count; i++) {
+	IOAPICInfo* io = &_ioapics[i];
+
+	for (unsigned e = 0; e < io->count; e++) {
+	    unsigned reg = 0x10 + e*2;
+	    this->WriteIOAPIC(io, reg,
+			      this->ReadIOAPIC(io, reg) | IOAPIC_MASKED);
+	}
+    }
+}
+
+/**
+ * MSIs are sent straight to our local APIC, with the IRQ vector
+ */
+bool APIC::GetMSIMessage(unsigned irqno, uint32_t& addr, uint32_t& data)
+{
+    if (irqno >= MAX_IRQS)
+	return false;
+
+    // Physical destination, no redirection hint
+    addr = MSI_ADDRESS_BASE | (uint32_t(_bsp_id) << 12);
+
+    // Fixed delivery, edge triggered
+    data = IRQHandler::GetVector(irqno);
+    return true;
+}
@@ -1,4 +1,5 @@
 #include <arch/x86/IO.hpp>
+#include <arch/x86/TSC.hpp>
 
 
 /* 
@@ -7,9 +8,16 @@
    Copyright (C) 2018 Arthur M
  */
 
+using annos::x86::TSC;
+
+#ifdef ANNOS_IO_STATS
+volatile uint32_t annos::x86::io_port_accesses = 0;
+#endif
+
 
 uint8_t annos::x86::in8(uint16_t port)
 {
+    IO_STATS_COUNT();
     uint8_t val = 0;
     asm("inb %1, %0" : "=a"(val) : "Nd"(port) );
 
@@ -18,12 +26,14 @@ uint8_t annos::x86::in8(uint16_t port)
 
 void annos::x86::out8(uint16_t port, uint8_t val)
 {
+    IO_STATS_COUNT();
     
     asm("outb %0, %1" : : "a"(val), "Nd"(port) );
 }
 
 uint16_t annos::x86::in16(uint16_t port)
 {
+    IO_STATS_COUNT();
     uint16_t val = 0;
     asm("inw %1, %0" : "=a"(val) : "Nd"(port) );
 
@@ -32,11 +42,13 @@ uint16_t annos::x86::in16(uint16_t port)
 
 void annos::x86::out16(uint16_t port, uint16_t val)
 {
+    IO_STATS_COUNT();
     asm("outw %0, %1" : : "a"(val), "Nd"(port) );
 }
 
 uint32_t annos::x86::in32(uint16_t port)
 {
+    IO_STATS_COUNT();
     uint32_t val = 0;
     asm("inl %1, %0" : "=a"(val) : "Nd"(port) );
 
@@ -45,13 +57,39 @@ uint32_t annos::x86::in32(uint16_t port)
 
 void annos::x86::out32(uint16_t port, uint32_t val)
 {
+    IO_STATS_COUNT();
     asm("outl %0, %1" : : "a"(val), "Nd"(port) );
 }
 
-void annos::x86::iodelay(unsigned n)
+/* Wait 'n' microseconds, using the POST port.
+   Good enough when we don't have a calibrated TSC */
+static void postdelay(unsigned n)
+{
+    for (unsigned i = 0; i < n; i++)
+	annos::x86::out8(0x80, 0);
+}
+
+void annos::x86::udelay(unsigned us)
 {
-    volatile unsigned i = 0;
-    for (i = 0; i < n; i++)
-	asm volatile("xor %eax, %eax"); //32 bit NOP
-	
+    if (!TSC::IsCalibrated()) {
+	postdelay(us);
+	return;
+    }
+
+    uint64_t end = TSC::Read() + (uint64_t)us * TSC::GetCyclesPerMicrosecond();
+    while (TSC::Read() < end)
+	asm volatile("pause");
+}
+
+void annos::x86::ndelay(unsigned ns)
+{
+    if (!TSC::IsCalibrated()) {
+	postdelay((ns + 999) / 1000);
+	return;
+    }
+
+    uint64_t cycles = ((uint64_t)ns * TSC::GetCyclesPerMicrosecond()) / 1000;
+    uint64_t end = TSC::Read() + cycles;
+    while (TSC::Read() < end)
+	asm volatile("pause");
 }
@@ -4,70 +4,215 @@
  * IRQ means Interrupt Request, something that the device 
  * issues when it needs processor attention
  *
- * The interrupt vectors 32 to 48 are reserved for IRQs
+ * The interrupt vectors 32 to 254 are reserved for IRQs. The first 16
+ * are the ISA IRQs, the others are allocated for MSI
  * This is what the drivers will use, so watch out...
  */
 
 #include <arch/x86/IRQHandler.hpp>
 #include <libk/stdio.h>
 #include <libk/panic.h>
+#include <arch/x86/InterruptGuard.hpp>
+#include <arch/x86/IO.hpp>
+#include <arch/x86/TSC.hpp>
+#include <WorkQueue.hpp>
 
 #include <Log.hpp>
 
 using namespace annos::x86;
+using annos::WorkItem;
+using annos::WorkQueue;
 
 /**
- * Functions to IRQ handlers
+ * Addresses of the IRQ stubs, one for each IRQ
  */
-extern "C" void irq0();
-extern "C" void irq1();
-extern "C" void irq2();
-extern "C" void irq3();
-extern "C" void irq4();
-extern "C" void irq5();
-extern "C" void irq6();
-extern "C" void irq7();
-extern "C" void irq8();
-extern "C" void irq9();
-extern "C" void irq10();
-extern "C" void irq11();
-extern "C" void irq12();
-extern "C" void irq13();
-extern "C" void irq14();
-extern "C" void irq15();
+extern "C" uintptr_t irq_stub_table[MAX_IRQS];
+extern "C" void irq_spurious();
 
 
 IDT* IRQHandler::_idt;
 
 // The IRQ controller being used
-i8259* _irq_control;
+IIRQController* _irq_control;
 
-void IRQHandler::Init(IDT* idt, i8259* irqcontrol)
+// The vector the local APIC uses for spurious interrupts
+#define SPURIOUS_VECTOR 0xFF
+
+#define compiler_barrier() asm volatile("" ::: "memory")
+
+/**
+ * A handler registered to an IRQ
+ *
+ * They form a singly linked list for each IRQ. Readers (the dispatcher and
+ * the bottom half) walk it without locks, so a removed action keeps its
+ * 'next' pointer, and its memory is only reused when no reader is left.
+ */
+struct IRQAction {
+    IIRQHandlerDevice* dev = NULL;
+    IRQAction* next = NULL;
+
+    // Removed, waiting until no reader can see it
+    IRQAction* retired_next = NULL;
+
+    // OnIRQ() asked for OnIRQThread()
+    volatile bool thread_pending = false;
+    bool used = false;
+};
+
+// We have no heap, so the actions come from here
+#define MAX_IRQ_ACTIONS 64
+static IRQAction irqActionPool[MAX_IRQ_ACTIONS];
+
+static IRQAction* volatile irqActions[MAX_IRQS] = {};
+static IRQAction* retiredActions = NULL;
+
+/* How many readers are walking the handler lists right now
+   On a single processor, this is only non-zero if we're inside the
+   dispatcher or a bottom half. */
+static volatile unsigned irqReaders = 0;
+
+// IRQs given by AllocateIRQ(). The ISA ones are always taken
+static uint32_t irqReserved[(MAX_IRQS + 31) / 32] = {0xffff};
+
+/* The bottom half of each IRQ */
+static WorkItem irqThreads[MAX_IRQS];
+
+static void RunIRQThread(WorkItem* w, void* data)
 {
-    
-    idt->Set(0x20, (uintptr_t)&irq0, 0x08);
-    idt->Set(0x21, (uintptr_t)&irq1, 0x08);
-    idt->Set(0x22, (uintptr_t)&irq2, 0x08);
-    idt->Set(0x23, (uintptr_t)&irq3, 0x08);
-    idt->Set(0x24, (uintptr_t)&irq4, 0x08);
-    idt->Set(0x25, (uintptr_t)&irq5, 0x08);
-    idt->Set(0x26, (uintptr_t)&irq6, 0x08);
-    idt->Set(0x27, (uintptr_t)&irq7, 0x08);
-    idt->Set(0x28, (uintptr_t)&irq8, 0x08);
-    idt->Set(0x29, (uintptr_t)&irq9, 0x08);
-    idt->Set(0x2A, (uintptr_t)&irq10, 0x08);
-    idt->Set(0x2B, (uintptr_t)&irq11, 0x08);
-    idt->Set(0x2C, (uintptr_t)&irq12, 0x08);
-    idt->Set(0x2D, (uintptr_t)&irq13, 0x08);
-    idt->Set(0x2E, (uintptr_t)&irq14, 0x08);
-    idt->Set(0x2F, (uintptr_t)&irq15, 0x08);
+    (void)w;
+    unsigned irq = (uintptr_t)data;
+
+    irqReaders++;
+    for (IRQAction* a = irqActions[irq]; a; a = a->next) {
+	bool pending;
+	{
+	    InterruptGuard g;
+	    pending = a->thread_pending;
+	    a->thread_pending = false;
+	}
+
+	if (pending)
+	    a->dev->OnIRQThread(irq);
+    }
+    irqReaders--;
+}
+
+/**
+ * Free the removed actions, if no one can be looking at them
+ * Must be called with interrupts disabled
+ */
+static void ReclaimActions()
+{
+    if (irqReaders > 0)
+	return;
+
+    while (retiredActions) {
+	IRQAction* a = retiredActions;
+	retiredActions = a->retired_next;
+	a->used = false;
+    }
+}
+
+void IRQHandler::Init(IDT* idt, IIRQController* irqcontrol)
+{
+    for (unsigned irq = 0; irq < MAX_IRQS; irq++) {
+	idt->Set(IRQHandler::GetVector(irq), irq_stub_table[irq], 0x08);
+
+	irqThreads[irq].handler = &RunIRQThread;
+	irqThreads[irq].data = (void*)(uintptr_t)irq;
+    }
+
+    /* Spurious interrupts from the local APIC must not be acknowledged,
+       so they don't go through the dispatcher */
+    idt->Set(SPURIOUS_VECTOR, (uintptr_t)&irq_spurious, 0x08);
     
     IRQHandler::_idt = idt;
     _irq_control = irqcontrol;
 }
 
-/* MAX_IRQ_HANDLERS (probably 16) handlers for 16 IRQs */
-static IIRQHandlerDevice* irqHandlers[16][MAX_IRQ_HANDLERS] = {};
+/**
+ * Switch to another interrupt controller
+ *
+ * The IRQs that have handlers are unmasked in the new controller,
+ * and the old one is fully masked.
+ */
+void IRQHandler::SetController(IIRQController* irqcontrol)
+{
+    InterruptGuard g;
+
+    IIRQController* old = _irq_control;
+
+    for (unsigned irq = 0; irq < irqcontrol->GetIRQCount(); irq++) {
+	if (irqActions[irq])
+	    irqcontrol->SetIRQMask(irq, false);
+    }
+
+    if (old)
+	old->MaskAll();
+
+    _irq_control = irqcontrol;
+    LOG(LogLevel::Info, "irq-handler", "switched interrupt controller");
+}
+
+IIRQController* IRQHandler::GetController()
+{
+    return _irq_control;
+}
+
+/* Statistics for each IRQ
+   Only the dispatcher writes them, with interrupts disabled. Readers use the
+   sequence number to know if they read it in the middle of an update: it's
+   odd while the dispatcher is writing */
+static IRQStats irq_stats[MAX_IRQS];
+static volatile uint32_t irq_stats_seq[MAX_IRQS];
+
+/**
+ * Get a consistent copy of the statistics of IRQ 'irqno'
+ *
+ * @return false if the IRQ number is invalid
+ */
+bool IRQHandler::GetStats(unsigned irqno, IRQStats* stats)
+{
+    if (irqno >= MAX_IRQS)
+	return false;
+
+    uint32_t seq;
+    do {
+	seq = irq_stats_seq[irqno];
+	compiler_barrier();
+	*stats = irq_stats[irqno];
+	compiler_barrier();
+    } while ((seq & 1) || seq != irq_stats_seq[irqno]);
+
+    return true;
+}
+
+/**
+ * Log the statistics of each IRQ that was called at least once
+ */
+void IRQHandler::DumpStats()
+{
+    for (unsigned irq = 0; irq < MAX_IRQS; irq++) {
+	IRQStats st;
+	IRQHandler::GetStats(irq, &st);
+
+	if (!st.count)
+	    continue;
+
+	uint32_t avg = (uint32_t)(st.cycles / st.count);
+	LOG(LogLevel::Info, "irq-stats",
+	    "IRQ %d: %d calls, %d spurious, %d cycles avg, %d max",
+	    irq, (uint32_t)st.count, st.spurious, avg, st.max_cycles);
+
+#ifdef ANNOS_IO_STATS
+	uint32_t calls = (uint32_t)st.count;
+	LOG(LogLevel::Info, "irq-stats",
+	    "IRQ %d: %d port accesses, %d.%02d per call",
+	    irq, st.io_ports, st.io_ports / calls,
+	    ((st.io_ports % calls) * 100) / calls);
+#endif
+    }
+}
 
 /**
  * IRQ dispatcher
@@ -75,75 +220,186 @@ static IIRQHandlerDevice* irqHandlers[16][MAX_IRQ_HANDLERS] = {};
  */
 extern "C" void IRQDispatcher(IRQRegs* regs)
 {
-    if (regs->irq_no > 0) {
-	annos::Log::Write(annos::Debug, "irq", "IRQ %d called", regs->irq_no);
-    }
+    unsigned irq = regs->irq_no;
+    uint64_t start = TSC::Read();
+#ifdef ANNOS_IO_STATS
+    uint32_t ports_before = io_port_accesses;
+#endif
     
-    size_t pos = 0;
-    while (irqHandlers[regs->irq_no][pos]) {
-	irqHandlers[regs->irq_no][pos]->OnIRQ(regs);
-	pos++;
+    irqReaders++;
 
-	if (pos >= MAX_IRQ_HANDLERS)
-	    break;
+    bool wake = false;
+    for (IRQAction* a = irqActions[irq]; a; a = a->next) {
+	if (a->dev->OnIRQ(regs) == IRQWakeThread) {
+	    a->thread_pending = true;
+	    wake = true;
+	}
     }
 
-    _irq_control->SendEOI(regs->irq_no);
+    irqReaders--;
+
+    if (wake)
+	WorkQueue::Queue(&irqThreads[irq]);
+
+    bool real = _irq_control->SendEOI(irq);
+
+    uint32_t cycles = (uint32_t)(TSC::Read() - start);
+    IRQStats* st = &irq_stats[irq];
+
+    irq_stats_seq[irq]++;
+    compiler_barrier();
+
+    st->count++;
+    st->cycles += cycles;
+    if (cycles > st->max_cycles)
+	st->max_cycles = cycles;
+    if (!real)
+	st->spurious++;
+#ifdef ANNOS_IO_STATS
+    st->io_ports += io_port_accesses - ports_before;
+#endif
+
+    compiler_barrier();
+    irq_stats_seq[irq]++;
 }
 
 /*
  * Sets a new IRQ handler
- * @returns a index in the list of handlers
+ * It's added to the end of the list, and can be called right after
+ * this returns.
+ *
+ * @returns the position in the list of handlers, or -1 on error
  */
 int IRQHandler::SetHandler(unsigned irqno, IIRQHandlerDevice* h)
 {
-    if (irqno >= 16)
-	panic("the IRQHandler only supports IRQ numbers 0 to 15");
-
+    if (irqno >= MAX_IRQS)
+	panic("invalid IRQ number");
 
-    // Get the IRQ count
-    size_t len = 0;
-    while (irqHandlers[irqno][len] != NULL) {
-	len++;
+    InterruptGuard g;
+    ReclaimActions();
 
-	if (len >= MAX_IRQ_HANDLERS)
+    IRQAction* action = NULL;
+    for (unsigned i = 0; i < MAX_IRQ_ACTIONS; i++) {
+	if (!irqActionPool[i].used) {
+	    action = &irqActionPool[i];
 	    break;
+	}
     }
-    if (len == 0)
-	_irq_control->SetIRQMask(irqno, false); // We have a handler, unmask
-	    
-
 
-    if (len >= 16) {
-	// Handler for this IRQ is full
-	panic("handler list is full");
+    if (!action) {
+	LOG(LogLevel::Error, "irq-handler",
+	    "no free IRQ actions for IRQ #%d", irqno);
 	return -1;
     }
 
-    Log::Write(LogLevel::Info, "irq-handler",
-	       "Set handler #%d to IRQ #%d to dev @ 0x%08x",
-	       len, irqno, h);
+    action->used = true;
+    action->dev = h;
+    action->next = NULL;
+    action->retired_next = NULL;
+    action->thread_pending = false;
+
+    // The action must be complete before the readers can see it
+    compiler_barrier();
+
+    int pos = 0;
+    IRQAction* volatile* link = &irqActions[irqno];
+    while (*link) {
+	link = &(*link)->next;
+	pos++;
+    }
+
+    *link = action;
+
+    if (pos == 0 && irqno < _irq_control->GetIRQCount())
+	_irq_control->SetIRQMask(irqno, false); // We have a handler, unmask
+
+    LOG(LogLevel::Info, "irq-handler",
+	"Set handler #%d to IRQ #%d to dev @ 0x%08x",
+	pos, irqno, h);
     
-    irqHandlers[irqno][len] = h;
-    return int(len);
+    return pos;
 }
 
 /*
  * Removes an IRQ handler
  */
-void IRQHandler::RemoveHandler(unsigned irqno, int index)
+void IRQHandler::RemoveHandler(unsigned irqno, IIRQHandlerDevice* h)
 {
-    irqHandlers[irqno][index] = NULL;
+    if (irqno >= MAX_IRQS)
+	return;
 
-    /* Check if we have no more handlers, so we can unmask it in the PIC */
-    unsigned i = 0;
-    while (irqHandlers[irqno][i] != NULL) {
-	i++;
-	if (i >= MAX_IRQ_HANDLERS)
-	    break;
-    }
+    InterruptGuard g;
+
+    IRQAction* volatile* link = &irqActions[irqno];
+    while (*link && (*link)->dev != h)
+	link = &(*link)->next;
+
+    IRQAction* action = *link;
+    if (!action)
+	return;
+
+    /* Unlink it, but keep its 'next', so a reader standing on it
+       can still go on */
+    *link = action->next;
+
+    action->retired_next = retiredActions;
+    retiredActions = action;
+    ReclaimActions();
 
-    if (i >= MAX_IRQ_HANDLERS)
+    /* No more handlers, so we can mask it in the interrupt controller */
+    if (!irqActions[irqno] && irqno < _irq_control->GetIRQCount())
 	_irq_control->SetIRQMask(irqno, true);
 }
 
+/**
+ * Reserve 'count' consecutive IRQs, for MSI
+ * 'count' must be a power of 2, and the first IRQ will be aligned to it,
+ * like multiple message MSI needs.
+ *
+ * @return the first IRQ, or -1 if there's no space
+ */
+int IRQHandler::AllocateIRQ(unsigned count)
+{
+    if (count == 0 || (count & (count - 1)) || count > 32)
+	return -1;
+
+    InterruptGuard g;
+
+    /* The vector must be aligned, not the IRQ number, so we start at the
+       first aligned vector after the ISA ones */
+    unsigned first = (GetVector(16) + count - 1) & ~(count - 1);
+    for (unsigned vec = first; vec + count <= GetVector(MAX_IRQS);
+	 vec += count) {
+	unsigned irq = vec - IRQ_VECTOR_BASE;
+	bool free = true;
+	for (unsigned i = irq; i < irq + count; i++) {
+	    if (irqReserved[i / 32] & (1 << (i % 32))) {
+		free = false;
+		break;
+	    }
+	}
+
+	if (!free)
+	    continue;
+
+	for (unsigned i = irq; i < irq + count; i++)
+	    irqReserved[i / 32] |= (1 << (i % 32));
+
+	return int(irq);
+    }
+
+    return -1;
+}
+
+/**
+ * Free IRQs reserved by AllocateIRQ()
+ */
+void IRQHandler::FreeIRQ(unsigned irqno, unsigned count)
+{
+    InterruptGuard g;
+
+    for (unsigned i = irqno; i < irqno + count && i < MAX_IRQS; i++) {
+	if (i >= 16)
+	    irqReserved[i / 32] &= ~(1 << (i % 32));
+    }
+}
@@ -8,24 +8,63 @@
 using namespace annos::x86;
 
 // The normal clock of the PIT, in HZ
+constexpr unsigned pit_rate = 1193182;
 
 // Changes the new timer clock to 'hz'
 void PIT::SetTimer(uint16_t hz)
 {
-    constexpr unsigned pit_rate = 1193182;
     uint16_t divisor = pit_rate / hz;
     
     out8(0x43, 0x36);
     out8(0x40, (divisor & 0xff));
     out8(0x40, (divisor >> 8));
 
-    Log::Write(LogLevel::Info, "pit", "frequency set to %d Hz", hz);
+    LOG(LogLevel::Info, "pit", "frequency set to %d Hz", hz);
 }
 
-void PIT::OnIRQ(IRQRegs* regs)
+IRQResult PIT::OnIRQ(IRQRegs* regs)
 {
     (void)regs;
+
+    // The timer events only queue work, so this is short enough
     Timer::Tick();
+    return IRQHandled;
+}
+
+/**
+ * Program the channel 0 in rate generator mode, 'hz' times
+ * per second
+ */
+void PIT::SetPeriodic(unsigned hz)
+{
+    this->SetTimer(hz);
+}
+
+/**
+ * Program the channel 0 to interrupt once, 'ns' nanoseconds from now
+ * It uses the mode 0, interrupt on terminal count.
+ */
+void PIT::SetOneShot(uint64_t ns)
+{
+    if (ns > this->GetMaxOneShot())
+	ns = this->GetMaxOneShot();
+
+    // Round up, so we never interrupt before the deadline
+    uint64_t count = ((ns * pit_rate) + 999999999) / 1000000000;
+    if (count == 0)
+	count = 1;
+    
+    out8(0x43, 0x30); // channel 0, lobyte/hibyte, mode 0
+    out8(0x40, (count & 0xff));
+    out8(0x40, (count >> 8));
+}
+
+/**
+ * The channel 0 counter has 16 bits, so around 55 ms
+ */
+uint64_t PIT::GetMaxOneShot()
+{
+    return (0xffffULL * 1000000000) / pit_rate;
 }
 
 /** 
@@ -34,8 +73,7 @@ void PIT::OnIRQ(IRQRegs* regs)
  */
 void PIT::Initialize()
 {
-    this->SetTimer(1000);
-    Timer::Init();
+    Timer::Init(this);
 }
 
 /**
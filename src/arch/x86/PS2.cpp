@@ -16,11 +16,54 @@ using namespace annos;
 using namespace annos::x86;
 
 
+// How long we wait for the controller, and for a device to answer
+constexpr unsigned ctl_timeout_us = 10000;
+constexpr unsigned dev_timeout_us = 20000;
+
+// Keyboards can take up to 500 ms to finish the self test after a reset
+constexpr unsigned reset_timeout_us = 750000;
+
 bool PS2::Detect()
 {
     return true; // We'll need ACPI to do it right
 }
 
+/**
+ * Wait until the controller has a byte for us in the data port
+ *
+ * @return true if it arrived before 'timeout_us' microseconds,
+ *         false if not
+ */
+bool PS2::WaitOutput(unsigned timeout_us)
+{
+    for (unsigned t = 0; t < timeout_us; t += 10) {
+	if (in8(STATUS_REG) & 0x1)
+	    return true;
+
+	udelay(10);
+    }
+
+    return (in8(STATUS_REG) & 0x1);
+}
+
+/**
+ * Wait until the controller can accept a byte from us
+ *
+ * @return true if it became ready before 'timeout_us' microseconds,
+ *         false if not
+ */
+bool PS2::WaitInput(unsigned timeout_us)
+{
+    for (unsigned t = 0; t < timeout_us; t += 10) {
+	if (!(in8(STATUS_REG) & 0x2))
+	    return true;
+
+	udelay(10);
+    }
+
+    return !(in8(STATUS_REG) & 0x2);
+}
+
 /**
  * Send a command to the device at port 'port'
  * It might be the device in the first channel or in the second
@@ -33,41 +76,33 @@ bool PS2::SendCommand(uint8_t code, unsigned port, int value)
     
     if (port == 2) {
 	out8(COMMAND_REG, 0xd4); // Write next byte to second PS/2 port
-	iodelay(100); // with a short delay for the controller to process
-	              // the command
+	WaitInput(ctl_timeout_us); // wait for the controller to process
+				   // the command
     }
     
     out8(DATA_PORT, code);
-    iodelay(100);
+    WaitInput(ctl_timeout_us);
 
     if (value > 0) {
 	out8(DATA_PORT, (uint8_t)value);
     }
     
-    unsigned timeout = 0;
-    while (!(in8(STATUS_REG) & 0x1)) {
-	if (timeout == 20) {
-	    Log::Write(Error, "ps2", "Timeout while sending command %02x to port %02x",
-	       code, port);
-	    return false;
-	}
-
-	timeout++;
-	iodelay(10000*timeout);
-	    
+    if (!WaitOutput(dev_timeout_us)) {
+	LOG(Error, "ps2", "Timeout while sending command %02x to port %02x",
+	    code, port);
+	return false;
     }
     
-    iodelay(50000);
     auto res = in8(DATA_PORT);
-    Log::Write(Debug, "ps2", "Sent %02x, received %02x on port %02x",
-	       code, res, port);
+    LOG(Debug, "ps2", "Sent %02x, received %02x on port %02x",
+	code, res, port);
 
     // If device returned AFK (0xFA) or 0xAA, return true
     if (res == 0xAA || res == 0xFA)
 	return true;
 
-    Log::Write(Error, "ps2", "Failed to send command %02x to port %02x, returned %02x",
-	       code, port, res);
+    LOG(Error, "ps2", "Failed to send command %02x to port %02x, returned %02x",
+	code, port, res);
     return false;
 }
 
@@ -83,38 +118,44 @@ bool PS2::Reset(unsigned port)
     
     if (port == 2) {
 	out8(COMMAND_REG, 0xd4); // Write next byte to second PS/2 port
-	iodelay(100); // with a short delay for the controller to process
-	              // the command
+	WaitInput(ctl_timeout_us); // wait for the controller to process
+				   // the command
     }
     
     out8(DATA_PORT, 0xff);
-    iodelay(50000);
+    if (!WaitOutput(dev_timeout_us)) {
+	LOG(Error, "ps2", "Timeout while resetting %02x", port);
+	return false;
+    }
+
     auto res = in8(DATA_PORT);
 
     // first 0xAA, then 0xFA, or vice-versa
     if (res != 0xAA && res != 0xFA) {
-	Log::Write(Error, "ps2", "Failed to reset %02x #1, returned %02x",
-		   port, res);
+	LOG(Error, "ps2", "Failed to reset %02x #1, returned %02x",
+	    port, res);
 	return false;
     }
 
-    iodelay(1000);
-    if (in8(STATUS_REG) & 0x1) {
+    // After the ACK, the self test result (0xAA) must come
+    if (WaitOutput(reset_timeout_us)) {
 	res = in8(DATA_PORT);
 	if (res != 0xAA && res != 0xFA) {
-	    Log::Write(Error, "ps2", "Failed to reset %02x #2, returned %02x",
-		       port, res);
+	    LOG(Error, "ps2", "Failed to reset %02x #2, returned %02x",
+		port, res);
 	    return false;
 	}
+    } else if (res == 0xFA) {
+	LOG(Error, "ps2", "Timeout waiting for the self test of %02x", port);
+	return false;
     }
 
-    iodelay(1000);
     // A 0x0 might come
-    if (in8(STATUS_REG) & 0x1) {
+    if (WaitOutput(dev_timeout_us)) {
 	res = in8(DATA_PORT);
 	if (res != 0x0) {
-	    Log::Write(Error, "ps2", "Failed to reset %02x #3, returned %02x",
-		   port, res);
+	    LOG(Error, "ps2", "Failed to reset %02x #3, returned %02x",
+		port, res);
 	    return false;
 	}
     }
@@ -132,16 +173,16 @@ void PS2::Initialize()
     
     // 1 - Disable the two PS/2 ports (keyboard and mouse)
     out8(COMMAND_REG, 0xAD);
-    iodelay(5000);
+    WaitInput(ctl_timeout_us);
     out8(COMMAND_REG, 0xA7);
-    iodelay(5000);
+    WaitInput(ctl_timeout_us);
 
     // 2 - Flush the output buffer
     // 16 reads should be sufficient to clear any crap in the buffer
     for (unsigned i = 0; i < 16; i++)
 	in8(DATA_PORT);
 
-    Log::Write(Info, "ps2", "Buffers cleared");
+    LOG(Info, "ps2", "Buffers cleared");
     
     // 3 - Disable IRQs and translation
     // (so it can't bother us while we initialise)
@@ -150,6 +191,7 @@ void PS2::Initialize()
     // Read the command configuration byte, an area in the controller RAM
     // with some of its configurations.
     
+    WaitOutput(ctl_timeout_us);
     auto ccb = in8(DATA_PORT);
 
     // Here we can check the number of channels of this device
@@ -161,45 +203,49 @@ void PS2::Initialize()
     if (ccb & (1 << 5))
 	this->max_channels = 2; // second port is present
 
-    Log::Write(Info, "ps2", "%d channels detected",
-	       (unsigned)this->max_channels);
+    LOG(Info, "ps2", "%d channels detected",
+	(unsigned)this->max_channels);
 
     out8(COMMAND_REG, 0x60);
 
     // Disable interrupts for both ports and translation
     ccb &= ~(0x1 | 0x2 | 0x40);
 
+    WaitInput(ctl_timeout_us);
     out8(DATA_PORT, ccb);
-    iodelay(50000);
+    WaitInput(ctl_timeout_us);
     
     // 4 - Make the controller do a self test
-    Log::Write(Debug, "ps2", "Controller self-test started");
+    LOG(Debug, "ps2", "Controller self-test started");
 
     out8(COMMAND_REG, 0xAA);
+    WaitOutput(ctl_timeout_us);
     auto st_res = in8(DATA_PORT);
-    Log::Write(Debug, "ps2", "Controller self-test result: 0x%02x", st_res);
+    LOG(Debug, "ps2", "Controller self-test result: 0x%02x", st_res);
 
     if (st_res != 0x55) {
-	Log::Write(Error, "ps2", "Controller self-test failed with %02x",
-		   st_res);
+	LOG(Error, "ps2", "Controller self-test failed with %02x",
+	    st_res);
 	//return false
     }
 
     // 5 - Test the channels themselves
     out8(COMMAND_REG, 0xAB); // Test the first port
+    WaitOutput(ctl_timeout_us);
     auto res = in8(DATA_PORT);
     if (res != 0x0) {
-	Log::Write(Error, "ps2", "First port test failed with %02x",
-		   res);
+	LOG(Error, "ps2", "First port test failed with %02x",
+	    res);
 	//return false
     }
 
     if (this->max_channels >= 2) {
 	out8(COMMAND_REG, 0xA9); // Test the second port
+	WaitOutput(ctl_timeout_us);
 	res = in8(DATA_PORT);
 	if (res != 0x0) {
-	    Log::Write(Error, "ps2", "Second port test failed with %02x",
-		       res);
+	    LOG(Error, "ps2", "Second port test failed with %02x",
+		res);
 	    //return false
 	}
     }
@@ -220,7 +266,7 @@ void PS2::Initialize()
     if (devtype > 0x80)
 	devtype |= (in8(DATA_PORT) << 8);
 
-    Log::Write(Info, "ps2", "First port device type: %04x", devtype);
+    LOG(Info, "ps2", "First port device type: %04x", devtype);
 
     // And on the second
     this->SendCommand(0xf5, 2); // Disable scanning
@@ -231,7 +277,7 @@ void PS2::Initialize()
     if (devtype > 0x80)
 	devtype |= (in8(DATA_PORT) << 8);
 
-    Log::Write(Info, "ps2", "Second port device type: %04x", devtype);
+    LOG(Info, "ps2", "Second port device type: %04x", devtype);
 
     this->InitKeyboard();
 
@@ -240,7 +286,7 @@ void PS2::Initialize()
 
     // Read the Controller Config Byte
     out8(COMMAND_REG, 0x20);
-    iodelay(100);
+    WaitOutput(ctl_timeout_us);
     ccb = in8(DATA_PORT);
 
     out8(COMMAND_REG, 0x60);
@@ -248,11 +294,12 @@ void PS2::Initialize()
     // Enable interrupts for both ports, keep translation disabled
     ccb |= 0x3;
 
+    WaitInput(ctl_timeout_us);
     out8(DATA_PORT, ccb);
     
     // Enable both ports
     out8(COMMAND_REG, 0xAE); // the first;
-    iodelay(1000);
+    WaitInput(ctl_timeout_us);
     if (this->max_channels == 2)
 	out8(COMMAND_REG, 0xA8);
 }
@@ -265,7 +312,7 @@ void PS2::Initialize()
  */
 bool PS2::InitKeyboard()
 {
-    Log::Write(Info, "ps2", "Initializing keyboard");
+    LOG(Info, "ps2", "Initializing keyboard");
 
     this->SendCommand(0xf0, 1, 0x02); // set to scancode set 2
     this->SendCommand(0xf4, 1); // enable scanning, keyboard will send scancodes
@@ -277,17 +324,56 @@ void PS2::Reset()
 }
 
 
-/* Called every IRQ */
-void PS2::OnIRQ(IRQRegs* regs)
+/**
+ * Put a received byte in the queue
+ * Called by the top half only
+ */
+void PS2::QueueByte(unsigned irqno, uint8_t byte)
+{
+    unsigned w = kbd_queue.write_cur;
+    if (w - kbd_queue.read_cur >= MAX_KBD_QUEUE) {
+	kbd_dropped++;
+	return;
+    }
+
+    kbd_queue.queue[w % MAX_KBD_QUEUE] = (irqno << 8) | byte;
+    asm volatile("" ::: "memory");
+    kbd_queue.write_cur = w + 1;
+}
+
+IRQResult PS2::OnIRQ(IRQRegs* regs)
 {
     if (regs->irq_no == 1) {
-	uint8_t key = in8(DATA_PORT);
-	Log::Write(Info, "ps2", "Data received: %02x", key);
+	this->QueueByte(1, in8(DATA_PORT));
     } else if (regs->irq_no == 12) {
-	uint16_t mousek = in8(DATA_PORT);
-	mousek |= (in8(DATA_PORT) << 8);
-	
-	Log::Write(Info, "ps2", "Mouse IRQ received %04x", mousek);
+	this->QueueByte(12, in8(DATA_PORT));
+	this->QueueByte(12, in8(DATA_PORT));
+    } else {
+	return IRQNotMine;
+    }
+
+    return IRQWakeThread;
+}
+
+void PS2::OnIRQThread(unsigned irqno)
+{
+    (void)irqno;
+
+    // We drain the whole queue, so keyboard and mouse share one run
+    while (kbd_queue.read_cur != kbd_queue.write_cur) {
+	unsigned r = kbd_queue.read_cur;
+	uint16_t e = kbd_queue.queue[r % MAX_KBD_QUEUE];
+	asm volatile("" ::: "memory");
+	kbd_queue.read_cur = r + 1;
+
+	if ((e >> 8) == 1)
+	    LOG(Info, "ps2", "Data received: %02x", e & 0xff);
+	else
+	    LOG(Info, "ps2", "Mouse data received: %02x", e & 0xff);
+    }
+
+    if (kbd_dropped) {
+	LOG(Warning, "ps2", "%d bytes dropped, queue full", kbd_dropped);
+	kbd_dropped = 0;
     }
-    
 }
@@ -18,8 +18,8 @@ bool CheckIfChecksumValid(SMBiosEntry* e)
 	chksum_total += smb_bytes[i];
     }
     
-    Log::Write(Debug, "smbios", "Checksum is %d, should be %d at 0x%x",
-	       chksum_total, 0, e);
+    LOG(Debug, "smbios", "Checksum is %d, should be %d at 0x%x",
+	chksum_total, 0, e);
     return (chksum_total == 0);
 }
 
@@ -47,8 +47,8 @@ bool SMBios::Detect()
 		}
 
 		smbios_addr -=  0xc0000000;
-		Log::Write(Info, "smbios", "SMBIOS entry point found at 0x%x",
-			   smbios_addr);
+		LOG(Info, "smbios", "SMBIOS entry point found at 0x%x",
+		    smbios_addr);
 
 		this->_smbios_entry_addr = smbios_addr + 0xc0000000;
 		
@@ -59,7 +59,7 @@ bool SMBios::Detect()
 	smbios_addr += 0x10;
     }
 
-    Log::Write(Warning, "smbios", "No SMBIOS entry point found");
+    LOG(Warning, "smbios", "No SMBIOS entry point found");
     return false;
 }
 
@@ -116,16 +116,16 @@ void SMBios::ParseBiosInformation(SMBiosStrHeader* hdr)
     const char* rdate = this->GetSMBiosString(hdr, binfo->releasedate_strptr);
 
     
-    Log::Write(Info, "smbios", "BIOS vendor: %s",
-	       (vendor) ? vendor : "<null>");
-    Log::Write(Info, "smbios", "BIOS version: %s",
-	       (version) ? version : "<null>");
-    Log::Write(Info, "smbios", "BIOS release date: %s",
-	       (rdate) ? rdate : "<null>");
-    Log::Write(Info, "smbios", "BIOS starting segment: %04x",
-	       binfo->starting_segment);
-    Log::Write(Info, "smbios", "BIOS ROM size: %d kB",
-	       64 * (binfo->rom_size+1));
+    LOG(Info, "smbios", "BIOS vendor: %s",
+	(vendor) ? vendor : "<null>");
+    LOG(Info, "smbios", "BIOS version: %s",
+	(version) ? version : "<null>");
+    LOG(Info, "smbios", "BIOS release date: %s",
+	(rdate) ? rdate : "<null>");
+    LOG(Info, "smbios", "BIOS starting segment: %04x",
+	binfo->starting_segment);
+    LOG(Info, "smbios", "BIOS ROM size: %d kB",
+	64 * (binfo->rom_size+1));
     
     
 }
@@ -148,13 +148,13 @@ void SMBios::ParseBoardInformation(SMBiosStrHeader* hdr)
 	 "Interconnect board"};
 	 
     
-    Log::Write(Info, "smbios", "Board type: %s (%x)",
-	       boardtype_str[binfo->board_type], binfo->board_type);
-    Log::Write(Info, "smbios", "Board Manufacturer: %s", manufacturer);
-    Log::Write(Info, "smbios", "Board Product: %s", product);
-    Log::Write(Info, "smbios", "Board Version: %s", version);
-    Log::Write(Info, "smbios", "Board Serial number: %s",
-	       (serialnum) ? serialnum : "<null>");
+    LOG(Info, "smbios", "Board type: %s (%x)",
+	boardtype_str[binfo->board_type], binfo->board_type);
+    LOG(Info, "smbios", "Board Manufacturer: %s", manufacturer);
+    LOG(Info, "smbios", "Board Product: %s", product);
+    LOG(Info, "smbios", "Board Version: %s", version);
+    LOG(Info, "smbios", "Board Serial number: %s",
+	(serialnum) ? serialnum : "<null>");
 }
 
 
@@ -170,26 +170,26 @@ void SMBios::ParseSysInformation(SMBiosStrHeader* hdr)
     const char* sku = this->GetSMBiosString(hdr, sinfo->serialnumber_sp);
     const char* model = this->GetSMBiosString(hdr, sinfo->serialnumber_sp);
 
-    Log::Write(Info, "smbios", "Manufacturer: %s",
-	       (manufacturer) ? manufacturer : "<null>");
-    Log::Write(Info, "smbios", "Product: %s",
-	       (product) ? product : "<null>");
-    Log::Write(Info, "smbios", "Version: %s",
-	       (version) ? version : "<null>");
-    Log::Write(Info, "smbios", "Serial number: %s",
-	       (serialnum) ? serialnum : "<null>");
+    LOG(Info, "smbios", "Manufacturer: %s",
+	(manufacturer) ? manufacturer : "<null>");
+    LOG(Info, "smbios", "Product: %s",
+	(product) ? product : "<null>");
+    LOG(Info, "smbios", "Version: %s",
+	(version) ? version : "<null>");
+    LOG(Info, "smbios", "Serial number: %s",
+	(serialnum) ? serialnum : "<null>");
 
     static const char* wake_event_str[] =
 	{"Reserved", "Other", "Unknown", "APM Timer", "Modem Ring",
 	 "LAN Remote", "Power Switch", "PCI PME#", "AC Power Restored"};
     
-    Log::Write(Info, "smbios", "Wake up Type: %s (0x%x)",
-	       wake_event_str[sinfo->wakeup_event], sinfo->wakeup_event);
+    LOG(Info, "smbios", "Wake up Type: %s (0x%x)",
+	wake_event_str[sinfo->wakeup_event], sinfo->wakeup_event);
 
-    Log::Write(Info, "smbios", "SKU: %s",
-	       (sku) ? sku : "<null>");
-    Log::Write(Info, "smbios", "Model: %s",
-	       (model) ? model : "<null>");
+    LOG(Info, "smbios", "SKU: %s",
+	(sku) ? sku : "<null>");
+    LOG(Info, "smbios", "Model: %s",
+	(model) ? model : "<null>");
 
 }
 
@@ -205,11 +205,11 @@ void SMBios::ParseMemDevice(SMBiosStrHeader* hdr)
     const char* dev_location = this->GetSMBiosString(hdr, minfo->device_location_sp);
     const char* bank_location = this->GetSMBiosString(hdr, minfo->bank_location_sp);
 
-    Log::Write(Info, "smbios", "Memory located at array handle %04x",
-	       minfo->memarray_handle);
-    Log::Write(Info, "smbios", "\tLocated at bank %s device %s",
-	       (bank_location) ? bank_location : "<null>",
-	       (dev_location) ? dev_location : "<null>");
+    LOG(Info, "smbios", "Memory located at array handle %04x",
+	minfo->memarray_handle);
+    LOG(Info, "smbios", "\tLocated at bank %s device %s",
+	(bank_location) ? bank_location : "<null>",
+	(dev_location) ? dev_location : "<null>");
 
     unsigned size_kb = 0;
     if (minfo->size == 0x7fff)
@@ -219,17 +219,17 @@ void SMBios::ParseMemDevice(SMBiosStrHeader* hdr)
     else
 	size_kb = minfo->size * 1024;
 	    
-    Log::Write(Info, "smbios", "\tSize: %d MB, %d MHz", size_kb/1024,
-	       minfo->speed_mhz);
-
-    Log::Write(Info, "smbios", "\tManufacturer: %s",
-	       (manufacturer) ? manufacturer : "<null>");
-    Log::Write(Info, "smbios", "\tSerial number: %s",
-	       (serialnum) ? serialnum : "<null>");
-    Log::Write(Info, "smbios", "\tAsset Tag: %s",
-	       (asset_tag) ? asset_tag : "<null>");
-    Log::Write(Info, "smbios", "\tPart number: %s",
-	       (part_number) ? part_number : "<null>");
+    LOG(Info, "smbios", "\tSize: %d MB, %d MHz", size_kb/1024,
+	minfo->speed_mhz);
+
+    LOG(Info, "smbios", "\tManufacturer: %s",
+	(manufacturer) ? manufacturer : "<null>");
+    LOG(Info, "smbios", "\tSerial number: %s",
+	(serialnum) ? serialnum : "<null>");
+    LOG(Info, "smbios", "\tAsset Tag: %s",
+	(asset_tag) ? asset_tag : "<null>");
+    LOG(Info, "smbios", "\tPart number: %s",
+	(part_number) ? part_number : "<null>");
 }
 
 /* Parse SMBIOS processor header */
@@ -248,22 +248,22 @@ void SMBios::ParseSysProcessor(SMBiosStrHeader* hdr)
 	"DSP Processor", "Video Processor"};
 				      
     
-    Log::Write(Info, "smbios", "Processor Socket: %s", socket);
-    Log::Write(Info, "smbios", "Processor Type: %s (%x)",
-	       sproc_type[smproc->proc_type], smproc->proc_type);
-    Log::Write(Info, "smbios", "Processor Family: %x", smproc->proc_family);
-    Log::Write(Info, "smbios", "Processor ID: %08x %08x",
-	       ((uint32_t)(smproc->proc_id >> 32)),
-	       ((uint32_t)(smproc->proc_id & 0xffffffff)));
-    Log::Write(Info, "smbios", "Processor Manufacturer: %s",
-	       (proc_manufacturer) ? proc_manufacturer : "<null>");
-    Log::Write(Info, "smbios", "Processor Version: %s",
-	       (proc_version) ? proc_version : "<null>");
-    Log::Write(Info, "smbios", "Bus Clock: %d MHz", smproc->clock_mhz);
-    Log::Write(Info, "smbios", "Processor Max Clock: %d MHz",
-	       smproc->max_speed_mhz);
-    Log::Write(Info, "smbios", "Processor Current Clock: %d MHz",
-	       smproc->curr_speed_mhz);
+    LOG(Info, "smbios", "Processor Socket: %s", socket);
+    LOG(Info, "smbios", "Processor Type: %s (%x)",
+	sproc_type[smproc->proc_type], smproc->proc_type);
+    LOG(Info, "smbios", "Processor Family: %x", smproc->proc_family);
+    LOG(Info, "smbios", "Processor ID: %08x %08x",
+	((uint32_t)(smproc->proc_id >> 32)),
+	((uint32_t)(smproc->proc_id & 0xffffffff)));
+    LOG(Info, "smbios", "Processor Manufacturer: %s",
+	(proc_manufacturer) ? proc_manufacturer : "<null>");
+    LOG(Info, "smbios", "Processor Version: %s",
+	(proc_version) ? proc_version : "<null>");
+    LOG(Info, "smbios", "Bus Clock: %d MHz", smproc->clock_mhz);
+    LOG(Info, "smbios", "Processor Max Clock: %d MHz",
+	smproc->max_speed_mhz);
+    LOG(Info, "smbios", "Processor Current Clock: %d MHz",
+	smproc->curr_speed_mhz);
     
     
     
@@ -278,15 +278,15 @@ void SMBios::Initialize()
 
     volatile SMBiosEntry* sm_entry = ( SMBiosEntry* )this->_smbios_entry_addr;
 
-    Log::Write(Info, "smbios", "entry point: len 0x%x, version %d.%d",
-	       sm_entry->length, sm_entry->major, sm_entry->minor);
+    LOG(Info, "smbios", "entry point: len 0x%x, version %d.%d",
+	sm_entry->length, sm_entry->major, sm_entry->minor);
 
-    Log::Write(Info, "smbios", "           maxstructsize %d, ep_revision %02x",
-	       sm_entry->max_structure_size, sm_entry->entry_point_revision);
+    LOG(Info, "smbios", "           maxstructsize %d, ep_revision %02x",
+	sm_entry->max_structure_size, sm_entry->entry_point_revision);
 
-    Log::Write(Info, "smbios", "           smbios_addr %x, len %d, count %d",
-	       sm_entry->smbios_struct_addr, sm_entry->smbios_struct_len,
-	       sm_entry->smbios_struct_count);
+    LOG(Info, "smbios", "           smbios_addr %x, len %d, count %d",
+	sm_entry->smbios_struct_addr, sm_entry->smbios_struct_len,
+	sm_entry->smbios_struct_count);
 
 
     /* Map 2 pages for guarding agains the smbios_struct_addr being near the end
@@ -303,10 +303,10 @@ void SMBios::Initialize()
     for (int i = 0; i < sm_entry->smbios_struct_count; i++) {
 	SMBiosStrHeader* smheader = (SMBiosStrHeader*)smbios_ptr;
 	
-	Log::Write(Debug, "smbios", "struct %d is type %02d len %d handle %04x "
-		   "address 0x%08x",
-		   (i+1), smheader->type, smheader->length, smheader->handle,
-		   smbios_ptr);
+	LOG(Debug, "smbios", "struct %d is type %02d len %d handle %04x "
+	    "address 0x%08x",
+	    (i+1), smheader->type, smheader->length, smheader->handle,
+	    smbios_ptr);
 
 	switch (smheader->type) {
 	case 0: this->ParseBiosInformation(smheader); break;
@@ -330,7 +330,7 @@ void SMBios::Initialize()
 	int strlength = 0;
 	const char* smstr = this->GetSMBiosString(smheader, max_idx);
 	while (smstr != NULL) {
-//	    Log::Write(Debug, "smbios", "Found string: %s", smstr);
+//	    LOG(Debug, "smbios", "Found string: %s", smstr);
 	    strlength += strlen(smstr)+1;
 	    max_idx++;
 	    smstr = this->GetSMBiosString(smheader, max_idx);
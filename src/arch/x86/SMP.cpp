@@ -0,0 +1,220 @@
+#include <arch/x86/SMP.hpp>
+#include <arch/x86/VMM.hpp>
+#include <arch/x86/InterruptGuard.hpp>
+#include <libk/stdlib.h>
+#include <Timer.hpp>
+#include <Log.hpp>
+
+/**
+ * Multiprocessor support
+ *
+ * Copyright (C) 2018 Arthur M
+ */
+
+using namespace annos;
+using namespace annos::x86;
+
+// The AP startup code, in SMPTrampoline.S
+extern "C" uint8_t smp_trampoline_start[];
+extern "C" uint8_t smp_trampoline_end[];
+extern "C" uint8_t smp_trampoline_data[];
+
+CPUInfo SMP::_cpus[MAX_CPUS];
+unsigned SMP::_cpu_count = 0;
+APIC* SMP::_apic = NULL;
+IDT* SMP::_idt = NULL;
+
+struct GDTPointer {
+    uint16_t size;
+    uint32_t addr;
+} __attribute__((packed));
+
+static uint64_t MakeDescriptor(uint32_t base, uint32_t limit, uint8_t access,
+			       uint8_t flags)
+{
+    return (limit & 0xffff) | (uint64_t(base & 0xffffff) << 16) |
+	(uint64_t(access) << 40) | (uint64_t((limit >> 16) & 0xf) << 48) |
+	(uint64_t(flags & 0xf) << 52) | (uint64_t(base >> 24) << 56);
+}
+
+/* Busy-wait until the processor comes online, or 'ns' nanoseconds
+   pass */
+static bool WaitOnline(CPUInfo* cpu, uint64_t ns)
+{
+    uint64_t end = Timer::GetNs() + ns;
+    while (Timer::GetNs() < end) {
+	if (cpu->online)
+	    return true;
+
+	asm volatile("pause");
+    }
+
+    return cpu->online;
+}
+
+/**
+ * Build the GDT and the TSS of 'cpu', and load them in the
+ * current processor
+ */
+void SMP::LoadGDT(CPUInfo* cpu)
+{
+    // Flat 4 GB segments, page granularity, 32-bit
+    cpu->gdt[0] = 0;
+    cpu->gdt[1] = MakeDescriptor(0, 0xfffff, 0x9a, 0xc); // Kernel code
+    cpu->gdt[2] = MakeDescriptor(0, 0xfffff, 0x92, 0xc); // Kernel data
+    cpu->gdt[3] = MakeDescriptor(0, 0xfffff, 0xfa, 0xc); // User code
+    cpu->gdt[4] = MakeDescriptor(0, 0xfffff, 0xf2, 0xc); // User data
+
+    memset(&cpu->tss, 0, sizeof(TSS));
+    cpu->tss.ss0 = GDT_KERNEL_DATA;
+    cpu->tss.esp0 = cpu->stack_top;
+    cpu->tss.iomap_base = sizeof(TSS); // No I/O permission bitmap
+    cpu->gdt[5] = MakeDescriptor((uintptr_t)&cpu->tss, sizeof(TSS) - 1,
+				 0x89, 0);
+
+    GDTPointer ptr = {.size = sizeof(cpu->gdt) - 1,
+		      .addr = (uint32_t)&cpu->gdt[0]};
+
+    // Reload the segments, so they come from the new table
+    asm volatile("lgdt %0\n\t"
+		 "ljmp $0x08, $1f\n"
+		 "1:\n\t"
+		 "mov %1, %%ds\n\t"
+		 "mov %1, %%es\n\t"
+		 "mov %1, %%fs\n\t"
+		 "mov %1, %%gs\n\t"
+		 "mov %1, %%ss\n\t"
+		 :: "m"(ptr), "r"((uint32_t)GDT_KERNEL_DATA) : "memory");
+
+    asm volatile("ltr %w0" :: "r"(GDT_TSS));
+}
+
+/**
+ * Start the AP 'cpu', and wait for it to reach the idle loop
+ *
+ * @return true if it started
+ */
+bool SMP::StartCPU(CPUInfo* cpu)
+{
+    auto data = (SMPTrampolineData*)(SMP_TRAMPOLINE_ADDR +
+				     (smp_trampoline_data - smp_trampoline_start));
+
+    uint32_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+
+    data->cr3 = cr3;
+    data->stack = cpu->stack_top;
+    data->entry = (uintptr_t)&smp_ap_entry;
+    data->cpu = (uintptr_t)cpu;
+    cpu->online = false;
+    __sync_synchronize();
+
+    if (!_apic->SendInit(cpu->apic_id))
+	return false;
+
+    // The processor needs 10 ms to reset
+    WaitOnline(cpu, 10000000);
+
+    /* Intel says to send the startup IPI twice. The second one is
+       ignored if the first worked */
+    if (!_apic->SendStartup(cpu->apic_id, SMP_TRAMPOLINE_ADDR))
+	return false;
+
+    if (WaitOnline(cpu, 1000000))
+	return true;
+
+    if (!_apic->SendStartup(cpu->apic_id, SMP_TRAMPOLINE_ADDR))
+	return false;
+
+    return WaitOnline(cpu, 1000000000);
+}
+
+/**
+ * The kernel entry of the APs, called by the trampoline
+ */
+extern "C" void smp_ap_entry(CPUInfo* cpu)
+{
+    SMP::APMain(cpu);
+}
+
+void SMP::APMain(CPUInfo* cpu)
+{
+    SMP::LoadGDT(cpu);
+    _idt->Load();
+    _apic->InitializeLocal();
+
+    // The write-combining pages must have the same type as in the BSP
+    VMM::LoadPAT();
+
+    /* We can't log from here: the log drain uses the work queue, and it
+       is only safe in the BSP. The BSP logs for us */
+    __sync_synchronize();
+    cpu->online = true;
+
+    // The idle loop. Nothing sends us interrupts yet, except IPIs
+    for (;;) {
+	asm volatile("sti; hlt" ::: "memory");
+	cpu->wakeups++;
+    }
+}
+
+/**
+ * Give the BSP its own GDT and TSS, and start all the other
+ * processors the MADT lists
+ *
+ * @return the number of processors online, the BSP included
+ */
+unsigned SMP::Init(APIC* apic, IDT* idt)
+{
+    _apic = apic;
+    _idt = idt;
+
+    // The BSP keeps the boot stack. Nothing runs in user mode yet
+    CPUInfo* bsp = &_cpus[0];
+    bsp->index = 0;
+    bsp->apic_id = apic->GetBootID();
+    bsp->stack_top = 0;
+    bsp->online = true;
+
+    {
+	InterruptGuard g;
+	SMP::LoadGDT(bsp);
+    }
+
+    _cpu_count = 1;
+
+    // The trampoline page must be identity mapped, so the APs can enable
+    // paging while they run it
+    VMM::RemapPage(SMP_TRAMPOLINE_ADDR, SMP_TRAMPOLINE_ADDR,
+		   VMMFlags::ReadWrite);
+    memcpy((void*)SMP_TRAMPOLINE_ADDR, smp_trampoline_start,
+	   smp_trampoline_end - smp_trampoline_start);
+
+    for (unsigned i = 0; i < apic->GetProcessorCount(); i++) {
+	uint8_t id = apic->GetProcessorID(i);
+	if (id == bsp->apic_id)
+	    continue;
+
+	CPUInfo* cpu = &_cpus[_cpu_count];
+	cpu->index = _cpu_count;
+	cpu->apic_id = id;
+	cpu->stack_top = VMM::AllocateVirtual(SMP_STACK_PAGES) +
+	    SMP_STACK_PAGES * VMM_PAGE_SIZE;
+
+	uint64_t start = Timer::GetNs();
+	if (!SMP::StartCPU(cpu)) {
+	    // Park it, so it doesn't wake up later and use the slot
+	    apic->SendInit(id);
+	    LOG(Warning, "smp", "processor #%d didn't start", id);
+	    continue;
+	}
+
+	LOG(Info, "smp", "cpu%d (APIC #%d) online in %d us",
+	    cpu->index, id, (uint32_t)((Timer::GetNs() - start) / 1000));
+	_cpu_count++;
+    }
+
+    LOG(Info, "smp", "%d of %d processors online", _cpu_count,
+	apic->GetProcessorCount());
+    return _cpu_count;
+}
@@ -0,0 +1,139 @@
+#include <arch/x86/TSC.hpp>
+#include <arch/x86/IO.hpp>
+#include <Log.hpp>
+
+/**
+ * Time Stamp Counter clock source for the x86
+ *
+ * Copyright (C) 2018 Arthur M
+ */
+
+using namespace annos;
+using namespace annos::x86;
+
+uint64_t TSC::_hz = 0;
+uint32_t TSC::_cycles_per_us = 0;
+uint32_t TSC::_ns_mult = 0;
+uint64_t TSC::_base = 0;
+
+// The PIT input clock, in Hz
+constexpr unsigned pit_rate = 1193182;
+
+// How long each calibration countdown lasts, in ms
+constexpr unsigned calibration_ms = 10;
+
+/**
+ * Check if the processor has a time stamp counter
+ */
+bool TSC::Detect()
+{
+    uint32_t eax = 1, ebx, ecx, edx;
+    asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+
+    return (edx & (1 << 4));
+}
+
+/**
+ * Count how many TSC cycles a PIT channel 2 countdown of 'latch'
+ * ticks took
+ *
+ * @return the cycle count, or 0 if the PIT didn't count
+ */
+uint64_t TSC::MeasurePIT(uint16_t latch)
+{
+    /* Port 0x61 bit 0 is the channel 2 gate, bit 1 enables the speaker
+       and bit 5 reflects the channel 2 output.
+       Open the gate, but keep the speaker quiet */
+    uint8_t p61 = in8(0x61);
+    out8(0x61, (p61 & ~0x02) | 0x01);
+
+    // Channel 2, lobyte/hibyte, mode 0 (interrupt on terminal count)
+    out8(0x43, 0xb0);
+    out8(0x42, latch & 0xff);
+    out8(0x42, latch >> 8);
+
+    uint64_t start = TSC::Read();
+    unsigned loops = 0;
+
+    // The output goes high when the count reaches zero
+    while (!(in8(0x61) & 0x20))
+	loops++;
+
+    uint64_t end = TSC::Read();
+    out8(0x61, p61);
+
+    /* If the output was already high, the PIT didn't count at all.
+       Do not trust this measure */
+    if (loops < 16)
+	return 0;
+
+    return end - start;
+}
+
+/**
+ * Calibrate the TSC against the PIT channel 2
+ *
+ * It does not need interrupts, so it can run very early.
+ * @return true if calibrated, false if there's no usable TSC
+ */
+bool TSC::Calibrate()
+{
+    if (!TSC::Detect()) {
+	LOG(Warning, "tsc", "processor has no time stamp counter");
+	return false;
+    }
+
+    const uint16_t latch = (pit_rate * calibration_ms) / 1000;
+
+    /* Take the smallest of some measures. Anything that delays us (an SMI,
+       the hypervisor...) can only make a measure longer */
+    uint64_t best = 0;
+    for (unsigned i = 0; i < 3; i++) {
+	uint64_t c = TSC::MeasurePIT(latch);
+	if (c > 0 && (best == 0 || c < best))
+	    best = c;
+    }
+
+    if (best == 0) {
+	LOG(Warning, "tsc", "PIT channel 2 didn't count, "
+	    "can't calibrate the TSC");
+	return false;
+    }
+
+    // Account the latch rounding, so 'hz' is exact for the ticks we waited
+    uint64_t hz = (best * pit_rate) / latch;
+
+    TSC::_cycles_per_us = (uint32_t)(hz / 1000000);
+    if (TSC::_cycles_per_us == 0)
+	TSC::_cycles_per_us = 1;
+
+    TSC::_ns_mult = (uint32_t)((1000000000ULL << 24) / hz);
+    TSC::_base = TSC::Read();
+    TSC::_hz = hz;
+
+    LOG(Info, "tsc", "TSC runs at %d.%03d MHz",
+	(uint32_t)(hz / 1000000), (uint32_t)((hz / 1000) % 1000));
+    return true;
+}
+
+/**
+ * Convert a cycle count to nanoseconds
+ */
+uint64_t TSC::CyclesToNs(uint64_t cycles)
+{
+    /* Split the multiplication, so a 64-bit cycle count can't overflow
+       the intermediate result */
+    uint64_t hi = cycles >> 32;
+    uint64_t lo = cycles & 0xffffffff;
+
+    return ((hi * _ns_mult) << 8) + ((lo * _ns_mult) >> 24);
+}
+
+/**
+ * Nanoseconds elapsed since calibration
+ * Monotonic, suitable to be used as the kernel clock source
+ */
+uint64_t TSC::GetNs()
+{
+    return TSC::CyclesToNs(TSC::Read() - TSC::_base);
+}
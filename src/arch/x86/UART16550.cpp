@@ -0,0 +1,314 @@
+#include <arch/x86/UART16550.hpp>
+#include <arch/x86/InterruptGuard.hpp>
+#include <arch/x86/IO.hpp>
+
+/*
+  Driver for the 16550A UART, the PC serial port
+
+  Copyright (C) 2018 Arthur M
+*/
+
+using namespace annos;
+using namespace annos::x86;
+
+// Register offsets from the base port
+#define UART_DATA 0 // RBR/THR, or the divisor low byte with DLAB
+#define UART_IER 1  // Interrupt enable, or the divisor high byte with DLAB
+#define UART_IIR 2  // Interrupt identification (read)
+#define UART_FCR 2  // FIFO control (write)
+#define UART_LCR 3
+#define UART_MCR 4
+#define UART_LSR 5
+#define UART_MSR 6
+#define UART_SCR 7
+
+// IER bits
+#define IER_RX 0x1
+#define IER_THRE 0x2
+#define IER_LINE 0x4
+
+// LSR bits
+#define LSR_DATA_READY 0x1
+#define LSR_THRE 0x20
+
+// IIR interrupt causes, in bits 1-3
+#define IIR_NONE 0x1
+#define IIR_MODEM 0x0
+#define IIR_THRE 0x2
+#define IIR_RX 0x4
+#define IIR_LINE 0x6
+#define IIR_RX_TIMEOUT 0xc
+
+/**
+ * Check if the UART exists, and if it has working FIFOs
+ */
+bool UART16550::Detect()
+{
+    // Nothing answers on an empty port, so the scratch register can't work
+    out8(_port + UART_SCR, 0xa5);
+    if (in8(_port + UART_SCR) != 0xa5)
+	return false;
+
+    // A 16550A reports its FIFOs enabled in the IIR bits 6 and 7
+    out8(_port + UART_FCR, 0x1);
+    return ((in8(_port + UART_IIR) & 0xc0) == 0xc0);
+}
+
+/**
+ * Program the baud rate, 8N1 and the FIFOs
+ * The UART interrupts stay disabled until EnableIRQ()
+ */
+void UART16550::Initialize()
+{
+    if (_baud == 0 || _baud > UART_BASE_BAUD)
+	_baud = UART_BASE_BAUD;
+
+    uint16_t divisor = UART_BASE_BAUD / _baud;
+
+    out8(_port + UART_IER, 0);
+
+    // Open divisor latch, by setting the bit 7, to set the baud rate
+    out8(_port + UART_LCR, 0x80);
+    out8(_port + UART_DATA, divisor & 0xff);
+    out8(_port + UART_IER, divisor >> 8);
+    out8(_port + UART_LCR, 0x3); // 8 bits, no parity, 1 stop bit (8N1)
+
+    /* Enable and clear the FIFOs. Interrupt on receive with 14 bytes,
+       the timeout interrupt catches what's left */
+    out8(_port + UART_FCR, 0xc7);
+
+    // DTR, RTS, and OUT2, that connects the UART IRQ line to the PIC
+    out8(_port + UART_MCR, 0x0b);
+
+    // Clear any pending condition
+    in8(_port + UART_LSR);
+    in8(_port + UART_DATA);
+    in8(_port + UART_MSR);
+
+    _tx_active = false;
+}
+
+void UART16550::Reset()
+{
+    this->Initialize();
+}
+
+void UART16550::SetTHREInterrupt(bool enable)
+{
+    uint8_t ier = IER_RX | IER_LINE;
+    if (enable)
+	ier |= IER_THRE;
+
+    out8(_port + UART_IER, ier);
+}
+
+/**
+ * Start using the interrupts
+ * Install the IRQ handler before calling it.
+ */
+void UART16550::EnableIRQ()
+{
+    InterruptGuard g;
+
+    _irq_enabled = true;
+    this->SetTHREInterrupt(false);
+    this->Kick();
+}
+
+/**
+ * Move up to a FIFO worth of bytes from the transmit ring to the
+ * UART
+ * The transmitter must be empty. Interrupts must be disabled.
+ *
+ * @return true if something was sent
+ */
+bool UART16550::FillFIFO()
+{
+    unsigned r = _tx_read;
+    unsigned w = _tx_write;
+    unsigned count = 0;
+
+    while (r != w && count < UART_FIFO_SIZE) {
+	out8(_port + UART_DATA, _tx_ring[r & (_tx_size - 1)]);
+	r++;
+	count++;
+    }
+
+    _tx_read = r;
+    return (count > 0);
+}
+
+/**
+ * Send everything in the transmit ring, waiting for the UART
+ * Interrupts must be disabled.
+ */
+void UART16550::DrainPolling()
+{
+    while (_tx_read != _tx_write) {
+	// Don't hang forever if the UART is gone
+	for (unsigned timeout = 0; !(in8(_port + UART_LSR) & LSR_THRE);
+	     timeout++) {
+	    if (timeout > 0x100000)
+		return;
+	}
+
+	this->FillFIFO();
+    }
+}
+
+/**
+ * Start transmitting the ring, if the transmitter is idle
+ * Interrupts must be disabled.
+ */
+void UART16550::Kick()
+{
+    if (!_irq_enabled) {
+	this->DrainPolling();
+	return;
+    }
+
+    if (_tx_active || _tx_read == _tx_write)
+	return;
+
+    // If the transmitter is idle, send the first burst now
+    if (in8(_port + UART_LSR) & LSR_THRE)
+	this->FillFIFO();
+
+    /* Always arm the THRE interrupt, even if the UART is still sending an
+       older burst: it fires when enabled with the holding register
+       empty, and otherwise on the transition to empty */
+    _tx_active = true;
+    this->SetTHREInterrupt(true);
+}
+
+/**
+ * Queue 'len' bytes to be sent
+ * If the ring is full, we wait for some space
+ */
+void UART16550::Write(const char* data, size_t len)
+{
+    uint32_t eflags;
+    asm volatile("pushf; pop %0" : "=r"(eflags));
+
+    // Without interrupts, nobody would empty the ring
+    bool polling = !(eflags & 0x200);
+
+    while (len > 0) {
+	InterruptGuard g;
+
+	unsigned w = _tx_write;
+	unsigned space = _tx_size - (w - _tx_read);
+
+	if (space == 0) {
+	    this->DrainPolling();
+	    continue;
+	}
+
+	size_t n = (len < space) ? len : space;
+	for (size_t i = 0; i < n; i++)
+	    _tx_ring[(w + i) & (_tx_size - 1)] = data[i];
+
+	asm volatile("" ::: "memory");
+	_tx_write = w + n;
+	data += n;
+	len -= n;
+
+	if (polling)
+	    this->DrainPolling();
+	else
+	    this->Kick();
+    }
+}
+
+/**
+ * Read up to 'len' received bytes
+ *
+ * @return the number of bytes read
+ */
+size_t UART16550::Read(char* data, size_t len)
+{
+    size_t n = 0;
+
+    if (!_irq_enabled) {
+	InterruptGuard g;
+	this->Receive();
+    }
+
+    unsigned r = _rx_read;
+    while (n < len && r != _rx_write) {
+	data[n++] = _rx_ring[r & (_rx_size - 1)];
+	r++;
+    }
+
+    asm volatile("" ::: "memory");
+    _rx_read = r;
+    return n;
+}
+
+/**
+ * Wait until everything in the transmit ring is sent
+ */
+void UART16550::Flush()
+{
+    InterruptGuard g;
+    this->DrainPolling();
+}
+
+/**
+ * Read the received bytes to the receive ring
+ */
+void UART16550::Receive()
+{
+    while (in8(_port + UART_LSR) & LSR_DATA_READY) {
+	uint8_t b = in8(_port + UART_DATA);
+	unsigned w = _rx_write;
+
+	if (w - _rx_read >= _rx_size) {
+	    _rx_dropped++;
+	    continue;
+	}
+
+	_rx_ring[w & (_rx_size - 1)] = b;
+	asm volatile("" ::: "memory");
+	_rx_write = w + 1;
+    }
+}
+
+IRQResult UART16550::OnIRQ(IRQRegs* regs)
+{
+    (void)regs;
+    IRQResult res = IRQNotMine;
+
+    for (;;) {
+	uint8_t iir = in8(_port + UART_IIR);
+	if (iir & IIR_NONE)
+	    break;
+
+	res = IRQHandled;
+
+	switch (iir & 0xe) {
+	case IIR_LINE:
+	    in8(_port + UART_LSR);
+	    break;
+
+	case IIR_RX:
+	case IIR_RX_TIMEOUT:
+	    this->Receive();
+	    break;
+
+	case IIR_THRE:
+	    // Reading the IIR cleared it. Stop when there's nothing more
+	    if (!this->FillFIFO()) {
+		_tx_active = false;
+		this->SetTHREInterrupt(false);
+	    }
+	    break;
+
+	case IIR_MODEM:
+	    in8(_port + UART_MSR);
+	    break;
+	}
+    }
+
+    return res;
+}
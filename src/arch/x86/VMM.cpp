@@ -115,6 +115,7 @@ annos::PMM* VMM::_pmm;
  * aka cr3
  */
 phys_t VMM::kernel_cr3_base;
+bool VMM::_has_pat = false;
 
 constexpr virt_t kernel_virt_cr3_base = 0xfffff000;
 
@@ -152,11 +153,28 @@ phys_t VMM::MapPageDirectoryIndex(unsigned dirindex)
     // map present and RW
 
     auto p = VMM::_pmm->AllocatePhysical();
-    Log::Write(Debug, "vmm", "mapped phys page %08x for diridx %d", p, dirindex);
+    LOG(Debug, "vmm", "mapped phys page %08x for diridx %d", p, dirindex);
     return p;
 }
 
 	
+/**
+ * Convert the VMMFlags to the page table entry bits
+ */
+uint32_t VMM::ToPTEFlags(uint16_t flags)
+{
+    // The bits 0 to 6 are the same in the page table
+    uint32_t pteflags = flags & 0x7f;
+    if (flags & VMMFlags::WriteCombining) {
+	if (VMM::_has_pat)
+	    pteflags = (pteflags & ~0x18) | 0x80; // PAT entry 4
+	else
+	    pteflags |= VMMFlags::NonCached;
+    }
+
+    return pteflags;
+}
+
 /**
  * Map 'n' pages of physical address 'phys' to the virtual address 'virt'
  * Set allow_nc to false to fail if it couldn't allocate contiguous
@@ -167,7 +185,7 @@ phys_t VMM::MapPageDirectoryIndex(unsigned dirindex)
  * this function will return 2. Or return -1 if it couldn't map.
  */
 int VMM::MapPhysicalToVirtual(phys_t phys, size_t n, virt_t virt,
-			      uint8_t flags)
+			      uint16_t flags)
 {
 
     unsigned dirindex, tableindex;
@@ -175,27 +193,29 @@ int VMM::MapPhysicalToVirtual(phys_t phys, size_t n, virt_t virt,
     dirindex = (virt >> 22);
 
     PageDir* pdir = (PageDir*)kernel_virt_cr3_base;
-    Log::Write(Debug, "vmm", "pdir[%d] = %08x", dirindex, pdir[dirindex]);
+    LOG(Debug, "vmm", "pdir[%d] = %08x", dirindex, pdir[dirindex]);
     if (!pdir[dirindex].present) {
 	// Allocate directory, present and RW, and clean all bytes of it
 	pdir[dirindex].addr = VMM::MapPageDirectoryIndex(dirindex) | 0x3;
 	memset((char*)(kernel_virt_first_table + (dirindex*4096)), 0, 4096);
     }
-    Log::Write(Debug, "vmm", "pdir[%d] = %08x", dirindex, pdir[dirindex]);
+    LOG(Debug, "vmm", "pdir[%d] = %08x", dirindex, pdir[dirindex]);
     
     PageTable* ptbl = (PageTable*)kernel_virt_first_table;
     unsigned toffset = (dirindex * 1024) + tableindex;
     
     if (ptbl[toffset].present) {
-	Log::Write(Warning, "vmm", "page dir %d table %d vaddr %08x already mapped",
-		   dirindex, tableindex, virt);
+	LOG(Warning, "vmm", "page dir %d table %d vaddr %08x already mapped",
+	    dirindex, tableindex, virt);
     }
 
+    uint32_t pteflags = VMM::ToPTEFlags(flags);
+
     for (unsigned int i = 0; i < n; i++) {
-	Log::Write(Debug, "vmm", "dir %d tbl %d idx %d", dirindex, tableindex, i);
-	Log::Write(Debug, "vmm", "ptbl[%d] = %08x", toffset+i, ptbl[toffset+i].addr);
-	ptbl[toffset+i].addr = phys | (flags & 0x7f); // Map an address, with present and RW bit
-	Log::Write(Debug, "vmm", "ptbl[%d] = %08x", toffset+i, ptbl[toffset+i].addr);
+	LOG(Debug, "vmm", "dir %d tbl %d idx %d", dirindex, tableindex, i);
+	LOG(Debug, "vmm", "ptbl[%d] = %08x", toffset+i, ptbl[toffset+i].addr);
+	ptbl[toffset+i].addr = phys | pteflags; // Map an address, with present and RW bit
+	LOG(Debug, "vmm", "ptbl[%d] = %08x", toffset+i, ptbl[toffset+i].addr);
 	// 'tableindex' and 'dirindex' aren't used for indexing, just for
 	// keeping track of directory wraps (when we go through the last
 	// table of a directory)
@@ -207,8 +227,10 @@ int VMM::MapPhysicalToVirtual(phys_t phys, size_t n, virt_t virt,
 	    dirindex++;
 	    tableindex = 0;
 
-	    if (!pdir[dirindex].present)
+	    if (!pdir[dirindex].present) {
 		pdir[dirindex].addr = VMM::MapPageDirectoryIndex(dirindex) | 0x3;
+		memset((char*)(kernel_virt_first_table + (dirindex*4096)), 0, 4096);
+	    }
 	}
     }
 
@@ -225,18 +247,18 @@ int VMM::UnmapVirtual(virt_t virt, size_t n)
     dirindex = (virt >> 22);
 
     PageDir* pdir = (PageDir*)kernel_virt_cr3_base;
-    Log::Write(Debug, "vmm", "pdir[%d] = %08x", dirindex, pdir[dirindex]);
+    LOG(Debug, "vmm", "pdir[%d] = %08x", dirindex, pdir[dirindex]);
     if (!pdir[dirindex].present) {
-	Log::Write(Fatal, "vmm", "Deallocating map from unmapped directory (index %d)",
-			   dirindex);
+	LOG(Fatal, "vmm", "Deallocating map from unmapped directory (index %d)",
+	    dirindex);
     }
 
     PageTable* ptbl = (PageTable*)kernel_virt_first_table;
     unsigned toffset = (dirindex * 1024) + tableindex;
     
-    if (ptbl[toffset].present) {
-	Log::Write(Warning, "vmm", "page dir %d table %d vaddr %08x already mapped",
-		   dirindex, tableindex, virt);
+    if (!ptbl[toffset].present) {
+	LOG(Warning, "vmm", "page dir %d table %d vaddr %08x is not mapped",
+	    dirindex, tableindex, virt);
     }
 
     for (unsigned int i = 0; i < n; i++) {
@@ -252,8 +274,8 @@ int VMM::UnmapVirtual(virt_t virt, size_t n)
 
 	    // TODO: Check and allocate another directory
 	    if (!pdir[dirindex].present) {
-		Log::Write(Fatal, "vmm", "Deallocating map from unmapped directory (index %d)",
-			   dirindex);
+		LOG(Fatal, "vmm", "Deallocating map from unmapped directory (index %d)",
+		    dirindex);
 	    }
 		
 	}
@@ -265,7 +287,7 @@ int VMM::UnmapVirtual(virt_t virt, size_t n)
 void VMM::Init(annos::PMM* pmm, const uintptr_t phys_cr3_base,
 		      virt_t kernel_start, virt_t kernel_end)
 {
-    Log::Write(Debug, "vmm", "phys_cr3 %08x, virtual_kstart %08x, virtual_kend %08x", phys_cr3_base, kernel_start, kernel_end);
+    LOG(Debug, "vmm", "phys_cr3 %08x, virtual_kstart %08x, virtual_kend %08x", phys_cr3_base, kernel_start, kernel_end);
     
     /* 2 things:
      *   1: Map the last page directory entry to the page directory
@@ -276,22 +298,22 @@ void VMM::Init(annos::PMM* pmm, const uintptr_t phys_cr3_base,
     PageDir* pdir = (PageDir*)phys_cr3_base;
     
 
-    Log::Write(Debug, "vmm", "pdir[1023].addr - %08x",
-	       pdir[1023].addr);
+    LOG(Debug, "vmm", "pdir[1023].addr - %08x",
+	pdir[1023].addr);
 
     pdir[1023].addr = phys_cr3_base | 0x3; // Map last dir to itself, present and writeable.
 
-    Log::Write(Debug, "vmm", "pdir[1023].addr - %08x",
-	       pdir[1023].addr);
+    LOG(Debug, "vmm", "pdir[1023].addr - %08x",
+	pdir[1023].addr);
 
     
     PageDir* identity_pdir = (PageDir*)kernel_virt_cr3_base;
-    Log::Write(Debug, "vmm", "identity_pdir[0] = %08x",
-	       identity_pdir[0]);
+    LOG(Debug, "vmm", "identity_pdir[0] = %08x",
+	identity_pdir[0]);
 
     PageTable* identity_ptbl = (PageTable*)(identity_pdir[0].addr & ~0x3ff);
-    Log::Write(Debug, "vmm", "identity_ptbl[0] = %08x",
-	       identity_ptbl[0]);
+    LOG(Debug, "vmm", "identity_ptbl[0] = %08x",
+	identity_ptbl[0]);
 
     identity_ptbl[0].addr = 0;
     VMM::_pmm = pmm;
@@ -305,14 +327,55 @@ void VMM::Init(annos::PMM* pmm, const uintptr_t phys_cr3_base,
     // (Next framebuffer access might cause a page fault)
     asm("mov %0, %%cr3" : : "r"(phys_cr3_base & ~0x3ff));
 
+    VMM::SetupPAT();
+}
+
+// The IA32_PAT MSR
+#define MSR_PAT 0x277
+
+/**
+ * Program the page attribute table, so we can have write-combining
+ * pages
+ */
+void VMM::SetupPAT()
+{
+    uint32_t eax = 1, ebx, ecx, edx;
+    asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+
+    if (!(edx & (1 << 16))) {
+	LOG(Info, "vmm", "no PAT, write-combining pages will be uncached");
+	return;
+    }
+
+    VMM::_has_pat = true;
+    VMM::LoadPAT();
+}
 
+/**
+ * Program the page attribute table of the current processor
+ * Every processor must have the same one, so the other processors
+ * call this when they start.
+ */
+void VMM::LoadPAT()
+{
+    if (!VMM::_has_pat)
+	return;
+
+    /* Keep the power-on entries 0 to 3 (WB, WT, UC-, UC), so the PWT and
+       PCD bits keep their meaning, and use entry 4 (the PAT bit alone)
+       for write-combining. The others are the same as 0 to 3 */
+    uint32_t lo = 0x00070406, hi = 0x00070401;
+
+    asm volatile("wbinvd" ::: "memory");
+    asm volatile("wrmsr" :: "a"(lo), "d"(hi), "c"(MSR_PAT));
+    asm volatile("wbinvd" ::: "memory");
 }
 
 /**
  * Allocate next avaliable 'n' pages from zone 'zone'.
  * Return the allocated virtual address from that zone
  */
-virt_t VMM::AllocateVirtual(size_t n, uint8_t flags, VMMZone zone)
+virt_t VMM::AllocateVirtual(size_t n, uint16_t flags, VMMZone zone)
 {
     virt_t v = VMM::AllocateVirtualPhysical(NULL, PMMZoneType::Normal, n, flags, zone);
     return v;    
@@ -331,14 +394,14 @@ virt_t VMM::AllocateVirtual(size_t n, uint8_t flags, VMMZone zone)
  * Return the allocated virtual address
  */
 virt_t VMM::AllocateVirtualPhysical(phys_t* rphys, PMMZoneType pzone,
-				    size_t n,  uint8_t flags, VMMZone vzone)
+				    size_t n,  uint16_t flags, VMMZone vzone)
 {    
     auto last_vaddr = vzones[vzone].last_vaddr;
-    Log::Write(Debug, "vmm", "last_vaddr = %08x", last_vaddr);
+    LOG(Debug, "vmm", "last_vaddr = %08x", last_vaddr);
 
     auto alloc_end = last_vaddr + (VMM_PAGE_SIZE * n);
     if ((alloc_end-1) >= vzones[vzone].addr_end) {
-	Log::Write(Fatal, "vmm",  "virtual address space exhausted for vmm zone %d", vzone);
+	LOG(Fatal, "vmm",  "virtual address space exhausted for vmm zone %d", vzone);
 	panic("vmm: virtual address space exhausted ");
     }
 
@@ -368,7 +431,7 @@ virt_t VMM::AllocateVirtualPhysical(phys_t* rphys, PMMZoneType pzone,
  *
  * Return the mapped virtual address for that physical address
  */
-virt_t VMM::MapPhysicalAddress(phys_t phys, size_t n, uint8_t flags,
+virt_t VMM::MapPhysicalAddress(phys_t phys, size_t n, uint16_t flags,
 				      VMMZone vzone)
 {
     auto last_vaddr = vzones[vzone].last_vaddr;
@@ -377,11 +440,11 @@ virt_t VMM::MapPhysicalAddress(phys_t phys, size_t n, uint8_t flags,
     phys &= ~0xfff; // align the physaddr to a page
 	
     auto alloc_end = last_vaddr + (VMM_PAGE_SIZE * n);
-    Log::Write(Debug, "vmm", "phys %08x => virt %08x -> %d pages",
-	       phys, last_vaddr, n);
+    LOG(Debug, "vmm", "phys %08x => virt %08x -> %d pages",
+	phys, last_vaddr, n);
     
     if ((alloc_end-1) >= vzones[vzone].addr_end) {
-	Log::Write(Fatal, "vmm",  "virtual address space exhausted for vmm zone %d", vzone);
+	LOG(Fatal, "vmm",  "virtual address space exhausted for vmm zone %d", vzone);
 	panic("vmm: virtual address space exhausted");
     }
 
@@ -401,10 +464,61 @@ virt_t VMM::MapPhysicalAddress(phys_t phys, size_t n, uint8_t flags,
 }
 
 /**
- * Unmap 'n' pages starting from physical address 'phys' 
+ * Map 'n' pages of device memory (or firmware tables) starting at
+ * physical address 'phys' into the next available virtual pages
+ *
+ * Unlike MapPhysicalAddress(), the pages aren't reserved in the PMM,
+ * because they usually aren't RAM, and they might be mapped more
+ * than once.
+ *
+ * Return the mapped virtual address for that physical address
+ */
+virt_t VMM::MapMMIO(phys_t phys, size_t n, uint16_t flags, VMMZone vzone)
+{
+    auto last_vaddr = vzones[vzone].last_vaddr;
+
+    unsigned off = phys & 0xfff;
+    phys &= ~0xfff; // align the physaddr to a page
+
+    auto alloc_end = last_vaddr + (VMM_PAGE_SIZE * n);
+    LOG(Debug, "vmm", "mmio %08x => virt %08x -> %d pages",
+	phys, last_vaddr, n);
+
+    if ((alloc_end-1) >= vzones[vzone].addr_end) {
+	LOG(Fatal, "vmm",  "virtual address space exhausted for vmm zone %d", vzone);
+	panic("vmm: virtual address space exhausted");
+    }
+
+    auto virtaddr = last_vaddr;
+    VMM::MapPhysicalToVirtual(phys, n, virtaddr, flags);
+
+    vzones[vzone].last_vaddr = last_vaddr + (VMM_PAGE_SIZE * n);
+    return virtaddr+off;
+}
+
+/**
+ * Point the already mapped page 'virt' to the physical page 'phys'
+ * and flush its TLB entry.
+ * Cheaper than mapping again, and it doesn't spend virtual addresses,
+ * so it's good for a window that moves over a big physical area.
+ */
+void VMM::RemapPage(virt_t virt, phys_t phys, uint16_t flags)
+{
+    PageTable* ptbl = (PageTable*)kernel_virt_first_table;
+    ptbl[virt >> 12].addr = (phys & ~0xfff) | VMM::ToPTEFlags(flags);
+
+    asm volatile("invlpg (%0)" :: "r"(virt) : "memory");
+}
+
+/**
+ * Unmap 'n' pages starting from virtual address 'virt', and flush
+ * their TLB entries
  */
 void VMM::Unmap(virt_t virt, size_t n)
 {
     VMM::UnmapVirtual(virt, n);
+
+    for (size_t i = 0; i < n; i++)
+	asm volatile("invlpg (%0)" :: "r"(virt + i * VMM_PAGE_SIZE) : "memory");
 }
 
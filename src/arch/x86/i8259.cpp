@@ -8,7 +8,6 @@
 #include <arch/x86/i8259.hpp>
 #include <arch/x86/IO.hpp>
 #include <libk/panic.h>
-#include <Log.hpp>
 
 using namespace annos::x86;
 
@@ -28,12 +27,9 @@ void i8259::Initialize()
        so it don't conflict with the processor exceptions
      */
 
-    // Small io_wait
+    // The old 8259s need a small recovery time between the ICWs
     auto io_wait_busy = [](){
-	volatile unsigned i = 0;
-	for (i = 0; i < 500; i += 2) {
-	    i--;
-	}
+	udelay(1);
     };
     
     out8(MasterPIC.command, 0x11); // ICW1 - begin initialisation;
@@ -119,33 +115,59 @@ void i8259::SetIRQMask(unsigned irqno, bool status)
  */
 bool i8259::GetIRQMask(unsigned irqno)
 {
-    // TODO: implement
-    return false;
+    unsigned port = (irqno >= 8) ? SlavePIC.data : MasterPIC.data;
+    return (in8(port) & (1 << (irqno % 8))) == 0;
+}
+
+/**
+ * Mask all IRQs, including the cascade
+ * Used when the APIC takes over
+ */
+void i8259::MaskAll()
+{
+    out8(SlavePIC.data, 0xff);
+    out8(MasterPIC.data, 0xff);
 }
 	
 
+/* Read the in-service register of a single controller */
+static uint8_t ReadISRFrom(const PICPorts& pic)
+{
+    out8(pic.command, 0x0b);
+    return in8(pic.command);
+}
+
 /**
  * Send an End of Interrupt signal
+ *
+ * Only the last line of each controller (IRQ 7 and IRQ 15) can be
+ * spurious, so only those pay for an ISR read.
+ *
+ * @return false if the IRQ was spurious
  */
-void i8259::SendEOI(unsigned irqno)
+bool i8259::SendEOI(unsigned irqno)
 {
-    // Get the ISR, so we can detect spurious IRQs
-    uint16_t isr = this->ReadISR();
-    
-    if (irqno >= 8) {
-	if (isr & (1 << irqno)) {
-	    out8(SlavePIC.command, 0x20);
-	} else {
-	    Log::Write(LogLevel::Warning, "i8259", "spurious IRQ on %d", irqno);
-	}
-    } else {
-	if ( (isr & (1 << irqno)) == 0) {
-	    Log::Write(LogLevel::Warning, "i8259", "spurious IRQ on %d", irqno);
-	    return;
-	}
+    // Not one of ours
+    if (irqno >= 16)
+	return true;
+
+    if (irqno == 7 && !(ReadISRFrom(MasterPIC) & 0x80)) {
+	// Spurious IRQ from the master. It was never in service.
+	return false;
+    }
+
+    if (irqno == 15 && !(ReadISRFrom(SlavePIC) & 0x80)) {
+	/* Spurious IRQ from the slave. The master doesn't know that, and
+	   the cascade line is in service there */
+	out8(MasterPIC.command, 0x20);
+	return false;
     }
 
+    if (irqno >= 8)
+	out8(SlavePIC.command, 0x20);
+
     out8(MasterPIC.command, 0x20);
+    return true;
 }
 
 
@@ -158,7 +180,6 @@ void i8259::SendEOI(unsigned irqno)
  */
 uint16_t i8259::ReadISR()
 {
-    out8(MasterPIC.command, 0x0b);
-    out8(SlavePIC.command, 0x0b);
-    return (in8(SlavePIC.command) << 8) | in8(MasterPIC.command);
+    uint8_t master = ReadISRFrom(MasterPIC);
+    return (ReadISRFrom(SlavePIC) << 8) | master;
 }
@@ -0,0 +1,128 @@
+#pragma once
+
+/*
+  ANSI/VT escape sequence parser for the consoles
+
+  A table-driven state machine that reads the CSI sequences (ESC [ ...)
+  and tells the console what to do through the IAnsiTarget interface.
+  It supports the SGR attributes (colors, including the 256 colors and
+  24-bit ones, and bold), cursor movement and erase.
+
+  The state is kept between calls, so a sequence split across two writes
+  still works. The text between the sequences is given to the console in
+  whole spans.
+
+  Copyright (C) 2018 Arthur M
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace annos {
+
+    // Maximum number of parameters of a CSI sequence. Extra ones are ignored
+#define ANSI_MAX_PARAMS 16
+
+    enum AnsiColorType : uint8_t {
+	AnsiColorDefault, // The color the console writes with
+	AnsiColorIndex,   // One of the 16 VGA colors
+	AnsiColorRGB,
+    };
+
+    struct AnsiColor {
+	AnsiColorType type;
+	uint8_t index; // A BaseColors value
+	uint8_t r, g, b;
+    };
+
+    /**
+     * The current text attributes
+     */
+    struct AnsiAttr {
+	AnsiColor fg, bg;
+	bool bold;
+    };
+
+    enum AnsiErase {
+	AnsiEraseToEnd,   // From the cursor to the end
+	AnsiEraseToStart, // From the start to the cursor
+	AnsiEraseAll,
+    };
+
+    /**
+     * What a console implements to be driven by the parser
+     */
+    class IAnsiTarget {
+    public:
+	/**
+	 * Write a span of text, with the current attributes
+	 * It might have control characters, like '\n' and '\t'
+	 */
+	virtual void AnsiText(const char* str, size_t len) = 0;
+
+	/**
+	 * The attributes changed
+	 */
+	virtual void AnsiAttributes(const AnsiAttr& attr) = 0;
+
+	virtual void AnsiGetCursor(unsigned& x, unsigned& y) = 0;
+
+	/**
+	 * Move the cursor. Clamp it to the screen
+	 */
+	virtual void AnsiSetCursor(unsigned x, unsigned y) = 0;
+
+	/**
+	 * Erase part of the line or of the screen, relative to the cursor
+	 */
+	virtual void AnsiEraseLine(AnsiErase mode) = 0;
+	virtual void AnsiEraseScreen(AnsiErase mode) = 0;
+    };
+
+    class AnsiParser {
+    private:
+	uint8_t _state = 0;
+
+	uint16_t _params[ANSI_MAX_PARAMS] = {};
+	unsigned _param_count = 0;
+	bool _private = false; // The sequence has a '?' or similar
+
+	AnsiAttr _attr = {};
+
+	/**
+	 * Execute the CSI sequence ending with 'final'
+	 */
+	void Dispatch(IAnsiTarget* t, char final);
+
+	/**
+	 * Execute a 'Select Graphic Rendition' (ESC [ ... m)
+	 */
+	void SelectGraphics(IAnsiTarget* t);
+
+	/**
+	 * Read a color given as 5;n or 2;r;g;b, starting at the
+	 * parameter 'i'
+	 *
+	 * @return the index of the last parameter used
+	 */
+	unsigned ReadExtendedColor(unsigned i, AnsiColor& c);
+
+    public:
+	/**
+	 * Parse 'len' bytes of 'str', and drive 't' with them
+	 */
+	void Feed(IAnsiTarget* t, const char* str, size_t len);
+
+	/**
+	 * Parse a null-terminated string
+	 */
+	void Feed(IAnsiTarget* t, const char* str);
+
+	const AnsiAttr& GetAttributes() const { return _attr; }
+    };
+
+    /**
+     * The nearest of the 16 VGA colors to an RGB color
+     */
+    uint8_t AnsiNearestVGA(uint8_t r, uint8_t g, uint8_t b);
+}
@@ -1,15 +1,13 @@
 #pragma once
 
 #include <Console.hpp>
+#include <arch/x86/UART16550.hpp>
 
 /*
   Kernel serial logging console driver
 
-  Outputs logging information to COM1 at 9600 baud, for ease retrieval of
-  logger information
-
-  TODO: When the *real* serial port driver starts, make this console driver
-  use it, instead of its own thing
+  Outputs logging information to COM1 at 115200 baud, for ease retrieval
+  of logger information. The UART driver does the real work
 
   Copyright (C) 2018 Arthur M
 */
@@ -19,14 +17,15 @@ namespace annos {
 
     private:
 	void WriteString(const char* str);
-	void WriteChar(char c);
 
-	const int portno = 0x3f8;
-	const int baud = 115200;
+	x86::UART16550 _uart;
 	
     public:
 	/* Do a basic setup */
 	SerialLogConsole();
+
+	/* The UART under us, so its IRQ can be installed */
+	x86::UART16550* GetUART() { return &_uart; }
 	
 	/* Write function for VGA-compatible output */
 	virtual void WriteVGA(const char* str,
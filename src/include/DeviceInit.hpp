@@ -0,0 +1,127 @@
+#pragma once
+
+/**
+ * Asynchronous device initialization
+ *
+ * Each device we initialize at boot becomes a task. A task can depend on
+ * other tasks, and it runs as a deferred work item once all of them are
+ * finished, so a slow device does not hold the ones that don't need it.
+ *
+ * Only the tasks marked as required hold the boot. The others are only
+ * queued after the required ones finish, so they run in the idle loop,
+ * after the system is loaded.
+ *
+ * Copyright (C) 2018 Arthur M
+ */
+
+#include <Device.hpp>
+#include <WorkQueue.hpp>
+#include <stdint.h>
+#include <stddef.h>
+
+namespace annos {
+
+#define MAX_DEVINIT_DEPS 4
+
+    enum DeviceInitState {
+	DevInitWaiting,  // Some dependency isn't finished
+	DevInitQueued,   // In the work queue
+	DevInitDone,     // Detected and initialized
+	DevInitNotFound, // Detect() failed
+    };
+
+    struct DeviceInitTask;
+
+    /**
+     * Called after the device initializes, still inside the task.
+     * Use it to install the IRQ handlers and things like that
+     */
+    typedef void (*fnDeviceInitDone)(DeviceInitTask* t, void* data);
+
+    /**
+     * A device initialization task
+     *
+     * The memory is owned by the caller, and must be kept alive until
+     * the task finishes.
+     */
+    struct DeviceInitTask {
+	Device* dev;
+
+	// Boot waits for this task in DeviceInit::WaitRequired()
+	bool required;
+
+	fnDeviceInitDone done;
+	void* data;
+
+	DeviceInitTask* deps[MAX_DEVINIT_DEPS] = {};
+	unsigned dep_count = 0;
+
+	volatile DeviceInitState state = DevInitWaiting;
+
+	// Time the task started and finished, in nanoseconds
+	uint64_t start_ns = 0, end_ns = 0;
+
+	WorkItem work;
+	DeviceInitTask* next = NULL;
+
+	DeviceInitTask(Device* d, bool req, fnDeviceInitDone cb = NULL,
+		       void* cbdata = NULL)
+	    : dev(d), required(req), done(cb), data(cbdata)
+	    {}
+
+	/**
+	 * Only run this task after 't' finishes
+	 * Must be called before the task is added.
+	 */
+	void DependsOn(DeviceInitTask* t);
+
+	bool IsFinished() const {
+	    return state == DevInitDone || state == DevInitNotFound;
+	}
+    };
+
+    enum DeviceInitPhase {
+	DevInitRegistering, // Tasks are added, nothing runs
+	DevInitRequired,    // Only the required tasks run
+	DevInitBackground,  // All tasks run
+    };
+
+    class DeviceInit {
+    private:
+	static DeviceInitTask* _tasks;
+	static DeviceInitPhase _phase;
+
+	/**
+	 * Queue the waiting tasks whose dependencies are finished
+	 * Before the background phase, only the required ones.
+	 */
+	static void QueueReady();
+
+	static void RunTask(WorkItem* w, void* data);
+
+    public:
+	/**
+	 * Add a task
+	 * It's only queued by WaitRequired(), or right away if that
+	 * already ran.
+	 */
+	static void Add(DeviceInitTask* t);
+
+	/**
+	 * Run the deferred work until 't' finishes
+	 * Waiting for a background task starts the background phase.
+	 */
+	static void WaitFor(DeviceInitTask* t);
+
+	/**
+	 * Run the required tasks, and the deferred work, until they
+	 * finish. Then queue the other tasks, to run in the idle loop
+	 */
+	static void WaitRequired();
+
+	/**
+	 * Log how long each finished task took
+	 */
+	static void Report();
+    };
+}
@@ -0,0 +1,178 @@
+#pragma once
+
+/*
+   Console implementation on linear framebuffers
+
+   The bootloader sets the video mode and gives us the framebuffer in the
+   multiboot information. We map it write-combining, so the glyph writes
+   go to the bus in bursts.
+
+   The text is kept in a ring of character cells, like in the VGA console,
+   and only the changed part of each row (its dirty span) is drawn, once
+   per write. We also keep the cells that are on the screen, so a scroll
+   only moves the ring top, and redraws the cells that really changed.
+
+   The glyphs are drawn through an expansion table with the 8 pixel masks
+   of each possible glyph byte, so each pixel costs an and-or, with no
+   bit tests.
+
+   The escape sequences are read by the shared ANSI parser, so the
+   24-bit colors are drawn as they are.
+
+   Only 32 bits per pixel modes are supported.
+
+   Copyright (C) 2018 Arthur M
+ */
+
+#include <Console.hpp>
+#include <AnsiParser.hpp>
+#include <stdint.h>
+#include <stddef.h>
+
+namespace annos {
+
+    // Limits of the text grid. Bigger screens leave a margin
+#define FB_MAX_COLS 256
+#define FB_MAX_ROWS 128
+
+    /**
+     * A bitmap font
+     * Each glyph has 'height' rows of 'row_bytes' bytes, the leftmost
+     * pixel in the most significant bit
+     */
+    struct FBFont {
+	unsigned width, height;
+	unsigned first, count; // The characters it has
+	unsigned row_bytes;
+	const uint8_t* glyphs;
+    };
+
+    // The font we use when there's no PSF font
+    extern const FBFont fb_builtin_font;
+
+    /**
+     * The framebuffer, as the bootloader describes it
+     */
+    struct FBInfo {
+	uint64_t phys;
+	uint32_t pitch; // Bytes per line
+	uint32_t width, height;
+	uint8_t bpp;
+	uint8_t red_pos, red_size;
+	uint8_t green_pos, green_size;
+	uint8_t blue_pos, blue_size;
+    };
+
+    /**
+     * A character cell, with its colors already in the framebuffer
+     * pixel format
+     */
+    struct FBCell {
+	uint32_t fg, bg;
+	uint8_t ch;
+    };
+
+    class FramebufferConsole : public Console, public IAnsiTarget {
+    private:
+	volatile uint32_t* _fb = NULL;
+	unsigned _pitch = 0; // In pixels
+	FBInfo _info;
+	const FBFont* _font = NULL;
+
+	unsigned _cols = 0, _rows = 0;
+	unsigned _xPos = 0, _yPos = 0;
+
+	// The cells, a ring of rows. '_top' is the first screen row
+	FBCell* _cells = NULL;
+	unsigned _top = 0;
+
+	// The cells drawn on the screen, in screen order
+	FBCell* _shown = NULL;
+
+	// Dirty span of each screen row. Empty if start >= end
+	uint16_t _dirty_start[FB_MAX_ROWS];
+	uint16_t _dirty_end[FB_MAX_ROWS];
+
+	// Where we drew the cursor
+	unsigned _cursor_x = 0, _cursor_y = 0;
+
+	// The 16 VGA colors, in the framebuffer pixel format
+	uint32_t _palette[16];
+
+	AnsiParser _ansi;
+
+	/* The color of the current write, used for the default foreground
+	   'fgbase' is its palette index, so bold can brighten it, or -1 */
+	uint32_t _write_fg = 0;
+	int _write_fgbase = -1;
+
+	// The colors we write the characters with
+	uint32_t _fg = 0, _bg = 0;
+
+	/**
+	 * Get the colors from the ANSI attributes and the write color
+	 */
+	void UpdateColor(const AnsiAttr& attr);
+	uint32_t AnsiPixel(const AnsiColor& c, bool bold);
+
+	// Clear 'count' cells from column 'x' of row 'y'
+	void EraseCells(unsigned x, unsigned y, unsigned count);
+
+	FBCell* CellRow(unsigned y);
+	void MarkDirty(unsigned x, unsigned y);
+
+	uint32_t MakePixel(uint8_t r, uint8_t g, uint8_t b);
+
+	void PutChar(char c, uint32_t fg, uint32_t bg);
+	void Scroll();
+
+	void DrawCell(unsigned x, unsigned y, const FBCell* cell);
+	void DrawCursor();
+
+	/**
+	 * Draw the dirty spans and the cursor
+	 */
+	void Flush();
+
+	/**
+	 * Write 'str', with 'fg' as the default foreground
+	 */
+	void Write(const char* str, uint32_t fg, int fgbase);
+
+    public:
+	/**
+	 * Map the framebuffer and allocate the cells
+	 *
+	 * @return false if we can't use this framebuffer
+	 */
+	bool Init(const FBInfo& info, const FBFont* font = &fb_builtin_font);
+
+	/**
+	 * Read a PSF (version 1 or 2) font from memory
+	 * The glyphs are copied, so 'data' can go away.
+	 *
+	 * @return true if it's a valid font
+	 */
+	static bool LoadPSF(const void* data, size_t len, FBFont& font);
+
+	/* Write function for VGA-compatible output */
+	virtual void WriteVGA(const char* str,
+			      BaseColors color = BaseColors::LightGrey);
+	
+	/* Write function for RGB-compatible output */
+	virtual void WriteRGB(const char* str,
+			      uint8_t r, uint8_t g, uint8_t b);
+
+	virtual void Clear();
+
+	virtual void AnsiText(const char* str, size_t len);
+	virtual void AnsiAttributes(const AnsiAttr& attr);
+	virtual void AnsiGetCursor(unsigned& x, unsigned& y);
+	virtual void AnsiSetCursor(unsigned x, unsigned y);
+	virtual void AnsiEraseLine(AnsiErase mode);
+	virtual void AnsiEraseScreen(AnsiErase mode);
+
+	unsigned GetColumns() const { return _cols; }
+	unsigned GetRows() const { return _rows; }
+    };
+}
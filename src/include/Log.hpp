@@ -1,11 +1,26 @@
 #pragma once
 
 #include <Console.hpp>
+#include <WorkQueue.hpp>
+#include <libk/stdio.h>
+#include <libk/stdlib.h>
+#include <stdint.h>
 #include <stddef.h> //for NULL
 
 /*
   Subsystem for the kernel logger
 
+  LOG() does not format the message. It appends a binary record to
+  an in-memory ring, like the dmesg buffer, with the format string
+  pointer, a TSC timestamp and the raw arguments. A deferred work item
+  drains the ring to the log console later, formatting the records, so
+  logging never waits for the serial port or for the formatter.
+
+  Any number of writers can append at the same time, even from
+  interrupt handlers: they reserve their space with a compare-and-swap
+  on the head, and mark the record as committed when it's complete.
+  The drainer is the only reader.
+
   Copyright (C) 2018 Arthur M
 */
 
@@ -20,14 +35,322 @@ namespace annos {
 	Fatal,
     };
 
+    /* LOG() calls below this level are removed at compile time.
+       Build with 'make LOG_MIN_LEVEL=n' to change it */
+#ifndef ANNOS_LOG_MIN_LEVEL
+#define ANNOS_LOG_MIN_LEVEL 0
+#endif
+
+    // How many tags can have their own level
+#define LOG_MAX_TAG_RULES 16
+#define LOG_MAX_TAG_NAME 16
+
+    // Entries of the tag level cache. Must be a power of 2
+#define LOG_TAG_CACHE_SIZE 64
+
+    /**
+     * A log level set for one tag
+     */
+    struct LogTagRule {
+	char tag[LOG_MAX_TAG_NAME];
+	uint8_t level;
+    };
+
+    /**
+     * The level of a tag, cached by the tag pointer, since the tags are
+     * literals
+     */
+    struct LogTagCache {
+	const char* tag;
+	uint32_t generation;
+	uint8_t level;
+    };
+
+    // Size of the log ring, in bytes. Must be a power of 2
+#define LOG_RING_SIZE 16384
+
+    enum LogRecordState {
+	LogRecordReserved = 0, // Still being written. Free space is zeroed to it
+	LogRecordCommitted,
+	LogRecordPadding,      // Fills the end of the ring. Skip it
+    };
+
+    /**
+     * Header of each record in the log ring
+     *
+     * The arguments follow it, laid out the way the i386 calling
+     * convention puts variadic arguments in the stack (each one in 4-byte
+     * slots, after the default promotions), so the drainer can use them
+     * as a va_list.
+     * The strings are copied after the arguments, and their argument
+     * points to the copy.
+     * The format string must be a literal, since we only keep its pointer.
+     */
+    struct LogRecord {
+	uint16_t size;  // Of the whole record, multiple of 4
+	uint8_t level;
+	volatile uint8_t state;
+	const char* tag;
+	const char* fmt;
+	uint64_t tsc;
+    };
+
+    // Longer string arguments are truncated
+#define LOG_MAX_STRING 256
+
+    /* Packing of the log arguments.
+       LogArgSize() returns the slot size of an argument, and adds the
+       space its string copy needs to 'extra'. LogArgPack() writes it */
+    namespace logargs {
+
+	template <typename T>
+	inline size_t ArgSize(size_t& extra, T v) {
+	    (void)extra;
+	    (void)v;
+	    return (sizeof(T) + 3) & ~3;
+	}
+
+	inline size_t StringLen(const char* s) {
+	    if (!s)
+		return 0;
+
+	    size_t len = 0;
+	    while (s[len] && len < LOG_MAX_STRING)
+		len++;
+	    return len;
+	}
+
+	inline size_t ArgSize(size_t& extra, const char* s) {
+	    extra += StringLen(s) + 1;
+	    return sizeof(const char*);
+	}
+
+	inline size_t ArgSize(size_t& extra, char* s) {
+	    return ArgSize(extra, (const char*)s);
+	}
+
+	// Floats are promoted to double
+	inline size_t ArgSize(size_t& extra, float v) {
+	    (void)extra;
+	    (void)v;
+	    return sizeof(double);
+	}
+
+	inline size_t Size(size_t& extra) {
+	    (void)extra;
+	    return 0;
+	}
+
+	template <typename T, typename... Rest>
+	inline size_t Size(size_t& extra, T v, Rest... rest) {
+	    size_t s = ArgSize(extra, v);
+	    return s + Size(extra, rest...);
+	}
+
+	template <typename T>
+	inline void ArgPack(uint8_t*& slot, char*& strs, T v) {
+	    (void)strs;
+	    *(uint32_t*)(slot + ((sizeof(T) - 1) & ~3)) = 0;
+	    memcpy(slot, &v, sizeof(T));
+	    slot += (sizeof(T) + 3) & ~3;
+	}
+
+	// The types smaller than an int are promoted, keeping the sign
+	inline void PackInt(uint8_t*& slot, int v) {
+	    *(int*)slot = v;
+	    slot += sizeof(int);
+	}
+
+	inline void ArgPack(uint8_t*& slot, char*& strs, char v) {
+	    (void)strs; PackInt(slot, v);
+	}
+	inline void ArgPack(uint8_t*& slot, char*& strs, signed char v) {
+	    (void)strs; PackInt(slot, v);
+	}
+	inline void ArgPack(uint8_t*& slot, char*& strs, unsigned char v) {
+	    (void)strs; PackInt(slot, v);
+	}
+	inline void ArgPack(uint8_t*& slot, char*& strs, short v) {
+	    (void)strs; PackInt(slot, v);
+	}
+	inline void ArgPack(uint8_t*& slot, char*& strs, unsigned short v) {
+	    (void)strs; PackInt(slot, v);
+	}
+	inline void ArgPack(uint8_t*& slot, char*& strs, bool v) {
+	    (void)strs; PackInt(slot, v);
+	}
+
+	inline void ArgPack(uint8_t*& slot, char*& strs, float v) {
+	    ArgPack(slot, strs, (double)v);
+	}
+
+	inline void ArgPack(uint8_t*& slot, char*& strs, const char* s) {
+	    const char* copy = NULL;
+	    if (s) {
+		size_t len = StringLen(s);
+		memcpy(strs, s, len);
+		strs[len] = '\0';
+		copy = strs;
+		strs += len + 1;
+	    }
+
+	    memcpy(slot, &copy, sizeof(copy));
+	    slot += sizeof(copy);
+	}
+
+	inline void ArgPack(uint8_t*& slot, char*& strs, char* s) {
+	    ArgPack(slot, strs, (const char*)s);
+	}
+
+	inline void Pack(uint8_t*& slot, char*& strs) {
+	    (void)slot;
+	    (void)strs;
+	}
+
+	template <typename T, typename... Rest>
+	inline void Pack(uint8_t*& slot, char*& strs, T v, Rest... rest) {
+	    ArgPack(slot, strs, v);
+	    Pack(slot, strs, rest...);
+	}
+    }
+
     class Log {
     private:
 	static Console* _cons;
+
+	static uint8_t _ring[LOG_RING_SIZE];
+
+	// Free-running byte positions. The ring offset is pos % LOG_RING_SIZE
+	static volatile uint32_t _head;
+	static volatile uint32_t _tail;
+
+	// Records lost because the ring was full
+	static volatile uint32_t _dropped;
+
+	// Set while someone drains the ring
+	static volatile uint32_t _draining;
+
+	static WorkItem _drain_work;
+
+	// Level of the tags without a rule
+	static volatile uint8_t _default_level;
+
+	static LogTagRule _rules[LOG_MAX_TAG_RULES];
+	static unsigned _rule_count;
+
+	/* Changes each time the rules change, so we know which cache
+	   entries are stale */
+	static volatile uint32_t _generation;
+	static LogTagCache _tag_cache[LOG_TAG_CACHE_SIZE];
+
+	/**
+	 * Find the level of 'tag' in the rules, and cache it
+	 */
+	static LogLevel LookupLevel(const char* tag);
+
+	/**
+	 * Reserve 'size' bytes in the ring
+	 *
+	 * @return the record, or NULL if there's no space
+	 */
+	static LogRecord* Reserve(size_t size);
+
+	/**
+	 * Write the committed records to the console
+	 * Stops at the first record not committed yet.
+	 */
+	static void Drain();
+
+	static void DrainWork(WorkItem* w, void* data);
+
+	/**
+	 * Reserve a record with 'datasize' bytes of arguments, and fill
+	 * its header
+	 *
+	 * @return the record, or NULL if the ring is full
+	 */
+	static LogRecord* Begin(LogLevel l, const char* tag, const char* fmt,
+				size_t datasize);
+
+	/**
+	 * Mark the record as complete, and schedule the drain
+	 */
+	static void Commit(LogRecord* r);
+
     public:
 	static void Init(Console* c);
 	static bool IsInit() { return (!(Log::_cons == NULL)); }
-	
-	static void Write(LogLevel l, const char* tag, const char* fmt, ...);
 
+	/**
+	 * Log a message. Call it through LOG()
+	 * 'fmt' is a vsnprintf format. It is only used when the record is
+	 * drained, so it must be a string literal.
+	 */
+	template <typename... Args>
+	static void Write(LogLevel l, const char* tag, const char* fmt,
+			  Args... args) {
+	    if (l < ANNOS_LOG_MIN_LEVEL || l < Log::GetLevel(tag))
+		return;
+
+	    size_t extra = 0;
+	    size_t argsize = logargs::Size(extra, args...);
+
+	    LogRecord* r = Log::Begin(l, tag, fmt, argsize + extra);
+	    if (!r)
+		return;
+
+	    uint8_t* slot = (uint8_t*)(r + 1);
+	    char* strs = (char*)(slot + argsize);
+	    logargs::Pack(slot, strs, args...);
+
+	    Log::Commit(r);
+	}
+
+	/**
+	 * Get the minimum level a message with tag 'tag' needs to be logged
+	 */
+	static inline LogLevel GetLevel(const char* tag) {
+	    auto& c = _tag_cache[((uintptr_t)tag >> 2) & (LOG_TAG_CACHE_SIZE-1)];
+	    if (c.tag == tag && c.generation == _generation)
+		return (LogLevel)c.level;
+
+	    return Log::LookupLevel(tag);
+	}
+
+	/**
+	 * Set the minimum level of the messages of 'tag'
+	 * A NULL tag sets the level of all tags without their own level
+	 *
+	 * @return false if there's no space for another tag
+	 */
+	static bool SetLevel(const char* tag, LogLevel l);
+
+	/**
+	 * Parse the log options of the kernel command line
+	 *
+	 *  loglevel=<level>     sets the default level
+	 *  log.<tag>=<level>    sets the level of a tag
+	 *
+	 * The level can be a name (debug, notice, info, warning, error,
+	 * fatal) or its number.
+	 */
+	static void ParseCommandLine(const char* cmdline);
+
+	/**
+	 * Write all committed records now
+	 * Used when we can't trust the work queue to run anymore, like on
+	 * a panic.
+	 */
+	static void Flush();
     };    
 }
+
+/* Log a message. Use this, not Log::Write(): the level is checked at the
+   call site, so the messages below ANNOS_LOG_MIN_LEVEL compile to
+   nothing, even without optimizations, and their arguments are never
+   evaluated */
+#define LOG(level, tag, ...)						\
+    do {								\
+	if ((level) >= ANNOS_LOG_MIN_LEVEL)				\
+	    ::annos::Log::Write((level), (tag), __VA_ARGS__);		\
+    } while (0)
@@ -8,6 +8,7 @@
 
 #include <Device.hpp>
 #include <stddef.h>
+#include <arch/x86/VMM.hpp>
 
 namespace annos {
 
@@ -85,6 +86,36 @@ namespace annos {
 	
     } __attribute__((packed));
 
+    static_assert(sizeof(PCIRegister) == 64,
+		  "PCIRegister must be the 64-byte configuration header");
+
+    /* PCI capability IDs we know about */
+    enum PCICapability {
+	PCICapPowerManagement = 0x01,
+	PCICapMSI = 0x05,
+	PCICapVendor = 0x09,
+	PCICapExpress = 0x10,
+	PCICapMSIX = 0x11,
+    };
+
+    /* Which kind of interrupt the device is using */
+    enum PCIInterruptMode {
+	PCIIntLegacy, // INTx pin, maybe shared
+	PCIIntMSI,
+	PCIIntMSIX,
+    };
+
+    /**
+     * A base address register, decoded and sized
+     */
+    struct PCIBar {
+	uint64_t addr;
+	uint64_t size;
+	bool io;           // I/O ports, not memory
+	bool prefetchable; // Reads have no side effects
+	bool is64;         // Uses this BAR and the next
+    };
+
     /**
      * PCI Device information
      */
@@ -98,7 +129,60 @@ namespace annos {
 
 	// PCI configuration data bits for that device
 	PCIRegister reginfo;
+
+	// Offset of the MSI and MSI-X capabilities, 0 if not present
+	uint8_t msi_cap = 0, msix_cap = 0;
+
+	// IRQs allocated for MSI or MSI-X
+	PCIInterruptMode int_mode = PCIIntLegacy;
+	int irq_base = -1;
+	unsigned irq_count = 0;
+
+	// All devices, in discovery order
+	PCIDev* next = NULL;
+
+	// Next device in the same vendor:device and class:subclass buckets
+	PCIDev* next_id = NULL;
+	PCIDev* next_class = NULL;
     };
+
+    // Matches any ID in a PCIDeviceID
+#define PCI_ANY_ID 0xffff
+
+    /**
+     * An entry of the table of devices a driver supports
+     * Use PCI_ANY_ID to match anything. The table ends with a zeroed entry
+     */
+    struct PCIDeviceID {
+	uint16_t vendor, device;
+	uint16_t classcode, subclass;
+    };
+
+    class PCIBus;
+
+    /**
+     * Check if the driver can handle the device 'dev', that matched the
+     * table entry 'id', and create its device object
+     *
+     * @return the device object, or NULL if the driver refused it
+     */
+    typedef Device* (*fnPCIProbe)(PCIBus* bus, PCIDev* dev,
+				  const PCIDeviceID* id);
+
+    /**
+     * A PCI driver
+     * The memory is owned by the driver, and must live forever
+     */
+    struct PCIDriver {
+	const char* name;
+	const PCIDeviceID* ids;
+	fnPCIProbe probe;
+
+	PCIDriver* next;
+    };
+
+    // Buckets of each PCI device hash table. Must be a power of 2
+#define PCI_HASH_SIZE 64
     
     class PCIBus : public Device {
 	friend class PCIDevice;
@@ -107,9 +191,92 @@ namespace annos {
 	const unsigned short CONFIG_ADDRESS = 0xCF8;
 	const unsigned short CONFIG_DATA = 0xCFC;
 
-	#define MAX_PCI_DEVS 32
-	PCIDev pcidevs[MAX_PCI_DEVS];
+	/* The device registry
+	   The devices are allocated from pages we get from the VMM, so there's
+	   no limit, and their addresses never change */
+	PCIDev* _devs = NULL;
+	PCIDev* _devs_tail = NULL;
 	unsigned pcidev_count = 0;
+
+	// Free space in the last page we allocated
+	PCIDev* _free_devs = NULL;
+	unsigned _free_count = 0;
+
+	// Indexes by vendor:device and class:subclass
+	PCIDev* _id_hash[PCI_HASH_SIZE] = {};
+	PCIDev* _class_hash[PCI_HASH_SIZE] = {};
+
+	PCIDriver* _drivers = NULL;
+
+	/**
+	 * Allocate a new device, and add it to the registry
+	 * The indexes are only updated in IndexDevice()
+	 */
+	PCIDev* AllocDevice();
+
+	/**
+	 * Add the device to the hash tables
+	 */
+	void IndexDevice(PCIDev* dev);
+
+	/**
+	 * Try the probe of 'drv' for each matching device without a
+	 * driver
+	 */
+	void BindDriver(PCIDriver* drv);
+
+	/**
+	 * Check if 'dev' matches the table entry 'id'
+	 */
+	static bool MatchID(PCIDev* dev, const PCIDeviceID* id);
+
+	/* PCI Express memory mapped configuration (ECAM)
+	   We only map a page of it, and move it to the function we access */
+	uintptr_t _ecam_phys = 0;
+	unsigned _ecam_start = 0, _ecam_end = 0;
+	virt_t _ecam_window = 0;
+	uint32_t _ecam_mapped = 0xffffffff; // bus:dev:func in the window
+
+	// Buses already scanned, so a bad bridge can't make us loop
+	uint32_t _scanned_buses[256 / 32];
+
+	/**
+	 * Find the devices in bus 'bus', and in the buses behind its bridges
+	 */
+	void ScanBus(unsigned bus);
+
+	/**
+	 * Read the header of a function we know exists, and add it to the
+	 * device list. If it's a bridge, scan the bus behind it
+	 */
+	void ScanFunction(unsigned bus, unsigned dev, unsigned fun);
+
+	/**
+	 * Look for the memory mapped configuration space in the ACPI MCFG
+	 * table. If not found, we use the I/O ports
+	 */
+	void InitECAM();
+
+	/**
+	 * Get a pointer to the configuration space of a function, through
+	 * the ECAM window. Must be called with interrupts disabled, so no
+	 * one moves the window while we use it
+	 */
+	volatile uint8_t* MapECAM(unsigned bus, unsigned dev, unsigned func);
+
+	/**
+	 * Read 'size' bits of the register 'idx' of the function 'func', of
+	 * device 'dev' in bus 'bus'
+	 */
+	unsigned ConfigRead(unsigned bus, unsigned dev, unsigned func,
+			    unsigned idx, unsigned size);
+
+	/**
+	 * Write 'size' bits of 'data' in the register 'idx' of the function
+	 * 'func', of device 'dev' in bus 'bus'
+	 */
+	void ConfigWrite(unsigned bus, unsigned dev, unsigned func,
+			 unsigned idx, unsigned size, unsigned data);
 	
 	/**
 	 * Make a read with 'size' bytes in the PCI register 'idx' of device
@@ -125,42 +292,137 @@ namespace annos {
 	// (i.e, you have to do 2 reads to get the full register)
 	// No one of the PCI common registers needs this. Should I treat this
 	// or this will never happen?
+	// With ECAM, 'idx' can go up to 4095, the extended configuration space
 
 	
 	/**
 	 * Write 'data', with 'size' bytes in the PCI register 'idx' of device
 	 * 'dev'
 	 *
-	 * @return the content read
-	 *
 	 * @remarks Note that 'size' can only be a multiple of 8
 	 */
 	template<uint8_t size>
 	void WritePCIRegister(PCIDev* dev, unsigned idx, unsigned data);
 
+	/**
+	 * Find the capability 'id' in the capability list of 'dev'
+	 * 'start' is the offset of the capability to start after, so we
+	 * can find the next one with the same ID
+	 *
+	 * @return the capability offset, or 0 if not found
+	 */
+	unsigned FindCapability(PCIDev* dev, uint8_t id, unsigned start = 0);
+
+	/**
+	 * Enable MSI for 'dev', with 'count' vectors
+	 * 'count' must be a power of 2, and the device might support less
+	 * than that. The legacy INTx interrupt is disabled.
+	 *
+	 * @return the first IRQ number, or -1 if MSI can't be used
+	 */
+	int EnableMSI(PCIDev* dev, unsigned& count);
+
+	/**
+	 * Enable MSI-X for 'dev', with 'count' vectors, one for each table
+	 * entry. Each one gets its own IRQ, and they're written in 'irqs'
+	 *
+	 * @return the number of vectors enabled, or -1 if MSI-X can't be
+	 *         used
+	 */
+	int EnableMSIX(PCIDev* dev, unsigned count, int* irqs);
+
+	/**
+	 * Disable MSI or MSI-X, and go back to the legacy interrupt
+	 */
+	void DisableMSI(PCIDev* dev);
+
+    public:
 	/**
 	 * Finds PCI device by vendor and device IDs
+	 * Pass the last device found in 'prev' to find the next one
 	 *
 	 * @returns PCIDev struct containing the device info, or NULL
 	 *          if it couldn't be found
 	 */
-	PCIDev* FindPCIByVendor(uint16_t vendor, uint16_t device);
+	PCIDev* FindPCIByVendor(uint16_t vendor, uint16_t device,
+				PCIDev* prev = NULL);
 
 	/**
 	 * Finds PCI devices by classcode and subclass
-	 * 'list_count' is the size of the array returned
+	 * Pass the last device found in 'prev' to find the next one
 	 *
-	 * @returns a pointer to an array containing the devices,
-	 *          or NULL if it couldn't find none.
+	 * @returns PCIDev struct containing the device info, or NULL
+	 *          if it couldn't find none.
 	 */
 	PCIDev* FindPCIByClass(uint16_t classcode, uint16_t subclass,
-			       unsigned& list_count);
-	
-    public:
+			       PCIDev* prev = NULL);
+
+	/**
+	 * Iterate through all devices
+	 * Pass NULL to get the first one
+	 */
+	PCIDev* GetNextDevice(PCIDev* prev) {
+	    return (prev) ? prev->next : _devs;
+	}
+
+	unsigned GetDeviceCount() { return pcidev_count; }
+
+	/**
+	 * Register a driver
+	 * Its probe function is called for each device that matches its
+	 * ID table and has no driver yet, now and after the bus
+	 * enumeration.
+	 */
+	void RegisterDriver(PCIDriver* drv);
+
 	PCIBus()
 	    : Device("pcibus", "PCI bus device")
 	    {}
 
+	/* Typed access to the configuration space of 'dev' */
+	uint8_t ReadConfig8(PCIDev* dev, unsigned off) {
+	    return this->ReadPCIRegister<8>(dev, off);
+	}
+	uint16_t ReadConfig16(PCIDev* dev, unsigned off) {
+	    return this->ReadPCIRegister<16>(dev, off);
+	}
+	uint32_t ReadConfig32(PCIDev* dev, unsigned off) {
+	    return this->ReadPCIRegister<32>(dev, off);
+	}
+	void WriteConfig8(PCIDev* dev, unsigned off, uint8_t val) {
+	    this->WritePCIRegister<8>(dev, off, val);
+	}
+	void WriteConfig16(PCIDev* dev, unsigned off, uint16_t val) {
+	    this->WritePCIRegister<16>(dev, off, val);
+	}
+	void WriteConfig32(PCIDev* dev, unsigned off, uint32_t val) {
+	    this->WritePCIRegister<32>(dev, off, val);
+	}
+
+	/**
+	 * Set the 'bits' of the command register of 'dev'
+	 * If 'enable' is false, clear them.
+	 */
+	void SetCommand(PCIDev* dev, uint16_t bits, bool enable = true);
+
+	/**
+	 * Read the BAR 'idx' of 'dev', and find its size
+	 * The size is found by writing all ones and reading back which bits
+	 * stuck. The device decoding is disabled while we do this.
+	 *
+	 * @return false if the BAR doesn't exist or isn't implemented
+	 */
+	bool GetBAR(PCIDev* dev, unsigned idx, PCIBar& bar);
+
+	/**
+	 * Map the memory BAR 'idx' of 'dev' in the kernel address space
+	 * Prefetchable BARs are mapped write-combining, the others uncached.
+	 * 'maxlen' limits how much we map, 0 means the whole BAR.
+	 *
+	 * @return the virtual address of the BAR, or 0 on error
+	 */
+	virt_t MapBAR(PCIDev* dev, unsigned idx, size_t maxlen = 0);
+
 
 	/** 
 	 *  Initializate and discover the devices connected there
@@ -29,6 +29,47 @@ namespace annos {
 	 */
 	bool DetectPCIByClass(uint16_t classcode, uint16_t subclass);
 
+	/**
+	 * Give this device its own interrupt vectors, through MSI
+	 * 'count' is how many we want, and it's updated with how many we
+	 * got. Register a handler for each IRQ after this.
+	 *
+	 * @return the first IRQ number, or -1 if MSI can't be used
+	 */
+	int EnableMSI(unsigned& count) {
+	    return _bus->EnableMSI(this->pci, count);
+	}
+
+	/**
+	 * Give this device one vector per queue, through MSI-X
+	 *
+	 * @return the number of IRQs written in 'irqs', or -1 if MSI-X can't
+	 *         be used
+	 */
+	int EnableMSIX(unsigned count, int* irqs) {
+	    return _bus->EnableMSIX(this->pci, count, irqs);
+	}
+
+	/**
+	 * Let the device do DMA
+	 */
+	void EnableBusMaster() {
+	    _bus->SetCommand(this->pci, 1 << 2);
+	}
+
+	bool GetBAR(unsigned idx, PCIBar& bar) {
+	    return _bus->GetBAR(this->pci, idx, bar);
+	}
+
+	/**
+	 * Map the memory BAR 'idx', with the right caching mode
+	 *
+	 * @return the virtual address, or 0 on error
+	 */
+	virt_t MapBAR(unsigned idx, size_t maxlen = 0) {
+	    return _bus->MapBAR(this->pci, idx, maxlen);
+	}
+
 
     public:
 	PCIDevice(PCIBus* bus, const char* tag, const char* name)
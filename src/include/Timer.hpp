@@ -3,23 +3,205 @@
 /**
  * Kernel timer
  *
- * The timer is supposed to tick each milisecond, for each PIT on each 
+ * The timer is supposed to tick each milisecond, for each PIT on each
  * architecture
  * It gives the kernel the notion of time.
  *
+ * It also keeps the scheduled timer events, in a hierarchical timer wheel.
+ * The wheel has TIMER_WHEEL_LEVELS levels with TIMER_WHEEL_SIZE slots
+ * each. The first level has one slot per tick, and each slot of a level
+ * covers a full turn of the level before it. When a level turns, the next
+ * slot of the level above is cascaded down.
+ * This makes scheduling and cancelling O(1), and the expiry of all events
+ * of a tick is done at once.
+ *
+ * In tickless mode, the timer device isn't periodic anymore. We program it
+ * to interrupt only at the next event deadline, and the tick count comes
+ * from the clock source.
+ *
  * Copyright (C) 2018 Arthur M
  */
 
 #include <stdint.h>
+#include <stddef.h>
 
 namespace annos {
 
+    /**
+     * Function pointer to a clock source
+     * Returns the nanoseconds elapsed since some fixed point in the past.
+     * It must be monotonic.
+     */
+    typedef uint64_t (*fnClockSource)();
+
+    /**
+     * Interface for devices that can generate the timer interrupt
+     */
+    class IClockEventDevice {
+    public:
+	/**
+	 * Interrupt 'hz' times per second
+	 */
+	virtual void SetPeriodic(unsigned hz) = 0;
+
+	/**
+	 * Interrupt only once, 'ns' nanoseconds from now
+	 * Intervals longer than GetMaxOneShot() are clamped to it.
+	 */
+	virtual void SetOneShot(uint64_t ns) = 0;
+
+	/**
+	 * Longest interval SetOneShot() supports, in nanoseconds
+	 */
+	virtual uint64_t GetMaxOneShot() = 0;
+    };
+
+    struct TimerEvent;
+
+    /**
+     * Function pointer to a timer callback
+     * It's called from the timer interrupt, so keep it short.
+     */
+    typedef void (*fnTimerCallback)(TimerEvent* ev, void* data);
+
+    /**
+     * A scheduled timer event
+     *
+     * The memory is owned by whoever schedules it. The timer only links it
+     * into the wheel, so it must be kept alive until it expires or is
+     * cancelled.
+     */
+    struct TimerEvent {
+	// Expiry time, in ticks
+	uint64_t deadline = 0;
+
+	// Period, in ticks, for periodic events. 0 for one-shot ones
+	uint64_t period = 0;
+
+	fnTimerCallback callback = NULL;
+	void* data = NULL;
+
+	// Wheel slot list links
+	TimerEvent* next = NULL;
+	TimerEvent** pprev = NULL;
+    };
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SIZE (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
     class Timer {
     private:
 	static uint64_t v;
+	static fnClockSource _clock;
+	static IClockEventDevice* _dev;
+
+	// Tickless mode: tick 0 in the clock source time, and the tick the
+	// device is programmed to interrupt
+	static bool _tickless;
+	static uint64_t _ns_offset;
+	static uint64_t _programmed_tick;
+
+	// The tick the wheel will process next
+	static uint64_t _wheel_base;
+	static TimerEvent* _wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+
+	// One bit for each non-empty slot, for each level
+	static uint64_t _wheel_pending[TIMER_WHEEL_LEVELS];
+
+	/**
+	 * Put the event in the slot its deadline belongs to
+	 * Interrupts must be disabled
+	 */
+	static void Enqueue(TimerEvent* ev);
+
+	/**
+	 * Take the event out of its slot
+	 * Interrupts must be disabled
+	 */
+	static void Dequeue(TimerEvent* ev);
+
+	/**
+	 * Redistribute the events of slot 'idx' of level 'level' into the
+	 * levels below
+	 *
+	 * @return the slot index, so the caller knows if it needs to cascade
+	 *         the level above too.
+	 */
+	static unsigned Cascade(unsigned level, unsigned idx);
+
+	/**
+	 * Run all events due until the current tick
+	 */
+	static void RunEvents();
+
+	/**
+	 * Find the tick of the earliest event in the wheel
+	 *
+	 * It might be earlier than the real event (we might return the tick
+	 * a level above cascades), but never later.
+	 * @return the tick, or UINT64_MAX if there's no event
+	 */
+	static uint64_t NextEventTick();
+
+	/**
+	 * Program the timer device to interrupt at the next event
+	 */
+	static void ProgramNext();
+
     public:
-	static void Init();
+	/**
+	 * Start the timer, ticking from the interrupts of 'dev'
+	 */
+	static void Init(IClockEventDevice* dev);
 	static void Tick();
 	static uint64_t Get();
-    };    
+
+	/**
+	 * Enable or disable the tickless mode
+	 * Tickless needs a clock source.
+	 *
+	 * @return true if the mode was changed, false if not
+	 */
+	static bool SetTickless(bool enable);
+	static bool IsTickless() { return _tickless; }
+
+	/**
+	 * Set a high resolution clock source for GetNs()
+	 */
+	static void SetClockSource(fnClockSource c);
+
+	/**
+	 * Get a monotonic time, in nanoseconds
+	 *
+	 * Without a clock source, it will have only the resolution of the
+	 * timer tick.
+	 */
+	static uint64_t GetNs();
+
+	/**
+	 * Schedule 'ev' to call 'cb' at tick 'deadline'
+	 * If the event is already scheduled, it is moved to the new deadline.
+	 * A deadline in the past will expire on the next tick.
+	 */
+	static void Schedule(TimerEvent* ev, uint64_t deadline,
+			     fnTimerCallback cb, void* data = NULL);
+
+	/**
+	 * Schedule 'ev' to call 'cb' every 'period' ticks, starting 'period'
+	 * ticks from now
+	 */
+	static void SchedulePeriodic(TimerEvent* ev, uint64_t period,
+				     fnTimerCallback cb, void* data = NULL);
+
+	/**
+	 * Cancel a scheduled event
+	 * Cancelling an event that isn't scheduled does nothing.
+	 *
+	 * @return true if the event was pending, false if not
+	 */
+	static bool Cancel(TimerEvent* ev);
+
+	static bool IsPending(TimerEvent* ev) { return (ev->pprev != NULL); }
+    };
 }
@@ -3,25 +3,74 @@
 /* 
    Console implementation on vga text-mode screens
 
+   We write the text to a shadow buffer in RAM, a ring of rows, so a
+   scroll only moves the ring top. The rows we changed are copied to the
+   video memory only at the end of each write, and the scroll is done by
+   moving the CRTC start address through the 32 kB of text memory.
+   The cursor is also only updated there.
+
+   The escape sequences are read by the shared ANSI parser, that keeps
+   its state between writes.
+
    Copyright (C) 2018 Arthur M
  */
 
 #include <Console.hpp>
+#include <AnsiParser.hpp>
+#include <stdint.h>
+#include <stddef.h>
 
 namespace annos {
-    class VGAConsole : public Console {
+    class VGAConsole : public Console, public IAnsiTarget {
     private:
 	// The location of the VGA framebuffer
 	static uint16_t* _framebuffer;
 	uint8_t _xPos = 0, _yPos = 0;
 
-	const unsigned _width = 80;
-	const unsigned _height = 25;
+	static const unsigned _width = 80;
+	static const unsigned _height = 25;
+
+	// Shadow ring row shown in the first screen row
+	unsigned _top = 0;
+
+	// Screen rows changed since the last flush, one bit each
+	uint32_t _dirty = 0;
+
+	// Video memory row the CRTC start address points to
+	unsigned _vram_row = 0;
+
+	// What the hardware has now, so we only touch it on changes
+	unsigned _hw_start = 0, _hw_cursor = ~0u;
+
+	AnsiParser _ansi;
 
-	void WriteChar(const char c, BaseColors color,
-		       BaseColors bgcolor = BaseColors::Black);
+	// The color of the current write, used for the default foreground
+	BaseColors _write_color = BaseColors::LightGrey;
+
+	// The attribute byte we write the characters with
+	uint8_t _color = 0x07;
+
+	/**
+	 * Get the attribute byte from the ANSI attributes and the
+	 * write color
+	 */
+	void UpdateColor(const AnsiAttr& attr);
+
+	// Clear 'count' characters from column 'x' of row 'y'
+	void EraseChars(unsigned x, unsigned y, unsigned count);
+
+	// Address of a screen row in the shadow buffer
+	uint16_t* ShadowRow(unsigned y);
+
+	void WriteChar(const char c);
 
 	void Scroll();
+
+	/**
+	 * Copy the dirty rows to the video memory, and update the start
+	 * address and the cursor
+	 */
+	void Flush();
 	
     public:
 	/* Write function for VGA-compatible output */
@@ -33,5 +82,12 @@ namespace annos {
 			      uint8_t r, uint8_t g, uint8_t b);
 
 	virtual void Clear();
+
+	virtual void AnsiText(const char* str, size_t len);
+	virtual void AnsiAttributes(const AnsiAttr& attr);
+	virtual void AnsiGetCursor(unsigned& x, unsigned& y);
+	virtual void AnsiSetCursor(unsigned x, unsigned y);
+	virtual void AnsiEraseLine(AnsiErase mode);
+	virtual void AnsiEraseScreen(AnsiErase mode);
     };
 };
@@ -0,0 +1,87 @@
+#pragma once
+
+/**
+ * Deferred work queue
+ *
+ * Interrupt handlers must be short, but some of the things they trigger
+ * (printing, logging, processing the data a device gave us) are not.
+ * They can queue a work item here instead, and it will run later, outside
+ * the interrupt, with interrupts enabled.
+ *
+ * For now, the work runs in the idle loop.
+ *
+ * Copyright (C) 2018 Arthur M
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace annos {
+
+    struct WorkItem;
+
+    /**
+     * Function pointer to a work handler
+     */
+    typedef void (*fnWorkHandler)(WorkItem* w, void* data);
+
+    /**
+     * A deferred work item
+     *
+     * The memory is owned by whoever queues it, and it must be kept alive
+     * until its handler runs.
+     * An item can be queued only once at a time. Queueing it again before
+     * it runs does nothing, so many interrupts can share the same run.
+     */
+    struct WorkItem {
+	fnWorkHandler handler;
+	void* data;
+
+	WorkItem* next = NULL;
+	volatile bool queued = false;
+
+	constexpr WorkItem()
+	    : handler(NULL), data(NULL)
+	    {}
+
+	constexpr WorkItem(fnWorkHandler h, void* d = NULL)
+	    : handler(h), data(d)
+	    {}
+    };
+
+    class WorkQueue {
+    private:
+	static WorkItem* _head;
+	static WorkItem* _tail;
+
+    public:
+	/**
+	 * Queue a work item to run later
+	 * Safe to call from interrupt handlers.
+	 *
+	 * @return true if queued, false if it was already in the queue
+	 */
+	static bool Queue(WorkItem* w);
+
+	/**
+	 * Run all the queued work, in the order it was queued.
+	 * Work queued while we run will also run.
+	 */
+	static void Run();
+
+	/**
+	 * Run only the first queued work item
+	 *
+	 * @return true if something ran, false if the queue was empty
+	 */
+	static bool RunOne();
+
+	static bool HasPending() { return (_head != NULL); }
+
+	/**
+	 * Halt the processor until the next interrupt, unless there's work
+	 * to do
+	 */
+	static void WaitForWork();
+    };
+}
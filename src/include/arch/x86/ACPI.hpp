@@ -0,0 +1,160 @@
+#pragma once
+
+/*
+  ACPI table discovery
+
+  We don't have an AML interpreter. This only finds the static tables the
+  firmware leaves in memory, like the MADT (the interrupt controllers and
+  processors) and the MCFG (the PCI Express configuration space)
+
+  Copyright (C) 2018 Arthur M
+
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace annos::x86 {
+
+    /**
+     * Root System Description Pointer
+     * The entry point of the ACPI tables, found in the BIOS area
+     */
+    struct ACPI_RSDP {
+	char signature[8]; // "RSD PTR "
+	uint8_t checksum;  // Checksum of the first 20 bytes
+	char oem_id[6];
+	uint8_t revision;  // 0 for ACPI 1.0, 2 for ACPI 2.0+
+	uint32_t rsdt_addr;
+
+	// ACPI 2.0+ fields
+	uint32_t length;
+	uint64_t xsdt_addr;
+	uint8_t ext_checksum;
+	uint8_t rsvd[3];
+    } __attribute__((packed));
+
+    /**
+     * Header common to all system description tables
+     */
+    struct ACPI_SDTHeader {
+	char signature[4];
+	uint32_t length; // Length of the table, with this header
+	uint8_t revision;
+	uint8_t checksum; // All bytes of the table must add to 0
+	char oem_id[6];
+	char oem_table_id[8];
+	uint32_t oem_revision;
+	uint32_t creator_id;
+	uint32_t creator_revision;
+    } __attribute__((packed));
+
+    /**
+     * Multiple APIC Description Table, signature "APIC"
+     * It's followed by a list of variable-length entries, each one starting
+     * with an ACPI_MADTEntry
+     */
+    struct ACPI_MADT {
+	ACPI_SDTHeader hdr;
+	uint32_t lapic_addr; // Physical address of the local APIC
+	uint32_t flags;      // Bit 0 means we also have the two 8259s
+    } __attribute__((packed));
+
+    enum ACPI_MADTEntryType {
+	MADTLocalAPIC = 0,
+	MADTIOAPIC = 1,
+	MADTInterruptOverride = 2,
+	MADTLocalAPICNMI = 4,
+	MADTLocalAPICOverride = 5,
+    };
+
+    struct ACPI_MADTEntry {
+	uint8_t type;
+	uint8_t length;
+    } __attribute__((packed));
+
+    /* One for each processor */
+    struct ACPI_MADTLocalAPIC {
+	ACPI_MADTEntry hdr;
+	uint8_t processor_id;
+	uint8_t apic_id;
+	uint32_t flags; // Bit 0: enabled, bit 1: can be enabled
+    } __attribute__((packed));
+
+    struct ACPI_MADTIOAPIC {
+	ACPI_MADTEntry hdr;
+	uint8_t ioapic_id;
+	uint8_t rsvd;
+	uint32_t ioapic_addr;
+	uint32_t gsi_base; // First global system interrupt of this IOAPIC
+    } __attribute__((packed));
+
+    /* An ISA IRQ that isn't connected to the IOAPIC pin of the same number
+       (like the PIT, usually at pin 2) or that isn't edge-triggered,
+       active-high */
+    struct ACPI_MADTInterruptOverride {
+	ACPI_MADTEntry hdr;
+	uint8_t bus;    // Always 0, ISA
+	uint8_t source; // The ISA IRQ
+	uint32_t gsi;   // The global system interrupt it's connected to
+	uint16_t flags; // Bits 0-1: polarity, bits 2-3: trigger mode
+    } __attribute__((packed));
+
+    /**
+     * PCI Express memory mapped configuration table, signature "MCFG"
+     * It's followed by a list of ACPI_MCFGEntry
+     */
+    struct ACPI_MCFG {
+	ACPI_SDTHeader hdr;
+	uint64_t rsvd;
+    } __attribute__((packed));
+
+    /* One for each PCI segment group */
+    struct ACPI_MCFGEntry {
+	uint64_t base_addr; // Configuration space of bus 0
+	uint16_t segment;
+	uint8_t start_bus, end_bus;
+	uint32_t rsvd;
+    } __attribute__((packed));
+
+    class ACPI {
+    private:
+	static ACPI_RSDP* _rsdp;
+	static ACPI_SDTHeader* _rsdt;
+
+	/**
+	 * Look for the RSDP in the 'len' bytes starting at physical
+	 * address 'start'
+	 */
+	static ACPI_RSDP* SearchRSDP(uintptr_t start, size_t len);
+
+	/**
+	 * Map a system description table, with its full length
+	 */
+	static ACPI_SDTHeader* MapTable(uintptr_t phys);
+
+    public:
+	/**
+	 * Find the ACPI tables
+	 * Needs the VMM, because the tables are usually at the end of the RAM
+	 *
+	 * @return true if found, false if not
+	 */
+	static bool Init();
+
+	static bool IsPresent() { return (_rsdt != NULL); }
+
+	/**
+	 * Find the table with signature 'sig'
+	 * 'idx' is used to get the next table with the same signature
+	 *
+	 * @return a pointer to the mapped table, or NULL if not found
+	 */
+	static ACPI_SDTHeader* FindTable(const char* sig, unsigned idx = 0);
+
+	/**
+	 * Check if the 'len' bytes of 'ptr' add to 0
+	 */
+	static bool CheckSum(const void* ptr, size_t len);
+    };
+}
@@ -0,0 +1,180 @@
+#pragma once
+
+/**
+ * Driver for the Advanced Programmable Interrupt Controller
+ *
+ * Each processor has a local APIC, that receives the interrupts and
+ * gets the EOIs. The I/O APICs receive the interrupts from the devices
+ * and route them to the local APICs.
+ *
+ * We find both through the ACPI MADT table.
+ *
+ * Copyright (C) 2018 Arthur M
+ */
+
+#include <Device.hpp>
+#include <arch/x86/IRQController.hpp>
+#include <stdint.h>
+#include <stddef.h>
+
+namespace annos::x86 {
+
+#define MAX_IOAPICS 4
+#define MAX_CPUS 16
+
+    /**
+     * Local APIC register offsets
+     */
+    enum LAPICRegister {
+	LAPIC_ID = 0x20,
+	LAPIC_Version = 0x30,
+	LAPIC_TPR = 0x80,  // Task priority
+	LAPIC_EOI = 0xb0,
+	LAPIC_SVR = 0xf0,  // Spurious interrupt vector
+	LAPIC_ESR = 0x280, // Error status
+	LAPIC_ICRLow = 0x300,
+	LAPIC_ICRHigh = 0x310,
+	LAPIC_LVTTimer = 0x320,
+	LAPIC_LVTLINT0 = 0x350,
+	LAPIC_LVTLINT1 = 0x360,
+	LAPIC_LVTError = 0x370,
+    };
+
+    struct IOAPICInfo {
+	volatile uint32_t* regs;
+	unsigned gsi_base;
+	unsigned count; // Number of redirection entries
+	uint8_t id;
+    };
+
+    /**
+     * Where each ISA IRQ is routed in the I/O APICs
+     */
+    struct ISARoute {
+	unsigned gsi;
+	uint32_t flags; // Polarity and trigger mode, in redirection entry format
+	bool valid;
+    };
+
+    class APIC : public Device, public IIRQController {
+    private:
+	volatile uint32_t* _lapic = NULL;
+	uintptr_t _lapic_phys = 0;
+
+	IOAPICInfo _ioapics[MAX_IOAPICS];
+	unsigned _ioapic_count = 0;
+
+	ISARoute _isa[16];
+
+	// APIC ID of the processor we boot on. All IRQs go to it
+	uint8_t _bsp_id = 0;
+
+	// APIC IDs of the enabled processors, the boot one included
+	uint8_t _cpu_ids[MAX_CPUS];
+	unsigned _cpu_count = 0;
+
+	/**
+	 * Send an inter-processor interrupt, and wait for the local APIC
+	 * to deliver it
+	 *
+	 * @return false if it wasn't delivered
+	 */
+	bool SendIPI(uint8_t apic_id, uint32_t icr);
+
+	/**
+	 * Read the MADT, and fill the I/O APIC list and the ISA IRQ
+	 * routes
+	 */
+	void ParseMADT();
+
+	/**
+	 * Find the I/O APIC that handles the global system interrupt 'gsi'
+	 */
+	IOAPICInfo* FindIOAPIC(unsigned gsi);
+
+	uint32_t ReadIOAPIC(IOAPICInfo* io, unsigned reg);
+	void WriteIOAPIC(IOAPICInfo* io, unsigned reg, uint32_t val);
+
+	/**
+	 * Set the redirection entry of 'gsi'
+	 */
+	void SetRedirection(unsigned gsi, uint8_t vector, uint32_t flags,
+			    bool masked);
+
+    public:
+	APIC()
+	    : Device("apic", "Local APIC and I/O APIC")
+	    {}
+
+	/**
+	 * Check if the processor has a local APIC, and if the firmware
+	 * tells us where the I/O APICs are
+	 */
+	virtual bool Detect();
+
+	/**
+	 * Map and enable the local APIC, and route the ISA IRQs through
+	 * the I/O APICs, all of them masked
+	 */
+	virtual void Initialize();
+
+	virtual void Reset();
+
+	/**
+	 * Enable and set up the local APIC of the current processor
+	 * Each processor must call it, since each has its own.
+	 */
+	void InitializeLocal();
+
+	uint32_t ReadLAPIC(unsigned reg) { return _lapic[reg/4]; }
+	void WriteLAPIC(unsigned reg, uint32_t val) { _lapic[reg/4] = val; }
+
+	/**
+	 * Get the APIC ID of the current processor
+	 */
+	uint8_t GetID() { return this->ReadLAPIC(LAPIC_ID) >> 24; }
+
+	uint8_t GetBootID() const { return _bsp_id; }
+
+	/**
+	 * The processors the MADT lists as enabled
+	 */
+	unsigned GetProcessorCount() const { return _cpu_count; }
+	uint8_t GetProcessorID(unsigned i) const { return _cpu_ids[i]; }
+
+	/**
+	 * Send an INIT to the processor 'apic_id', resetting it to the
+	 * wait-for-SIPI state
+	 */
+	bool SendInit(uint8_t apic_id);
+
+	/**
+	 * Send a startup IPI to the processor 'apic_id'
+	 * It starts in real mode, at the page-aligned address 'addr', below
+	 * 1 MB
+	 */
+	bool SendStartup(uint8_t apic_id, uintptr_t addr);
+
+	virtual void SetIRQMask(unsigned irqno, bool status);
+	virtual bool GetIRQMask(unsigned irqno);
+
+	/**
+	 * Send an End of Interrupt signal
+	 * It's a single write to the local APIC
+	 */
+	virtual bool SendEOI(unsigned irqno) {
+	    this->WriteLAPIC(LAPIC_EOI, 0);
+	    return true;
+	}
+
+	virtual void MaskAll();
+
+	virtual unsigned GetIRQCount() { return 16; }
+
+	/**
+	 * MSIs are sent straight to our local APIC, with the IRQ vector
+	 */
+	virtual bool GetMSIMessage(unsigned irqno, uint32_t& addr,
+				   uint32_t& data);
+    };
+}
@@ -64,5 +64,10 @@ namespace annos::x86 {
 	/** Register the IDT into the processor
 	 */
 	void Register();
+
+	/** Load the registered IDT into the current processor
+	 * Used by the other processors, that share it
+	 */
+	void Load();
     };
 }
@@ -22,5 +22,21 @@ namespace annos::x86 {
     uint32_t in32(uint16_t port);
     void out32(uint16_t port, uint32_t);
 
-    void iodelay(unsigned n);
+    /* Busy-wait delays
+       They use the calibrated TSC. Before calibration (or without a TSC),
+       they fall back to writes to the POST port 0x80, that take around
+       one microsecond each on the ISA bus.
+    */
+    void udelay(unsigned us);
+    void ndelay(unsigned ns);
+
+#ifdef ANNOS_IO_STATS
+    /* Count of port accesses done so far.
+       Only built with 'make IO_STATS=1', it's used to measure how many
+       port accesses each interrupt costs */
+    extern volatile uint32_t io_port_accesses;
+#define IO_STATS_COUNT() (annos::x86::io_port_accesses++)
+#else
+#define IO_STATS_COUNT()
+#endif
 }
@@ -0,0 +1,63 @@
+#pragma once
+
+/**
+ * Interface for the x86 interrupt controllers
+ *
+ * The IRQ handler talks to the interrupt controller only through this, so
+ * it doesn't care if we're using the old 8259s or the APICs
+ *
+ * Copyright (C) 2018 Arthur M
+ */
+
+#include <stdint.h>
+
+namespace annos::x86 {
+
+    class IIRQController {
+    public:
+	/**
+	 * Enable/disable IRQ mask for a certain IRQ
+	 * 'status' true means masked.
+	 */
+	virtual void SetIRQMask(unsigned irqno, bool status) = 0;
+
+	/**
+	 * Get IRQ mask status
+	 *
+	 * @returns true if unmasked, false if masked
+	 */
+	virtual bool GetIRQMask(unsigned irqno) = 0;
+
+	/**
+	 * Send an End of Interrupt signal
+	 *
+	 * @return false if the IRQ was spurious
+	 */
+	virtual bool SendEOI(unsigned irqno) = 0;
+
+	/**
+	 * Mask all IRQs
+	 * Used when another controller takes over.
+	 */
+	virtual void MaskAll() = 0;
+
+	/**
+	 * Number of IRQ lines this controller can deliver
+	 */
+	virtual unsigned GetIRQCount() = 0;
+
+	/**
+	 * Get the message a PCI device must write to raise 'irqno' with
+	 * MSI or MSI-X
+	 *
+	 * @return false if this controller can't receive MSIs
+	 */
+	virtual bool GetMSIMessage(unsigned irqno, uint32_t& addr,
+				   uint32_t& data) {
+	    (void)irqno;
+	    (void)addr;
+	    (void)data;
+	    return false;
+	}
+    };
+}
@@ -1,7 +1,7 @@
 #pragma once
 
 #include <arch/x86/IDT.hpp>
-#include <arch/x86/i8259.hpp>
+#include <arch/x86/IRQController.hpp>
 
 /**
  * The IRQ handler code for the x86 architecture
@@ -9,14 +9,18 @@
  * IRQ means Interrupt Request, something that the device 
  * issues when it needs processor attention
  *
- * The interrupt vectors 32 to 48 are reserved for IRQs
+ * The interrupt vectors 32 to 254 are reserved for IRQs. The first 16
+ * are the ISA IRQs, the others are allocated for MSI
  * This is what the drivers will use, so watch out...
  */
 
 namespace annos::x86 {
 
-    // Max of handlers per irq
-#define MAX_IRQ_HANDLERS 16
+    // The vector of IRQ 0
+#define IRQ_VECTOR_BASE 0x20
+
+    // Number of IRQs. The last vector, 0xff, is the APIC spurious one
+#define MAX_IRQS (0xff - IRQ_VECTOR_BASE)
     
     /**
      * Represents register layout within IRQs
@@ -29,14 +33,49 @@ namespace annos::x86 {
     };
 
     
+    /**
+     * Per-IRQ statistics
+     * The cycles are TSC cycles spent in the handlers and in the EOI
+     */
+    struct IRQStats {
+	uint64_t count;
+	uint64_t cycles;
+	uint32_t max_cycles;
+	uint32_t spurious;
+#ifdef ANNOS_IO_STATS
+	uint32_t io_ports; // Port accesses done, handlers and EOI included
+#endif
+    };
+
+    /**
+     * What the top half of an IRQ handler did
+     */
+    enum IRQResult {
+	IRQNotMine,    // The device didn't interrupt, the IRQ is shared
+	IRQHandled,    // Everything is done
+	IRQWakeThread, // Acknowledged, but OnIRQThread() must run later
+    };
+
     /* Interface to be implemented for all devices that 
        handler IRQs */
     class IIRQHandlerDevice {
     public:
 	/**
 	 * Event function to be called on each IRQ
+	 *
+	 * This is the top half. It runs with interrupts disabled, so it
+	 * must only acknowledge the device and save what can't wait.
+	 */
+	virtual IRQResult OnIRQ(IRQRegs* regs) = 0;
+
+	/**
+	 * The bottom half, for the heavy work
+	 *
+	 * It runs from the work queue, with interrupts enabled, some time
+	 * after OnIRQ() returns IRQWakeThread. Many IRQs might be handled
+	 * by a single call.
 	 */
-	virtual void OnIRQ(IRQRegs* regs) = 0;
+	virtual void OnIRQThread(unsigned irqno) { (void)irqno; }
     };
 
 
@@ -52,18 +91,64 @@ namespace annos::x86 {
 	/**
 	 * Set the IDT handler for each one of the IRQs
 	 */
-	static void Init(IDT* idt, i8259* irqcontrol);
+	static void Init(IDT* idt, IIRQController* irqcontrol);
+
+	/**
+	 * Switch to another interrupt controller
+	 *
+	 * The IRQs that have handlers are unmasked in the new controller,
+	 * and the old one is fully masked.
+	 */
+	static void SetController(IIRQController* irqcontrol);
+
+	static IIRQController* GetController();
 
 	/*
 	 * Sets a new IRQ handler
-	 * @returns a index in the list of handlers
+	 * It's added to the end of the list, and can be called right after
+	 * this returns.
+	 *
+	 * @returns the position in the list of handlers, or -1 on error
 	 */
 	static int SetHandler(unsigned irqno, IIRQHandlerDevice*);
 
 	/*
 	 * Removes an IRQ handler
 	 */
-	static void RemoveHandler(unsigned irqno, int index);
+	static void RemoveHandler(unsigned irqno, IIRQHandlerDevice*);
+
+	/**
+	 * Reserve 'count' consecutive IRQs, for MSI
+	 * 'count' must be a power of 2, and the first IRQ will be aligned to
+	 * it, like multiple message MSI needs.
+	 *
+	 * @return the first IRQ, or -1 if there's no space
+	 */
+	static int AllocateIRQ(unsigned count = 1);
+
+	/**
+	 * Free IRQs reserved by AllocateIRQ()
+	 */
+	static void FreeIRQ(unsigned irqno, unsigned count = 1);
+
+	/**
+	 * Get the interrupt vector of an IRQ
+	 */
+	static unsigned GetVector(unsigned irqno) {
+	    return irqno + IRQ_VECTOR_BASE;
+	}
+
+	/**
+	 * Get a consistent copy of the statistics of IRQ 'irqno'
+	 *
+	 * @return false if the IRQ number is invalid
+	 */
+	static bool GetStats(unsigned irqno, IRQStats* stats);
+
+	/**
+	 * Log the statistics of each IRQ that was called at least once
+	 */
+	static void DumpStats();
     };
 
 }
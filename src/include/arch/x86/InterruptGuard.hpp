@@ -0,0 +1,34 @@
+#pragma once
+
+/**
+ * Interrupt guard for the x86
+ *
+ * Disables interrupts while the object lives, and restores the previous
+ * interrupt flag when it is destroyed. This makes it safe to nest them and
+ * to use them in code that can be called from interrupt handlers.
+ *
+ * Copyright (C) 2018 Arthur M
+ */
+
+#include <stdint.h>
+
+namespace annos::x86 {
+
+    class InterruptGuard {
+    private:
+	uint32_t _eflags;
+
+    public:
+	InterruptGuard() {
+	    asm volatile("pushf; pop %0; cli" : "=r"(_eflags) : : "memory");
+	}
+
+	~InterruptGuard() {
+	    if (_eflags & 0x200) // IF
+		asm volatile("sti" : : : "memory");
+	}
+
+	InterruptGuard(const InterruptGuard&) = delete;
+	InterruptGuard& operator=(const InterruptGuard&) = delete;
+    };
+}
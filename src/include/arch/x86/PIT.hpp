@@ -13,7 +13,8 @@
 
 namespace annos::x86 {
 
-    class PIT : public Device, public IIRQHandlerDevice {
+    class PIT : public Device, public IIRQHandlerDevice,
+		public IClockEventDevice {
     private:
 	// Changes the new timer clock to 'hz'
 	void SetTimer(uint16_t hz);
@@ -35,7 +36,24 @@ namespace annos::x86 {
 	 */
 	virtual void Reset();
 
-	virtual void OnIRQ(IRQRegs* regs);
+	virtual IRQResult OnIRQ(IRQRegs* regs);
+
+	/**
+	 * Program the channel 0 in rate generator mode, 'hz' times
+	 * per second
+	 */
+	virtual void SetPeriodic(unsigned hz);
+
+	/**
+	 * Program the channel 0 to interrupt once, 'ns' nanoseconds from now
+	 * It uses the mode 0, interrupt on terminal count.
+	 */
+	virtual void SetOneShot(uint64_t ns);
+
+	/**
+	 * The channel 0 counter has 16 bits, so around 55 ms
+	 */
+	virtual uint64_t GetMaxOneShot();
 	    
     };
 }
@@ -16,16 +16,29 @@
 
 namespace annos::x86 {
 
-    // Maximum bytes for the keyboard queue
+    // Maximum bytes for the keyboard queue. Must be a power of 2
     #define MAX_KBD_QUEUE 64
 
     class PS2 : public KeyboardDevice, public IIRQHandlerDevice {
     private:
+	/* Bytes received by the top half, waiting for the bottom half.
+	   The IRQ number goes in the high byte of each entry.
+	   The IRQ only writes 'write_cur', and the bottom half only
+	   writes 'read_cur', so no lock is needed */
 	volatile struct {
 	    unsigned read_cur = 0, write_cur = 0;
-	    char queue[MAX_KBD_QUEUE];
+	    uint16_t queue[MAX_KBD_QUEUE];
 	} kbd_queue;
 
+	// Bytes dropped because the queue was full
+	volatile unsigned kbd_dropped = 0;
+
+	/**
+	 * Put a received byte in the queue
+	 * Called by the top half only
+	 */
+	void QueueByte(unsigned irqno, uint8_t byte);
+
 	// Number of PS/2 channels in this machine
 	// Maximum is 2 (keyboard and mouse)
 	unsigned char max_channels = 1;
@@ -35,6 +48,22 @@ namespace annos::x86 {
 	const uint16_t STATUS_REG = 0x64;  // read status
 	const uint16_t COMMAND_REG = 0x64; // write commands
 
+	/**
+	 * Wait until the controller has a byte for us in the data port
+	 *
+	 * @return true if it arrived before 'timeout_us' microseconds,
+	 *         false if not
+	 */
+	bool WaitOutput(unsigned timeout_us);
+
+	/**
+	 * Wait until the controller can accept a byte from us
+	 *
+	 * @return true if it became ready before 'timeout_us' microseconds,
+	 *         false if not
+	 */
+	bool WaitInput(unsigned timeout_us);
+
 	/**
 	 * Send a command to the device currently selected
 	 * Return true on success, false on error
@@ -79,8 +108,12 @@ namespace annos::x86 {
 	virtual void Initialize();
 	virtual void Reset();
 
-	/* Called every IRQ */
-	virtual void OnIRQ(IRQRegs* regs);
+	/* Called every IRQ
+	   Only reads the data, so the controller can send more */
+	virtual IRQResult OnIRQ(IRQRegs* regs);
+
+	/* Process the bytes the IRQs queued */
+	virtual void OnIRQThread(unsigned irqno);
 	
     };
 }
@@ -0,0 +1,124 @@
+#pragma once
+
+/**
+ * Multiprocessor support
+ *
+ * We find the processors through the MADT, and start each application
+ * processor (AP) with the INIT-SIPI-SIPI sequence. They start in real mode
+ * at a trampoline in low memory, that brings them to protected mode and
+ * paging, and calls the kernel.
+ *
+ * Each processor has its own GDT, TSS and kernel stack. They share the
+ * IDT. For now the APs only enable their local APIC and wait in an idle
+ * loop; the interrupts still go to the boot processor (BSP).
+ *
+ * Copyright (C) 2018 Arthur M
+ */
+
+#include <arch/x86/APIC.hpp>
+#include <arch/x86/IDT.hpp>
+#include <stdint.h>
+#include <stddef.h>
+
+namespace annos::x86 {
+
+    // Physical address of the AP startup code. Must be page-aligned, below 1 MB
+#define SMP_TRAMPOLINE_ADDR 0x8000
+
+    // Kernel stack of each AP
+#define SMP_STACK_PAGES 4
+
+    // GDT selectors. The kernel ones are the same as in the boot GDT
+#define GDT_KERNEL_CODE 0x08
+#define GDT_KERNEL_DATA 0x10
+#define GDT_TSS 0x28
+#define GDT_ENTRIES 6
+
+    /**
+     * The task state segment
+     * We have no tasks; only the ring 0 stack is used, when an interrupt
+     * comes from user mode
+     */
+    struct TSS {
+	uint32_t prev;
+	uint32_t esp0, ss0;
+	uint32_t esp1, ss1;
+	uint32_t esp2, ss2;
+	uint32_t cr3, eip, eflags;
+	uint32_t eax, ecx, edx, ebx, esp, ebp, esi, edi;
+	uint32_t es, cs, ss, ds, fs, gs;
+	uint32_t ldt;
+	uint16_t trap;
+	uint16_t iomap_base;
+    } __attribute__((packed));
+
+    static_assert(sizeof(TSS) == 104, "the TSS layout is wrong");
+
+    /**
+     * What the trampoline reads, at smp_trampoline_data
+     */
+    struct SMPTrampolineData {
+	uint32_t cr3;
+	uint32_t stack;
+	uint32_t entry;
+	uint32_t cpu;
+    } __attribute__((packed));
+
+    /**
+     * Per-processor data
+     */
+    struct CPUInfo {
+	unsigned index;
+	uint8_t apic_id;
+
+	// Set by the processor itself, when it reaches the idle loop
+	volatile bool online;
+
+	uint64_t gdt[GDT_ENTRIES];
+	TSS tss;
+	uintptr_t stack_top;
+
+	// Times the processor woke up in the idle loop
+	volatile uint32_t wakeups;
+    };
+
+    extern "C" void smp_ap_entry(CPUInfo* cpu);
+
+    class SMP {
+    private:
+	static CPUInfo _cpus[MAX_CPUS];
+	static unsigned _cpu_count;
+	static APIC* _apic;
+	static IDT* _idt;
+
+	/**
+	 * Build the GDT and the TSS of 'cpu', and load them in the
+	 * current processor
+	 */
+	static void LoadGDT(CPUInfo* cpu);
+
+	/**
+	 * Start the AP 'cpu', and wait for it to reach the idle loop
+	 *
+	 * @return true if it started
+	 */
+	static bool StartCPU(CPUInfo* cpu);
+
+    public:
+	/**
+	 * Give the BSP its own GDT and TSS, and start all the other
+	 * processors the MADT lists
+	 *
+	 * @return the number of processors online, the BSP included
+	 */
+	static unsigned Init(APIC* apic, IDT* idt);
+
+	/**
+	 * The kernel entry of the APs, called by the trampoline
+	 */
+	static void APMain(CPUInfo* cpu);
+
+	static unsigned GetCPUCount() { return _cpu_count; }
+	static CPUInfo* GetCPU(unsigned i) { return &_cpus[i]; }
+    };
+}
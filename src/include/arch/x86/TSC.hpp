@@ -0,0 +1,77 @@
+#pragma once
+
+/**
+ * Time Stamp Counter clock source for the x86
+ *
+ * The TSC is a 64-bit counter incremented at a fixed rate by the processor.
+ * We do not know that rate, so we measure it against the PIT channel 2
+ * (the one wired to the PC speaker), that runs at a well known frequency.
+ *
+ * Copyright (C) 2018 Arthur M
+ */
+
+#include <stdint.h>
+
+namespace annos::x86 {
+
+    class TSC {
+    private:
+	// TSC frequency, in Hz. Zero if not calibrated
+	static uint64_t _hz;
+
+	// TSC cycles in one microsecond
+	static uint32_t _cycles_per_us;
+
+	/* Nanoseconds per TSC cycle, as a fixed point number with 24
+	   fractional bits. This avoids a division on each GetNs() */
+	static uint32_t _ns_mult;
+
+	// TSC value at calibration time, the zero of our monotonic clock
+	static uint64_t _base;
+
+	/**
+	 * Count how many TSC cycles a PIT channel 2 countdown of 'latch'
+	 * ticks took
+	 *
+	 * @return the cycle count, or 0 if the PIT didn't count
+	 */
+	static uint64_t MeasurePIT(uint16_t latch);
+
+    public:
+	/**
+	 * Check if the processor has a time stamp counter
+	 */
+	static bool Detect();
+
+	/**
+	 * Calibrate the TSC against the PIT channel 2
+	 *
+	 * It does not need interrupts, so it can run very early.
+	 * @return true if calibrated, false if there's no usable TSC
+	 */
+	static bool Calibrate();
+
+	static bool IsCalibrated() { return (_hz != 0); }
+
+	/* Read the raw counter */
+	static inline uint64_t Read() {
+	    uint32_t lo, hi;
+	    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	    return ((uint64_t)hi << 32) | lo;
+	}
+
+	static uint64_t GetFrequency() { return _hz; }
+	static uint32_t GetCyclesPerMicrosecond() { return _cycles_per_us; }
+
+	/**
+	 * Convert a cycle count to nanoseconds
+	 */
+	static uint64_t CyclesToNs(uint64_t cycles);
+
+	/**
+	 * Nanoseconds elapsed since calibration
+	 * Monotonic, suitable to be used as the kernel clock source
+	 */
+	static uint64_t GetNs();
+    };
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+/*
+  Driver for the 16550A UART, the PC serial port
+
+  Transmission is interrupt driven. Writers only copy the data to the
+  transmit ring, and each THRE (transmitter holding register empty)
+  interrupt refills the 16-byte FIFO from it, so we touch the port
+  once per 16 bytes instead of polling it for each one.
+  Received bytes go to the receive ring, until someone reads them.
+
+  While the IRQ isn't installed, or if interrupts are disabled (like in
+  a panic), writes wait for the FIFO instead.
+
+  Copyright (C) 2018 Arthur M
+*/
+
+#include <Device.hpp>
+#include <arch/x86/IRQHandler.hpp>
+#include <stdint.h>
+#include <stddef.h>
+
+namespace annos::x86 {
+
+    // Bytes the transmit FIFO of a 16550A holds
+#define UART_FIFO_SIZE 16
+
+    // The clock of the baud rate generator, divided by 16
+#define UART_BASE_BAUD 115200
+
+    class UART16550 : public Device, public IIRQHandlerDevice {
+    private:
+	uint16_t _port;
+	unsigned _baud;
+
+	// Is the IRQ handler installed and the UART interrupt enabled?
+	volatile bool _irq_enabled = false;
+
+	// Is the transmitter sending data from the ring?
+	volatile bool _tx_active = false;
+
+	/* The rings. The writers only move the write cursor, and the
+	   IRQ only moves the read cursor of the transmit ring (the
+	   opposite for the receive ring).
+	   The memory is given by the owner, because they are too big for
+	   the stack. The sizes are powers of 2 */
+	volatile unsigned _tx_read = 0, _tx_write = 0;
+	uint8_t* _tx_ring;
+	unsigned _tx_size;
+
+	volatile unsigned _rx_read = 0, _rx_write = 0;
+	uint8_t* _rx_ring;
+	unsigned _rx_size;
+
+	// Received bytes lost because the ring was full
+	volatile unsigned _rx_dropped = 0;
+
+	/**
+	 * Move up to a FIFO worth of bytes from the transmit ring to the
+	 * UART
+	 * The transmitter must be empty. Interrupts must be disabled.
+	 *
+	 * @return true if something was sent
+	 */
+	bool FillFIFO();
+
+	/**
+	 * Send everything in the transmit ring, waiting for the UART
+	 * Interrupts must be disabled.
+	 */
+	void DrainPolling();
+
+	/**
+	 * Start transmitting the ring, if the transmitter is idle
+	 * Interrupts must be disabled.
+	 */
+	void Kick();
+
+	/**
+	 * Read the received bytes to the receive ring
+	 */
+	void Receive();
+
+	void SetTHREInterrupt(bool enable);
+
+    public:
+	/**
+	 * Create the driver for the UART at 'port'
+	 * 'txring' and 'rxring' are the memory for the rings. Their sizes
+	 * must be powers of 2
+	 */
+	UART16550(uint16_t port, unsigned baud,
+		  uint8_t* txring, unsigned txsize,
+		  uint8_t* rxring, unsigned rxsize)
+	    : Device("16550", "16550A serial port"), _port(port), _baud(baud),
+	      _tx_ring(txring), _tx_size(txsize),
+	      _rx_ring(rxring), _rx_size(rxsize)
+	    {}
+
+	/**
+	 * Check if the UART exists, and if it has working FIFOs
+	 */
+	virtual bool Detect();
+
+	/**
+	 * Program the baud rate, 8N1 and the FIFOs
+	 * The UART interrupts stay disabled until EnableIRQ()
+	 */
+	virtual void Initialize();
+	virtual void Reset();
+
+	/**
+	 * Start using the interrupts
+	 * Install the IRQ handler before calling it.
+	 */
+	void EnableIRQ();
+
+	/**
+	 * Queue 'len' bytes to be sent
+	 * If the ring is full, we wait for some space
+	 */
+	void Write(const char* data, size_t len);
+
+	/**
+	 * Read up to 'len' received bytes
+	 *
+	 * @return the number of bytes read
+	 */
+	size_t Read(char* data, size_t len);
+
+	/**
+	 * Wait until everything in the transmit ring is sent
+	 */
+	void Flush();
+
+	unsigned GetBaudRate() const { return _baud; }
+
+	virtual IRQResult OnIRQ(IRQRegs* regs);
+    };
+}
@@ -33,7 +33,7 @@ namespace annos::x86 {
 
        TODO: Change the numbers when porting to other architectures
      */
-    enum VMMFlags : uint8_t {
+    enum VMMFlags : uint16_t {
 	ReadOnly = 0x1,     /* Page is read only */
 	ReadWrite = 0x3,    /* Page is readable and writable */
 	WriteThrough = 0x8, /* Write-through cache enabled. Good for DMA */
@@ -41,6 +41,10 @@ namespace annos::x86 {
 
 	NoExecute = 0x80, /* Non executable page. 
 			     Might be non-existant on some systems */
+
+	WriteCombining = 0x100, /* Writes are combined before going to the
+				   bus. Good for framebuffers.
+				   Needs PAT, or it will be NonCached */
     };
 
     #define VMM_PAGE_SIZE 4096
@@ -50,6 +54,20 @@ namespace annos::x86 {
 	static annos::PMM* _pmm;
 	static phys_t kernel_cr3_base;
 
+	// True if the processor has the page attribute table
+	static bool _has_pat;
+
+	/**
+	 * Program the page attribute table, so we can have write-combining
+	 * pages
+	 */
+	static void SetupPAT();
+
+	/**
+	 * Convert the VMMFlags to the page table entry bits
+	 */
+	static uint32_t ToPTEFlags(uint16_t flags);
+
 	/**
 	 * Map a directory entry index 'dirindex' in the current page
 	 * directory
@@ -78,7 +96,7 @@ namespace annos::x86 {
 	 * this function will return 2. Or return -1 if it couldn't map.
 	 */
 	static int MapPhysicalToVirtual(phys_t phys, size_t n, virt_t virt,
-					uint8_t flags = VMMFlags::ReadWrite);
+					uint16_t flags = VMMFlags::ReadWrite);
 
 	/**
 	 * Unmap 'n' bits starting from physical address 'virt'
@@ -89,12 +107,19 @@ namespace annos::x86 {
 	static void Init(annos::PMM* pmm, uintptr_t phys_cr3_base,
 			 virt_t kernel_start, virt_t kernel_end);
 
+	/**
+	 * Program the page attribute table of the current processor
+	 * Every processor must have the same one, so the other processors
+	 * call this when they start.
+	 */
+	static void LoadPAT();
+
 	/**
 	 * Allocate next avaliable 'n' pages from zone 'zone'.
 	 * Return the allocated virtual address from that zone
 	 */
 	static virt_t AllocateVirtual(size_t n = 1,
-				      uint8_t flags = VMMFlags::ReadWrite,
+				      uint16_t flags = VMMFlags::ReadWrite,
 				      VMMZone zone = VMMZone::ZKernel);
 
 	/**
@@ -112,7 +137,7 @@ namespace annos::x86 {
 	static virt_t AllocateVirtualPhysical(phys_t* rphys,
 					      PMMZoneType pzone,
 					      size_t n = 1,
-					      uint8_t flags = VMMFlags::ReadWrite,
+					      uint16_t flags = VMMFlags::ReadWrite,
 					      VMMZone vzone = VMMZone::ZKernel);
 
 	/**
@@ -126,12 +151,36 @@ namespace annos::x86 {
 	 */
 	static virt_t MapPhysicalAddress(phys_t phys,
 					 size_t n = 1,
-					 uint8_t flags = VMMFlags::ReadWrite,
+					 uint16_t flags = VMMFlags::ReadWrite,
 					 VMMZone vzone = VMMZone::ZKernel);
 
 
 	/**
-	 * Unmap 'n' pages starting from physical address 'phys' 
+	 * Map 'n' pages of device memory (or firmware tables) starting at
+	 * physical address 'phys' into the next available virtual pages
+	 *
+	 * Unlike MapPhysicalAddress(), the pages aren't reserved in the PMM,
+	 * because they usually aren't RAM, and they might be mapped more
+	 * than once.
+	 *
+	 * Return the mapped virtual address for that physical address
+	 */
+	static virt_t MapMMIO(phys_t phys, size_t n = 1,
+			      uint16_t flags = VMMFlags::ReadWrite | VMMFlags::NonCached,
+			      VMMZone vzone = VMMZone::ZKernel);
+
+	/**
+	 * Point the already mapped page 'virt' to the physical page 'phys'
+	 * and flush its TLB entry.
+	 * Cheaper than mapping again, and it doesn't spend virtual addresses,
+	 * so it's good for a window that moves over a big physical area.
+	 */
+	static void RemapPage(virt_t virt, phys_t phys,
+			      uint16_t flags = VMMFlags::ReadWrite | VMMFlags::NonCached);
+
+	/**
+	 * Unmap 'n' pages starting from virtual address 'virt', and flush
+	 * their TLB entries
 	 */
 	static void Unmap(virt_t virt, size_t n);
     };
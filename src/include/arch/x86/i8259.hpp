@@ -8,9 +8,10 @@
  */
 
 #include <Device.hpp>
+#include <arch/x86/IRQController.hpp>
 
 namespace annos::x86 {
-    class i8259 : public Device {
+    class i8259 : public Device, public IIRQController {
     private:
 	/**
 	 * Clear the mask for all IRQs.
@@ -36,19 +37,32 @@ namespace annos::x86 {
 	/**
 	 * Enable/disable IRQ mask for a certain IRQ
 	 */
-	void SetIRQMask(unsigned irqno, bool status);
+	virtual void SetIRQMask(unsigned irqno, bool status);
 
 	/**
 	 * Get IRQ mask status
 	 *
 	 * @returns true if unmasked, false if masked
 	 */
-	bool GetIRQMask(unsigned irqno);
+	virtual bool GetIRQMask(unsigned irqno);
 
 	/**
 	 * Send an End of Interrupt signal
+	 *
+	 * Only the last line of each controller (IRQ 7 and IRQ 15) can be
+	 * spurious, so only those pay for an ISR read.
+	 *
+	 * @return false if the IRQ was spurious
+	 */
+	virtual bool SendEOI(unsigned irqno);
+
+	/**
+	 * Mask all IRQs, including the cascade
+	 * Used when the APIC takes over
 	 */
-	void SendEOI(unsigned irqno);
+	virtual void MaskAll();
+
+	virtual unsigned GetIRQCount() { return 16; }
 
 	/**
 	 * Read the Interrupt Service Register
@@ -0,0 +1,17 @@
+#pragma once
+
+/**
+ * Benchmark of the libk memory functions
+ *
+ * Only built with 'make MEMBENCH=1'. It compares memcpy, memmove, memset
+ * and memcmp with plain byte loops, across some sizes, and prints the
+ * results.
+ *
+ * Copyright (C) 2018 Arthur M
+ */
+
+/**
+ * Run the benchmark
+ * Needs a calibrated TSC to show the time.
+ */
+void membench();
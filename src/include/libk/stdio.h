@@ -25,6 +25,16 @@ void itoa(int num, char* str);
 /* Integer based potentiation */
 uint32_t ipow(uint32_t base, uint32_t exp);
 
+/**
+ * Format 'fmt' into 'str', writing at most 'size' bytes, including the
+ * terminating null
+ *
+ * @return the length of the full formatted string, even if it was
+ *         truncated
+ */
+int vsnprintf(char* str, size_t size, const char* fmt, va_list v);
+int snprintf(char* str, size_t size, const char* fmt, ...);
+
 void vsprintf(char* str, const char* fmt, va_list v);
 char* strcat(char* dst, const char* str);
 
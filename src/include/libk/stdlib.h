@@ -22,6 +22,14 @@ int memcmp(const void* s1, const void* s2, size_t len);
  */
 void* memcpy(void* dest, const void* src, size_t len);
 
+/**
+ * Copies 'len' bytes of 'src' to 'dest'
+ * The areas can overlap
+ *
+ * @returns a pointer to dest
+ */
+void* memmove(void* dest, const void* src, size_t len);
+
 /**
  * Fills the first 'n' bytes of 's' with byte 'c'
  *
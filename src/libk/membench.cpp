@@ -0,0 +1,127 @@
+#include <libk/membench.h>
+#include <libk/stdlib.h>
+#include <libk/stdio.h>
+#include <arch/x86/TSC.hpp>
+
+/**
+ * Benchmark of the libk memory functions
+ *
+ * Copyright (C) 2018 Arthur M
+ */
+
+#ifdef ANNOS_MEMBENCH
+
+using annos::x86::TSC;
+
+#define MEMBENCH_MAX_SIZE 16384
+#define MEMBENCH_RUNS 32
+
+static unsigned char bench_src[MEMBENCH_MAX_SIZE + 16];
+static unsigned char bench_dst[MEMBENCH_MAX_SIZE + 16];
+
+/* The reference implementations, the way libk used to do it.
+   'volatile' so the compiler can't turn them into a libk call */
+static void byte_copy(void* d, const void* s, size_t n)
+{
+    volatile unsigned char* cd = (volatile unsigned char*)d;
+    const unsigned char* cs = (const unsigned char*)s;
+    for (size_t i = 0; i < n; i++)
+	cd[i] = cs[i];
+}
+
+static void byte_set(void* d, int c, size_t n)
+{
+    volatile unsigned char* cd = (volatile unsigned char*)d;
+    for (size_t i = 0; i < n; i++)
+	cd[i] = c;
+}
+
+static void byte_cmp(const void* a, const void* b, size_t n)
+{
+    const volatile unsigned char* ca = (const volatile unsigned char*)a;
+    const unsigned char* cb = (const unsigned char*)b;
+    for (size_t i = 0; i < n; i++)
+	if (ca[i] != cb[i])
+	    return;
+}
+
+enum BenchOp { BenchCopy, BenchMove, BenchSet, BenchCmp, BenchByteCopy,
+	       BenchByteSet, BenchByteCmp };
+
+/**
+ * Run 'op' over 'len' bytes some times, starting at 'misalign' bytes
+ * from an aligned address
+ *
+ * @return the smallest cycle count, so interrupts don't count
+ */
+static uint32_t bench_run(BenchOp op, size_t len, unsigned misalign)
+{
+    unsigned char* d = bench_dst + misalign;
+    unsigned char* s = bench_src;
+    uint64_t best = ~0ull;
+
+    for (unsigned r = 0; r < MEMBENCH_RUNS; r++) {
+	uint64_t start = TSC::Read();
+
+	switch (op) {
+	case BenchCopy: memcpy(d, s, len); break;
+	case BenchMove: memmove(d + 1, d, len - 1); break;
+	case BenchSet: memset(d, 0x5a, len); break;
+	case BenchCmp: memcmp(d, s, len); break;
+	case BenchByteCopy: byte_copy(d, s, len); break;
+	case BenchByteSet: byte_set(d, 0x5a, len); break;
+	case BenchByteCmp: byte_cmp(d, s, len); break;
+	}
+
+	uint64_t c = TSC::Read() - start;
+	if (c < best)
+	    best = c;
+    }
+
+    return (uint32_t)best;
+}
+
+/**
+ * Run the benchmark
+ * Needs a calibrated TSC to show the time.
+ */
+void membench()
+{
+    static const size_t sizes[] = {8, 64, 256, 1024, 4096, MEMBENCH_MAX_SIZE};
+
+    for (size_t i = 0; i < sizeof(bench_src); i++)
+	bench_src[i] = i;
+
+    kprintf("\nmembench: best of %d runs, in cycles, for an aligned "
+	    "destination / a misaligned one. Byte loops in brackets\n",
+	    MEMBENCH_RUNS);
+
+    for (size_t s : sizes) {
+	uint32_t res[7][2];
+	for (unsigned op = 0; op < 7; op++) {
+	    for (unsigned m = 0; m < 2; m++) {
+		// memcmp over equal buffers, so it goes until the end
+		if (op == BenchCmp || op == BenchByteCmp)
+		    memcpy(bench_dst + m, bench_src, s);
+
+		res[op][m] = bench_run((BenchOp)op, s, m);
+	    }
+	}
+
+	kprintf("%d bytes: memcpy %d/%d (%d/%d), memset %d/%d (%d/%d), "
+		"memcmp %d/%d (%d/%d), memmove %d/%d\n", s,
+		res[BenchCopy][0], res[BenchCopy][1],
+		res[BenchByteCopy][0], res[BenchByteCopy][1],
+		res[BenchSet][0], res[BenchSet][1],
+		res[BenchByteSet][0], res[BenchByteSet][1],
+		res[BenchCmp][0], res[BenchCmp][1],
+		res[BenchByteCmp][0], res[BenchByteCmp][1],
+		res[BenchMove][0], res[BenchMove][1]);
+    }
+
+    if (TSC::IsCalibrated())
+	kprintf("membench: TSC runs at %d cycles per us\n",
+		TSC::GetCyclesPerMicrosecond());
+}
+
+#endif
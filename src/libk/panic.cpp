@@ -1,9 +1,13 @@
 #include <libk/panic.h>
 #include <libk/stdio.h>
+#include <Log.hpp>
 
 void _assert(int expr, const char* file, int line)
 {
     if (!expr) {
+	// The UART only writes synchronously with interrupts disabled
+	asm volatile("cli" ::: "memory");
+	annos::Log::Flush();
 	kprintf("\n\n\033[41;37;1mAssertion failed at %s:%d.\033[0m System halted\n",
 		file, line);
 	
@@ -14,6 +18,11 @@ void _assert(int expr, const char* file, int line)
 
 void panic(const char* str)
 {
+    /* The log may have the reason of the panic, and nobody else will drain
+       it. Disable interrupts first, so the UART writes it all now instead
+       of waiting for an interrupt that will never come */
+    asm volatile("cli" ::: "memory");
+    annos::Log::Flush();
     kprintf("\n\033[41;37;1mpanic:\033[0m %s\n", str);
     asm volatile("cli; hlt");
 }
@@ -50,33 +50,30 @@ uint32_t ipow(uint32_t base, uint32_t exp)
 
 
 
-inline void _inttostr(uint64_t num, int base, char* retchar, int padding=0,
-    char padchar=' ')
+/**
+ * Write the digits of 'num' in base 'base' backwards, ending just before
+ * 'end', so the number doesn't need to be reversed
+ *
+ * @return a pointer to the first digit
+ */
+static char* _uinttostr_end(uint64_t num, unsigned base, char* end,
+			    bool upper = false)
 {
-    static const char* table = "0123456789abcdefghijklmnopqrstuvwxyz";
-
-    char str[64];
-    char revstr[64];
-        
-    auto i = 0;
-    while (num >= (unsigned)base) {
-	auto idx = num % base;
-	str[i++] = table[idx];
+    const char* table = (upper) ? "0123456789ABCDEF" : "0123456789abcdef";
+
+    // Most numbers fit in 32 bits, and their division is much cheaper
+    while (num > 0xffffffff) {
+	*--end = table[num % base];
 	num /= base;
     }
-    str[i++] = table[num];
-    str[i] = '\0';
-    
-    for (size_t p = i; p < (size_t)padding; p++) {
-	str[p] = padchar;
 
-	if (p == ((size_t)padding-1))
-	    str[p+1] = '\0';
-    }
-    
-    
-    strrev(revstr, str);
-    strncpy(retchar, revstr, strlen(str)+1);
+    uint32_t n32 = (uint32_t)num;
+    do {
+	*--end = table[n32 % base];
+	n32 /= base;
+    } while (n32);
+
+    return end;
 }
 
 inline uint64_t _strtoint(const char* str, int base)
@@ -118,129 +115,268 @@ long atol(const char* str)
 
 void itoa(int num, char* str)
 {
-    _inttostr((uint64_t)num, 10, str);
+    snprintf(str, 12, "%d", num);
+}
+
+/* The output cursor of vsnprintf
+   It counts everything, even what doesn't fit, so we can return the
+   length the full string would have */
+struct PrintCursor {
+    char* str;
+    size_t cap; // Space for characters, without the terminator
+    size_t pos;
+
+    inline void Put(char c) {
+	if (pos < cap)
+	    str[pos] = c;
+	pos++;
+    }
+
+    void Repeat(char c, int count) {
+	for (; count > 0; count--)
+	    this->Put(c);
+    }
+
+    void Write(const char* s, size_t len) {
+	if (pos < cap) {
+	    size_t fit = (len < cap - pos) ? len : cap - pos;
+	    memcpy(&str[pos], s, fit);
+	}
+	pos += len;
+    }
+};
+
+// vsnprintf conversion flags
+#define PRINT_LEFT 0x1 // '-', pad on the right
+#define PRINT_ZERO 0x2 // '0', pad with zeros
+#define PRINT_PLUS 0x4 // '+', always show the sign
+#define PRINT_ALT 0x8  // '#', prefix hex numbers with 0x
+
+/**
+ * Write a number, with its sign, prefix and padding
+ * 'precision' is the minimum number of digits, or -1
+ */
+static void _print_number(PrintCursor& c, uint64_t num, bool negative,
+			  unsigned base, bool upper, unsigned flags, int width,
+			  int precision)
+{
+    char buf[24];
+    char* end = &buf[sizeof(buf)];
+    char* digits = _uinttostr_end(num, base, end, upper);
+    int len = end - digits;
+
+    // With a precision, the '0' flag is ignored, and a zero with
+    // precision 0 has no digits
+    int zeros = 0;
+    if (precision >= 0) {
+	flags &= ~PRINT_ZERO;
+	if (num == 0 && precision == 0)
+	    len = 0;
+	if (precision > len)
+	    zeros = precision - len;
+    }
+
+    char prefix[3];
+    int plen = 0;
+    if (negative)
+	prefix[plen++] = '-';
+    else if (flags & PRINT_PLUS)
+	prefix[plen++] = '+';
+
+    if ((flags & PRINT_ALT) && base == 16) {
+	prefix[plen++] = '0';
+	prefix[plen++] = (upper) ? 'X' : 'x';
+    }
+
+    int pad = width - zeros - len - plen;
+
+    if (!(flags & (PRINT_LEFT | PRINT_ZERO)))
+	c.Repeat(' ', pad);
+
+    c.Write(prefix, plen);
+
+    if (!(flags & PRINT_LEFT) && (flags & PRINT_ZERO))
+	c.Repeat('0', pad);
+
+    c.Repeat('0', zeros);
+    c.Write(digits, len);
+
+    if (flags & PRINT_LEFT)
+	c.Repeat(' ', pad);
 }
 
-void vsprintf(char* str, const char* fmt, va_list vl) {
+/**
+ * Format 'fmt' into 'str', writing at most 'size' bytes, including the
+ * terminating null
+ *
+ * Supports the d, i, u, x, X, o, p, s, c and % conversions, the
+ * '-', '0', '+' and '#' flags, field widths and precisions (also as '*'),
+ * and the h, l and ll length modifiers.
+ * The precision is the minimum number of digits for the integers, and
+ * the maximum length for '%s'.
+ *
+ * @return the length of the full formatted string, even if it was
+ *         truncated
+ */
+int vsnprintf(char* str, size_t size, const char* fmt, va_list vl)
+{
+    PrintCursor c = {str, (size > 0) ? size - 1 : 0, 0};
+
     while (*fmt) {
-        if (*fmt == '%') {
-            fmt++;
-            unsigned padding = 0;
-            char padchar = ' ';
-            char padstr[8];
-            int padstrptr = 0;
-            /* detect padding specifiers */
-            while ( (fmt[padstrptr] >= '0' &&
-                     fmt[padstrptr] <= '9') ) {
-                    if (padstrptr == 0 && fmt[padstrptr] == '0')
-                    {
-                        padchar = '0';
-                        fmt++;
-                        continue;
-                    }
-                    padstr[padstrptr] = fmt[padstrptr];
-                    padstrptr++;
-
-            }
-
-            if (padstrptr > 0) {
-                padstr[padstrptr] = 0;
-                padding = atoi(padstr);
-                fmt += padstrptr;
-            }
-
-            //tokens
-            switch (*fmt) {
-                //literal %
-                case '%':
-                    *str = '%';
-                    break;
-
-                //signed integer
-                case 'd': {
-                    char num[16];
-                    int32_t i = va_arg(vl, int32_t);
-                    if (padding > 0)
-			_inttostr(i, 10, num, padding, padchar);
-                    else
-			_inttostr(i, 10, num);
-                    *str = 0;
-                    str = strcat(str, num);
-                    str++;
-
-                }
-                    break;
-
-                    //unsigned integer
-                case 'u': {
-                    char num[16];
-                    int32_t i = va_arg(vl, int32_t);
-                    if (padding > 0)
-			_inttostr((i & 0x7fffffff), 10, num, padding, padchar);
-                    else
-                        _inttostr((i & 0x7fffffff), 10, num);
-                    *str = 0;
-		    if (i < 0)
-			str = strcat(str, "-");
-		    
-                    str = strcat(str, num);
-                    str++;
-
-                }
-                break;
-
-                //hex
-                case 'x': {
-                    char num[8];
-                    uint32_t i = va_arg(vl, uint32_t);
-                    if (padding > 0)
-			_inttostr(i, 16, num, padding, padchar);
-                    else
-                        _inttostr(i, 16, num);
-                    *str = 0;
-                    str = strcat(str, num);
-                    str++;
-                }
-                    break;
-
-                //string
-                case 's': {
-                    char* s = va_arg(vl, char*);
-                    *str = 0;
-                    str = strcat(str, s);
-                    int truepad = padding-strlen(s);
-                    if (truepad > 0) {
-                        for (int i = 0; i < truepad; i++) {
-                            str++;
-                            *str = ' ';
-
-                        }
-                        str++;
-                        *str = 0;
-                        str--;
-                    }
-                    str++;
-
-                }
-                    break;
-
-                //char
-                case 'c': {
-                    char c = va_arg(vl, int);
-                    str++;
-                    *str = c;
-                }
-                    break;
-            }
-
-        } else {
-            *str = *fmt;
-            str++;
-        }
-        fmt++;
+	if (*fmt != '%') {
+	    // Copy the literal text up to the next conversion at once
+	    const char* start = fmt;
+	    while (*fmt && *fmt != '%')
+		fmt++;
+
+	    c.Write(start, fmt - start);
+	    continue;
+	}
+
+	fmt++;
+
+	unsigned flags = 0;
+	for (;; fmt++) {
+	    if (*fmt == '-') flags |= PRINT_LEFT;
+	    else if (*fmt == '0') flags |= PRINT_ZERO;
+	    else if (*fmt == '+') flags |= PRINT_PLUS;
+	    else if (*fmt == '#') flags |= PRINT_ALT;
+	    else break;
+	}
+
+	int width = 0;
+	if (*fmt == '*') {
+	    width = va_arg(vl, int);
+	    if (width < 0) {
+		flags |= PRINT_LEFT;
+		width = -width;
+	    }
+	    fmt++;
+	} else {
+	    while (*fmt >= '0' && *fmt <= '9')
+		width = width * 10 + (*fmt++ - '0');
+	}
+
+	int precision = -1;
+	if (*fmt == '.') {
+	    fmt++;
+	    precision = 0;
+	    if (*fmt == '*') {
+		precision = va_arg(vl, int);
+		fmt++;
+	    } else {
+		while (*fmt >= '0' && *fmt <= '9')
+		    precision = precision * 10 + (*fmt++ - '0');
+	    }
+	}
+
+	// 'l' is 32-bit here, the same as int; only 'll' changes the size
+	unsigned longs = 0;
+	while (*fmt == 'l' || *fmt == 'h' || *fmt == 'z') {
+	    if (*fmt == 'l')
+		longs++;
+	    fmt++;
+	}
+
+	char conv = *fmt;
+	if (!conv)
+	    break;
+	fmt++;
+
+	switch (conv) {
+	case '%':
+	    c.Put('%');
+	    break;
+
+	case 'd':
+	case 'i': {
+	    int64_t v = (longs >= 2) ? va_arg(vl, long long) : va_arg(vl, int);
+	    bool neg = (v < 0);
+	    uint64_t uv = (neg) ? -(uint64_t)v : (uint64_t)v;
+	    _print_number(c, uv, neg, 10, false, flags, width, precision);
+	    break;
+	}
+
+	case 'u':
+	case 'x':
+	case 'X':
+	case 'o': {
+	    uint64_t v = (longs >= 2) ? va_arg(vl, unsigned long long) :
+		va_arg(vl, unsigned);
+	    unsigned base = (conv == 'u') ? 10 : (conv == 'o') ? 8 : 16;
+	    _print_number(c, v, false, base, conv == 'X', flags, width,
+			  precision);
+	    break;
+	}
+
+	case 'p': {
+	    uintptr_t v = (uintptr_t)va_arg(vl, void*);
+	    _print_number(c, v, false, 16, false, flags | PRINT_ALT | PRINT_ZERO,
+			  2 + sizeof(uintptr_t) * 2, -1);
+	    break;
+	}
+
+	case 's': {
+	    const char* s = va_arg(vl, const char*);
+	    if (!s)
+		s = "(null)";
+
+	    size_t len = 0;
+	    while (s[len] && (precision < 0 || len < (size_t)precision))
+		len++;
+
+	    int pad = width - (int)len;
+	    if (!(flags & PRINT_LEFT))
+		c.Repeat(' ', pad);
+
+	    c.Write(s, len);
+
+	    if (flags & PRINT_LEFT)
+		c.Repeat(' ', pad);
+	    break;
+	}
+
+	case 'c': {
+	    if (!(flags & PRINT_LEFT))
+		c.Repeat(' ', width - 1);
+
+	    c.Put((char)va_arg(vl, int));
+
+	    if (flags & PRINT_LEFT)
+		c.Repeat(' ', width - 1);
+	    break;
+	}
+
+	default:
+	    // Unknown conversion. Print it, so the mistake is visible
+	    c.Put('%');
+	    c.Put(conv);
+	    break;
+	}
     }
-    *str++ = 0;
-    *str = 0;
+
+    if (size > 0)
+	str[(c.pos < c.cap) ? c.pos : c.cap] = '\0';
+
+    return (int)c.pos;
+}
+
+int snprintf(char* str, size_t size, const char* fmt, ...)
+{
+    va_list vl;
+    va_start(vl, fmt);
+    int r = vsnprintf(str, size, fmt, vl);
+    va_end(vl);
+    return r;
+}
+
+/**
+ * Format without a bound
+ * Prefer vsnprintf, this is kept for the old callers.
+ */
+void vsprintf(char* str, const char* fmt, va_list vl)
+{
+    vsnprintf(str, SIZE_MAX, fmt, vl);
 }
 
 char* strcat(char* dst, const char* str)
@@ -7,6 +7,9 @@
 
 static annos::Console* cons = NULL;
 
+// Longer kprintf lines are truncated
+#define KPRINTF_MAX 512
+
 void init_stdio(annos::Console* c)
 {
     cons = c;
@@ -19,10 +22,10 @@ void kputs(const char* s)
 
 void kprintf(const char* format, ...)
 {
-    char str[256+strlen(format)];
+    char str[KPRINTF_MAX];
     va_list vl;
     va_start(vl, format);
-    vsprintf(str, format, vl);
+    vsnprintf(str, sizeof(str), format, vl);
     va_end(vl);
     kputs(str);
 }
@@ -1,5 +1,21 @@
 #include <libk/stdlib.h>
+#include <stdint.h>
 
+/*
+  The memory functions use the x86 string instructions. 'rep movsl' and
+  'rep stosd' move 4 bytes per iteration, and the newer processors
+  optimize them to move whole cache lines.
+
+  We don't use SSE here: the interrupt entry doesn't save the XMM
+  registers, so a memcpy interrupted by an IRQ handler that also uses
+  them would be corrupted.
+ */
+
+// Below this, the setup of the string instructions costs more than it saves
+#define MEM_SMALL_SIZE 16
+
+// A 32-bit word that can alias any other type
+typedef uint32_t __attribute__((__may_alias__)) alias_uint32_t;
 
 /**
  * Compares 'len' bytes of s1 and s2 and see if they are equal
@@ -8,13 +24,20 @@
  */
 int memcmp(const void* s1, const void* s2, size_t len)
 {
-    const char* cs1 = (const char*)s1;
-    const char* cs2 = (const char*)s2;
+    const unsigned char* cs1 = (const unsigned char*)s1;
+    const unsigned char* cs2 = (const unsigned char*)s2;
+
+    // Skip the equal words fast. The different byte is found below
+    while (len >= 4 &&
+	   *(const alias_uint32_t*)cs1 == *(const alias_uint32_t*)cs2) {
+	cs1 += 4;
+	cs2 += 4;
+	len -= 4;
+    }
+
     for (size_t i = 0; i < len; i++) {
-	if (cs1[i] != cs2[i]) {
-	    if (cs1[i] < cs2[i]) return -1;
-	    if (cs1[i] > cs2[i]) return 1;
-	}
+	if (cs1[i] != cs2[i])
+	    return (cs1[i] < cs2[i]) ? -1 : 1;
     }
 
     return 0;
@@ -27,10 +50,64 @@ int memcmp(const void* s1, const void* s2, size_t len)
  */
 void* memcpy(void* dest, const void* src, size_t len)
 {
-    char* cdest = (char*)dest;
-    const char* csrc = (const char*)src;
-    for (auto i = 0; i < len; i++)
-	cdest[i] = csrc[i];
+    void* d = dest;
+    const void* s = src;
+
+    if (len >= MEM_SMALL_SIZE) {
+	// Align the destination, so the word stores don't cross lines
+	size_t head = (-(uintptr_t)d) & 3;
+	size_t words = (len - head) >> 2;
+	len = (len - head) & 3;
+
+	asm volatile("rep movsb\n\t"
+		     "mov %3, %%ecx\n\t"
+		     "rep movsl"
+		     : "+D"(d), "+S"(s), "+c"(head)
+		     : "r"(words)
+		     : "memory");
+    }
+
+    asm volatile("rep movsb"
+		 : "+D"(d), "+S"(s), "+c"(len)
+		 :: "memory");
+
+    return dest;
+}
+
+/**
+ * Copies 'len' bytes of 'src' to 'dest'
+ * The areas can overlap
+ *
+ * @returns a pointer to dest
+ */
+void* memmove(void* dest, const void* src, size_t len)
+{
+    uintptr_t d = (uintptr_t)dest;
+    uintptr_t s = (uintptr_t)src;
+
+    // A forward copy is only wrong if 'dest' starts inside 'src'
+    if (d <= s || d >= s + len)
+	return memcpy(dest, src, len);
+
+    /* Copy backwards, from the last byte. The odd bytes go first, so
+       the rest is a whole number of words
+       The interrupt and fault entries clear DF, so an IRQ in the middle
+       of this doesn't see it set */
+    void* dp = (void*)(d + len - 1);
+    const void* sp = (const void*)(s + len - 1);
+    size_t tail = len & 3;
+    size_t words = len >> 2;
+
+    asm volatile("std\n\t"
+		 "rep movsb\n\t"
+		 "sub $3, %%edi\n\t"
+		 "sub $3, %%esi\n\t"
+		 "mov %3, %%ecx\n\t"
+		 "rep movsl\n\t"
+		 "cld"
+		 : "+D"(dp), "+S"(sp), "+c"(tail)
+		 : "r"(words)
+		 : "memory");
 
     return dest;
 }
@@ -42,9 +119,26 @@ void* memcpy(void* dest, const void* src, size_t len)
  */
 void* memset(void* s, unsigned char c, size_t n)
 {
-    char* cs = (char*)s;
-    for (size_t i = 0; i < n; i++)
-	cs[i] = c;
+    void* d = s;
+
+    if (n >= MEM_SMALL_SIZE) {
+	uint32_t pattern = c * 0x01010101u;
+	size_t head = (-(uintptr_t)d) & 3;
+	size_t words = (n - head) >> 2;
+	n = (n - head) & 3;
+
+	asm volatile("rep stosb\n\t"
+		     "mov %2, %%ecx\n\t"
+		     "rep stosl"
+		     : "+D"(d), "+c"(head)
+		     : "r"(words), "a"(pattern)
+		     : "memory");
+    }
+
+    asm volatile("rep stosb"
+		 : "+D"(d), "+c"(n)
+		 : "a"(c)
+		 : "memory");
 
     return s;
 }
@@ -1,21 +1,29 @@
 #include <VGAConsole.hpp>
+#include <FramebufferConsole.hpp>
 #include <DebugConsole.hpp>
 #include <Log.hpp>
 #include <PMM.hpp>
 #include <arch/x86/IO.hpp>
 #include <arch/x86/IDT.hpp>
 #include <arch/x86/PIT.hpp>
+#include <arch/x86/TSC.hpp>
 #include <arch/x86/VMM.hpp>
 #include <arch/x86/i8259.hpp>
+#include <arch/x86/ACPI.hpp>
+#include <arch/x86/APIC.hpp>
 #include <arch/x86/FaultHandler.hpp>
 #include <arch/x86/IRQHandler.hpp>
 #include <arch/x86/SMBIOS.hpp>
 #include <arch/x86/PS2.hpp>
+#include <arch/x86/SMP.hpp>
 #include <PCIBus.hpp>
+#include <WorkQueue.hpp>
+#include <DeviceInit.hpp>
 
 #include <libk/stdio.h>
 #include <libk/stdlib.h>
 #include <libk/panic.h>
+#include <libk/membench.h>
 
 using namespace annos;
 
@@ -25,6 +33,33 @@ extern "C" void __cxa_pure_virtual()
 }
 
 
+/* Dump the IRQ statistics every 10 seconds */
+static void DumpIRQStats(WorkItem* w, void* data)
+{
+    (void)w;
+    (void)data;
+    ::x86::IRQHandler::DumpStats();
+}
+
+static TimerEvent irqstats_ev;
+static WorkItem irqstats_work(&DumpIRQStats);
+
+static void OnIRQStatsEvent(TimerEvent* ev, void* data)
+{
+    (void)ev;
+    (void)data;
+    WorkQueue::Queue(&irqstats_work);
+}
+
+/* Only take the PS/2 IRQs after the controller is set up */
+static void OnPS2Ready(DeviceInitTask* t, void* data)
+{
+    (void)data;
+    auto ps2 = (::x86::PS2*)t->dev;
+    ::x86::IRQHandler::SetHandler(1, ps2);
+    ::x86::IRQHandler::SetHandler(12, ps2);
+}
+
 /**
  * Boot structure
  */
@@ -90,8 +125,61 @@ struct MultibootBIF {
     // Memory map information
     uint32_t mmap_length;
     uint32_t mmap_addr;
+
+    uint32_t drives_length, drives_addr;
+    uint32_t config_table;
+    uint32_t boot_loader_name;
+    uint32_t apm_table;
+
+    // VBE information
+    uint32_t vbe_control_info, vbe_mode_info;
+    uint16_t vbe_mode;
+    uint16_t vbe_interface_seg, vbe_interface_off, vbe_interface_len;
+
+    // Framebuffer information, valid if the flag 12 is set
+    uint64_t framebuffer_addr;
+    uint32_t framebuffer_pitch;
+    uint32_t framebuffer_width, framebuffer_height;
+    uint8_t framebuffer_bpp;
+    uint8_t framebuffer_type; // 0 = indexed, 1 = RGB, 2 = EGA text
+    uint8_t red_pos, red_size;
+    uint8_t green_pos, green_size;
+    uint8_t blue_pos, blue_size;
+} __attribute__((packed));
+
+static_assert(offsetof(MultibootBIF, framebuffer_addr) == 88,
+	      "the multiboot information layout is wrong");
+
+/* A multiboot module */
+struct MultibootModule {
+    uint32_t mod_start, mod_end;
+    uint32_t string;
+    uint32_t reserved;
 };
 
+/**
+ * Look for a PSF font in the 'count' boot modules of 'mods'
+ */
+static bool FindModuleFont(const MultibootModule* mods, unsigned count,
+			   FBFont& font)
+{
+    for (unsigned i = 0; i < count; i++) {
+	size_t len = mods[i].mod_end - mods[i].mod_start;
+	size_t off = mods[i].mod_start & 0xfff;
+	size_t pages = (off + len + VMM_PAGE_SIZE - 1) / VMM_PAGE_SIZE;
+
+	auto data = ::x86::VMM::MapMMIO(mods[i].mod_start & ~0xfff, pages,
+					::x86::VMMFlags::ReadOnly);
+	if (FramebufferConsole::LoadPSF((void*)(data + off), len, font)) {
+	    LOG(Info, "fbcon", "using the %dx%d font of module %d",
+		font.width, font.height, i);
+	    return true;
+	}
+    }
+
+    return false;
+}
+
 
 /**
  * The kernel entry point
@@ -109,11 +197,17 @@ void kernel_main(BootStruct* bs) {
     Log::Init(&dc);
 
     if (bs->magic != 0x2badb002) {
-	Log::Write(LogLevel::Error, "boot",
-		   "Multiboot magic number is wrong: 0x%08x != 0x2badb002",
-		   bs->magic);
+	LOG(LogLevel::Error, "boot",
+	    "Multiboot magic number is wrong: 0x%08x != 0x2badb002",
+	    bs->magic);
 	panic("invalid boot magic number");
     }
+
+    /* Read the log options before anything else logs. The boot
+       information is still identity mapped here */
+    MultibootBIF* bif = (MultibootBIF*)bs->multiboot_phys_ptr;
+    if (bif->flags & 0x4)
+	Log::ParseCommandLine((const char*)bif->cmdline);
     
     kprintf("\n\n Kernel starts at 0x%x, ends at 0x%x\n",
 	    bs->phys_kernel_start, bs->phys_kernel_end);
@@ -125,6 +219,11 @@ void kernel_main(BootStruct* bs) {
     idt.Register();
     kprintf("...idt ");
 
+    if (::x86::TSC::Calibrate()) {
+	Timer::SetClockSource(&::x86::TSC::GetNs);
+	kprintf("...tsc ");
+    }
+
     ::x86::i8259 oi8259;
     oi8259.Initialize();
     kprintf("...%s ", oi8259.GetTag());
@@ -140,7 +239,6 @@ void kernel_main(BootStruct* bs) {
     kprintf("\n Magic value is 0x%08x, multiboot is at address 0x%x\n",
 	    bs->magic, bs->multiboot_phys_ptr);
 
-    MultibootBIF* bif = (MultibootBIF*)bs->multiboot_phys_ptr;
     kprintf("\t-> Bootloader flags: \033[1m0x%08x\033[0m\n", bif->flags);
     kprintf("\t-> Memory total: \033[1m%d kB\033[0m\n",
 	    bif->mem_lower+bif->mem_upper);
@@ -156,8 +254,8 @@ void kernel_main(BootStruct* bs) {
 	    
 
     MultibootMmap* mb_mmap = (MultibootMmap*)bif->mmap_addr;
-    Log::Write(Info, "mmap", "mmap entries are %d bytes",
-	       mb_mmap->size);
+    LOG(Info, "mmap", "mmap entries are %d bytes",
+	mb_mmap->size);
 
     /* Create a PMM-compatible memory map, so we can add it in the PMM */
     
@@ -172,6 +270,24 @@ void kernel_main(BootStruct* bs) {
 		   .type = (int)mtype};
     }
 
+    /* The VMM unmaps the low memory where the bootloader usually puts
+       the boot information, so copy what we need after it */
+    bool has_fb = (bif->flags & (1 << 12)) && bif->framebuffer_type == 1;
+    FBInfo fbi = {
+	.phys = bif->framebuffer_addr,
+	.pitch = bif->framebuffer_pitch,
+	.width = bif->framebuffer_width,
+	.height = bif->framebuffer_height,
+	.bpp = bif->framebuffer_bpp,
+	.red_pos = bif->red_pos, .red_size = bif->red_size,
+	.green_pos = bif->green_pos, .green_size = bif->green_size,
+	.blue_pos = bif->blue_pos, .blue_size = bif->blue_size,
+    };
+
+    unsigned modcount = (bif->flags & (1 << 3)) ? bif->mods_count : 0;
+    MultibootModule mods[modcount];
+    memcpy(mods, (void*)bif->mods_addr, sizeof(mods));
+
     PMM pmm = PMM(bs->phys_kernel_start, bs->phys_virt_offset,
 		  (void*)(bs->phys_kernel_end + bs->phys_virt_offset),
 		  mmap, entcount);
@@ -180,32 +296,87 @@ void kernel_main(BootStruct* bs) {
     ::x86::VMM::Init(&pmm, bs->phys_cr3_addr,
 		     bs->phys_kernel_start + bs->phys_virt_offset,
 		     bs->phys_kernel_end + bs->phys_virt_offset);
+
+    /* If the bootloader gave us a graphics mode, the VGA text memory isn't
+       on the screen anymore */
+    FramebufferConsole fbcon;
+    if (has_fb) {
+	static FBFont font;
+	const FBFont* pfont = &fb_builtin_font;
+	if (FindModuleFont(mods, modcount, font))
+	    pfont = &font;
+
+	if (fbcon.Init(fbi, pfont)) {
+	    init_stdio(&fbcon);
+	    kprintf("annos v0.1.0, on a %dx%d framebuffer\n",
+		    fbi.width, fbi.height);
+	} else {
+	    LOG(Warning, "fbcon", "can't use the %dx%d %d bpp framebuffer",
+		fbi.width, fbi.height, fbi.bpp);
+	}
+    }
+
+    if (::x86::ACPI::Init())
+	kprintf(" ...acpi");
+
+    // Prefer the APIC, if we have one
+    ::x86::APIC apic;
+    bool has_apic = apic.Detect();
+    if (has_apic) {
+	apic.Initialize();
+	::x86::IRQHandler::SetController(&apic);
+	kprintf(" ...%s", apic.GetTag());
+    }
     
     ::x86::PIT p;
     p.Initialize();
     ::x86::IRQHandler::SetHandler(0, &p);
 
+    // From now on, the log goes out through the UART interrupt
+    ::x86::IRQHandler::SetHandler(4, dc.GetUART());
+    dc.GetUART()->EnableIRQ();
+
+    // With a good clock source, we don't need to interrupt every tick
+    if (Timer::SetTickless(true))
+	kprintf(" ...tickless");
+
+    Timer::SchedulePeriodic(&irqstats_ev, 10000, &OnIRQStatsEvent);
 
+    // Start the other processors. They wait in their idle loops
+    if (has_apic)
+	kprintf(" ...smp (%d cpus)", ::x86::SMP::Init(&apic, &idt));
+
+    /* The other devices initialize as deferred tasks. We only wait for
+       the ones the rest of the boot needs; the others finish in the
+       idle loop */
     ::x86::SMBios b;
-    if (b.Detect()) {
-	kprintf(" ...smbios");
-	b.Initialize();
-    }
+    DeviceInitTask smbios_init(&b, false);
+    DeviceInit::Add(&smbios_init);
 
-    kprintf(" ...pcibus");
     PCIBus pcibus;
-    pcibus.Initialize();
+    DeviceInitTask pcibus_init(&pcibus, true);
+    DeviceInit::Add(&pcibus_init);
 
-    kprintf(" ...ps2");
+    /* The firmware might be emulating the PS/2 controller through an USB
+       controller, so touch it only after the PCI devices are known */
     ::x86::PS2 ps2;
-    ps2.Initialize();
-    ::x86::IRQHandler::SetHandler(1, &ps2);
-    ::x86::IRQHandler::SetHandler(12, &ps2);
-    
-    
+    DeviceInitTask ps2_init(&ps2, false, &OnPS2Ready);
+    ps2_init.DependsOn(&pcibus_init);
+    DeviceInit::Add(&ps2_init);
+
+    DeviceInit::WaitRequired();
+    kprintf(" ...pcibus");
+
+#ifdef ANNOS_MEMBENCH
+    membench();
+#endif
+
     kprintf("\n\n\033[32mSystem loaded\033[0m\n");
+
+    // The idle loop. Run the deferred work, and sleep when there's none
     for (;;) {
-	asm volatile("hlt");
+	WorkQueue::Run();
+	WorkQueue::WaitForWork();
     }
 
 